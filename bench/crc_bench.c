@@ -0,0 +1,74 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench/crc_bench.c -o crc_bench
+// Self-tests every CRC32 kernel of vsfs_crc.h against the reference crc32() and
+// reports throughput per kernel.  Usage: crc_bench [--size <bytes>] [--seconds <s>]
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../vsfs_crc.h"
+
+// ====================================CRC32====================================
+// reference implementation, identical to the one in mkfs_builder.c / mkfs_adder.c
+uint32_t CRC32_TAB[256];
+void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+// ====================================CRC32====================================
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = 4096;
+    double seconds = 0.5;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) size = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) seconds = strtod(argv[++i], NULL);
+        else { fprintf(stderr, "Usage: %s [--size <bytes>] [--seconds <s>]\n", argv[0]); return 1; }
+    }
+    if (size == 0) size = 1;
+
+    crc32_init();
+    vsfs_crc_init();
+
+    int bad = vsfs_crc_selftest(crc32);
+    printf("selftest: %s (active kernel: %s)\n", bad == 0 ? "ok" : "FAILED", vsfs_crc_active_name);
+    if (bad != 0) return 1;
+
+    uint8_t *buf = malloc(size);
+    if (!buf) { perror("malloc"); return 1; }
+    for (size_t i = 0; i < size; i++) buf[i] = (uint8_t)(i * 131u + 7u);
+    uint32_t want = crc32(buf, size);
+
+    printf("%-10s %12s %10s\n", "kernel", "bytes/call", "GB/s");
+    for (size_t k = 0; k < VSFS_CRC_NKERNELS; k++) {
+        if (!vsfs_crc_kernels[k].available) continue;
+        vsfs_crc_kernel_fn fn = vsfs_crc_kernels[k].fn;
+        uint64_t calls = 0;
+        volatile uint32_t sink = 0; // keeps the calls from being optimized away
+        double t0 = now_sec(), t1;
+        do {
+            for (int r = 0; r < 64; r++) sink ^= fn(0xFFFFFFFFu, buf, size);
+            calls += 64;
+            t1 = now_sec();
+        } while (t1 - t0 < seconds);
+        if ((fn(0xFFFFFFFFu, buf, size) ^ 0xFFFFFFFFu) != want) { fprintf(stderr, "%s: mismatch\n", vsfs_crc_kernels[k].name); return 1; }
+        printf("%-10s %12zu %10.2f\n", vsfs_crc_kernels[k].name, size, (double)calls * (double)size / (t1 - t0) / 1e9);
+    }
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,324 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench/vsfs_bench.c -o vsfs_bench -lm
+// Generates a seeded synthetic workload and drives mkfs_builder / mkfs_adder over
+// it, printing one JSON object with throughput, latency percentiles, peak RSS and
+// bytes written.  The same --seed always produces the same files, sizes and
+// pre-fill pattern, so runs are comparable across builds and machines.
+//
+// Usage: vsfs_bench [--builder <path>] [--adder <path>] [--workdir <dir>] [--keep]
+//                   [--seed <n>] [--files <n>] [--dist <spec>] [--size-kib <KiB>]
+//                   [--inodes <n>] [--mode add|from-dir] [--batch <n>]
+//                   [--prefill <pct>] [--frag-run <blocks>] [--adder-arg <arg>]...
+//   --dist  fixed:<bytes> | uniform:<min>:<max> | lognormal:<median>:<sigma>
+//   --mode  add       build an empty image, then add the files --batch at a time
+//           from-dir  build the populated image in one mkfs_builder --from-dir run
+//   --prefill marks <pct>% of the data region allocated in runs of 1..--frag-run
+//           blocks before adding, to measure allocation on a fragmented image
+// The tools run with VSFS_IO_ENGINE=threads (sync is kept if set), since io_uring
+// writes do not show up in the wchar count that bytes_written is read from.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../vsfs_crc.h"
+#include "../vsfs_format.h"
+
+#define BS 4096u
+#define MAX_ARGS 64
+
+// splitmix64: small, seedable, identical on every platform
+static uint64_t rng_state;
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+static double rng_unit(void) { return (double)(rng_next() >> 11) / 9007199254740992.0; } // [0, 1)
+static uint64_t rng_range(uint64_t lo, uint64_t hi) { return lo + rng_next() % (hi - lo + 1); } // [lo, hi]
+
+typedef enum { DIST_FIXED, DIST_UNIFORM, DIST_LOGNORMAL } dist_kind_t;
+typedef struct {
+    dist_kind_t kind;
+    double a, b;
+} dist_t;
+
+static int parse_dist(const char *s, dist_t *d) {
+    if (sscanf(s, "fixed:%lf", &d->a) == 1) { d->kind = DIST_FIXED; return 0; }
+    if (sscanf(s, "uniform:%lf:%lf", &d->a, &d->b) == 2 && d->a <= d->b) { d->kind = DIST_UNIFORM; return 0; }
+    if (sscanf(s, "lognormal:%lf:%lf", &d->a, &d->b) == 2 && d->a > 0) { d->kind = DIST_LOGNORMAL; return 0; }
+    return -1;
+}
+
+static uint64_t dist_sample(const dist_t *d) {
+    switch (d->kind) {
+    case DIST_FIXED: return (uint64_t)d->a;
+    case DIST_UNIFORM: return rng_range((uint64_t)d->a, (uint64_t)d->b);
+    case DIST_LOGNORMAL: {
+        double u1 = rng_unit(), u2 = rng_unit();
+        double z = sqrt(-2.0 * log(1.0 - u1)) * cos(2.0 * M_PI * u2); // Box-Muller
+        return (uint64_t)(d->a * exp(d->b * z));
+    }
+    }
+    return 0;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    double wall;          // seconds
+    long maxrss_kib;      // peak RSS of the child
+    uint64_t wchar;       // bytes the child passed to write-type syscalls
+    uint64_t oublock;     // bytes the child wrote through to the block layer
+} run_stats_t;
+
+// bytes written by a child that has exited but not been reaped yet; counts
+// pwrite and friends only, hence the engine pinned in main
+static uint64_t proc_wchar(pid_t pid) {
+    char path[64], line[128];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    uint64_t v = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "wchar: %" SCNu64, &v) == 1) break;
+    }
+    fclose(f);
+    return v;
+}
+
+// runs argv with stdout/stderr discarded; returns the exit status or -1
+static int run(char *const argv[], run_stats_t *rs) {
+    double t0 = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) { dup2(null, 1); dup2(null, 2); }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    siginfo_t si;
+    while (waitid(P_PID, (id_t)pid, &si, WEXITED | WNOWAIT) != 0 && errno == EINTR) {}
+    uint64_t wchar = proc_wchar(pid);
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0) if (errno != EINTR) return -1;
+    rs->wall = now_sec() - t0;
+    rs->maxrss_kib = ru.ru_maxrss;
+    rs->wchar = wchar;
+    rs->oublock = (uint64_t)ru.ru_oublock * 512;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int write_file(const char *path, uint64_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    uint64_t buf[BS / 8];
+    while (size > 0) {
+        for (size_t i = 0; i < BS / 8; i++) buf[i] = rng_next();
+        size_t n = size < BS ? (size_t)size : BS;
+        if (write(fd, buf, n) != (ssize_t)n) { close(fd); return -1; }
+        size -= n;
+    }
+    return close(fd);
+}
+
+// marks about pct% of the data region allocated in runs of 1..max_run blocks,
+// straight in the data bitmap (bitmaps are not covered by any checksum). The
+// free-space summary in the superblock no longer matches, so it is dropped (and
+// the superblock CRC redone); the adder then counts the bitmaps on open.
+static int prefill(const char *image, double pct, uint64_t max_run, uint64_t *marked) {
+    int fd = open(image, O_RDWR);
+    if (fd < 0) return -1;
+    uint8_t sb_block[BS];
+    superblock_t sb;
+    if (pread(fd, sb_block, BS, 0) != (ssize_t)BS) { close(fd); return -1; }
+    memcpy(&sb, sb_block, sizeof(sb));
+    size_t bytes = (size_t)sb.data_bitmap_blocks * BS;
+    uint8_t *bm = malloc(bytes);
+    if (!bm || pread(fd, bm, bytes, (off_t)(sb.data_bitmap_start * BS)) != (ssize_t)bytes) { free(bm); close(fd); return -1; }
+    uint64_t used_max = (uint64_t)(2.0 * (double)max_run * pct / 100.0);
+    uint64_t free_max = (uint64_t)(2.0 * (double)max_run * (100.0 - pct) / 100.0);
+    if (used_max < 1) used_max = 1;
+    if (free_max < 1) free_max = 1;
+    *marked = 0;
+    uint64_t b = 1; // keep the root directory's block as the builder left it
+    while (b < sb.data_region_blocks) {
+        uint64_t used = rng_range(1, used_max);
+        for (uint64_t i = 0; i < used && b < sb.data_region_blocks; i++, b++) {
+            if (!(bm[b / 8] & (1u << (b % 8)))) { bm[b / 8] |= (uint8_t)(1u << (b % 8)); (*marked)++; }
+        }
+        b += rng_range(1, free_max);
+    }
+    int rc = pwrite(fd, bm, bytes, (off_t)(sb.data_bitmap_start * BS)) == (ssize_t)bytes ? 0 : -1;
+    memset(sb_block + SB_FREE_OFFSET, 0, BS - SB_FREE_OFFSET);
+    ((superblock_t *)sb_block)->checksum = 0;
+    vsfs_crc_init();
+    ((superblock_t *)sb_block)->checksum = vsfs_crc32(sb_block, BS - 4);
+    if (rc == 0 && pwrite(fd, sb_block, BS, 0) != (ssize_t)BS) rc = -1;
+    free(bm);
+    if (close(fd) != 0) rc = -1;
+    return rc;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p / 100.0 * (double)(n - 1) + 0.5);
+    return sorted[i < n ? i : n - 1];
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+int main(int argc, char *argv[]) {
+    const char *builder = "./mkfs_builder";
+    const char *adder = "./mkfs_adder";
+    const char *workdir = NULL;
+    const char *mode = "add";
+    const char *adder_args[MAX_ARGS];
+    int n_adder_args = 0;
+    int keep = 0;
+    uint64_t seed = 1, files = 1000, size_kib = 65536, inodes = 4096, batch = 1, frag_run = 8;
+    double prefill_pct = 0;
+    dist_t dist = { DIST_LOGNORMAL, 8192, 1.5 };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--builder") == 0 && i + 1 < argc) builder = argv[++i];
+        else if (strcmp(argv[i], "--adder") == 0 && i + 1 < argc) adder = argv[++i];
+        else if (strcmp(argv[i], "--workdir") == 0 && i + 1 < argc) workdir = argv[++i];
+        else if (strcmp(argv[i], "--keep") == 0) keep = 1;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--files") == 0 && i + 1 < argc) files = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--size-kib") == 0 && i + 1 < argc) size_kib = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) inodes = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) batch = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--prefill") == 0 && i + 1 < argc) prefill_pct = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "--frag-run") == 0 && i + 1 < argc) frag_run = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) mode = argv[++i];
+        else if (strcmp(argv[i], "--dist") == 0 && i + 1 < argc) {
+            if (parse_dist(argv[++i], &dist) != 0) { fprintf(stderr, "Bad --dist: %s\n", argv[i]); return 1; }
+        }
+        else if (strcmp(argv[i], "--adder-arg") == 0 && i + 1 < argc && n_adder_args < MAX_ARGS) adder_args[n_adder_args++] = argv[++i];
+        else { fprintf(stderr, "Unknown or incomplete argument: %s\n", argv[i]); return 1; }
+    }
+    int from_dir = strcmp(mode, "from-dir") == 0;
+    if (!from_dir && strcmp(mode, "add") != 0) { fprintf(stderr, "Error: --mode must be add or from-dir.\n"); return 1; }
+    if (batch < 1 || frag_run < 1 || prefill_pct < 0 || prefill_pct >= 100) { fprintf(stderr, "Error: bad --batch, --frag-run or --prefill.\n"); return 1; }
+    if (from_dir && prefill_pct > 0) { fprintf(stderr, "Error: --prefill only applies to --mode add.\n"); return 1; }
+    const char *engine = getenv("VSFS_IO_ENGINE");
+    if (!engine || strcmp(engine, "sync") != 0) setenv("VSFS_IO_ENGINE", "threads", 1);
+
+    char tmpl[] = "/tmp/vsfs_bench.XXXXXX";
+    char dir[4096];
+    if (workdir) {
+        snprintf(dir, sizeof(dir), "%s", workdir);
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) { perror(dir); return 1; }
+    } else {
+        if (!mkdtemp(tmpl)) { perror("mkdtemp"); return 1; }
+        snprintf(dir, sizeof(dir), "%s", tmpl);
+    }
+    char src[4200], image[4200];
+    snprintf(src, sizeof(src), "%s/src", dir);
+    snprintf(image, sizeof(image), "%s/bench.img", dir);
+    if (mkdir(src, 0755) != 0 && errno != EEXIST) { perror(src); return 1; }
+
+    // workload: sizes and contents both come from the seeded generator
+    rng_state = seed;
+    char **paths = calloc(files, sizeof(char *));
+    if (!paths) return 1;
+    uint64_t total_bytes = 0;
+    for (uint64_t i = 0; i < files; i++) {
+        uint64_t size = dist_sample(&dist);
+        if (asprintf(&paths[i], "%s/f%07" PRIu64, src, i) < 0) return 1;
+        if (write_file(paths[i], size) != 0) { perror(paths[i]); return 1; }
+        total_bytes += size;
+    }
+
+    int rc = 0;
+    run_stats_t build = {0};
+    char size_arg[32], inodes_arg[32], seed_arg[32];
+    snprintf(size_arg, sizeof(size_arg), "%" PRIu64, size_kib);
+    snprintf(inodes_arg, sizeof(inodes_arg), "%" PRIu64, inodes);
+    snprintf(seed_arg, sizeof(seed_arg), "%" PRIu64, seed);
+    char *bargv[] = { (char *)builder, "--image", image, "--size-kib", size_arg, "--inodes", inodes_arg,
+                      "--seed", seed_arg, from_dir ? "--from-dir" : NULL, src, NULL };
+    if (run(bargv, &build) != 0) { fprintf(stderr, "mkfs_builder failed\n"); rc = 1; goto out; }
+
+    uint64_t prefilled = 0;
+    if (prefill_pct > 0 && prefill(image, prefill_pct, frag_run, &prefilled) != 0) { perror("prefill"); rc = 1; goto out; }
+
+    uint64_t runs = from_dir ? 0 : (files + batch - 1) / batch;
+    double *lat = calloc(runs ? runs : 1, sizeof(double));
+    char **aargv = calloc(6 + (size_t)n_adder_args + 2 * batch, sizeof(char *));
+    if (!lat || !aargv) { rc = 1; free(lat); free(aargv); goto out; }
+    double add_wall = 0;
+    long add_rss = 0;
+    uint64_t add_wchar = 0, add_oublock = 0, failed = 0;
+    for (uint64_t r = 0; r < runs; r++) {
+        int k = 0;
+        aargv[k++] = (char *)adder;
+        aargv[k++] = "--input";
+        aargv[k++] = image;
+        aargv[k++] = "--in-place";
+        for (int j = 0; j < n_adder_args; j++) aargv[k++] = (char *)adder_args[j];
+        for (uint64_t f = r * batch; f < files && f < (r + 1) * batch; f++) { aargv[k++] = "--file"; aargv[k++] = paths[f]; }
+        aargv[k] = NULL;
+        run_stats_t rs = {0};
+        if (run(aargv, &rs) != 0) failed++;
+        lat[r] = rs.wall * 1000.0;
+        add_wall += rs.wall;
+        if (rs.maxrss_kib > add_rss) add_rss = rs.maxrss_kib;
+        add_wchar += rs.wchar;
+        add_oublock += rs.oublock;
+    }
+    qsort(lat, runs, sizeof(double), cmp_double);
+
+    struct stat st;
+    uint64_t image_alloc = stat(image, &st) == 0 ? (uint64_t)st.st_blocks * 512 : 0;
+    double ingest = from_dir ? build.wall : add_wall; // time spent getting the files in
+    printf("{\"mode\": \"%s\", \"seed\": %" PRIu64 ", \"files\": %" PRIu64 ", \"bytes\": %" PRIu64 ", "
+           "\"size_kib\": %" PRIu64 ", \"inodes\": %" PRIu64 ", \"batch\": %" PRIu64 ", "
+           "\"prefill_pct\": %.1f, \"prefill_blocks\": %" PRIu64 ",\n",
+           mode, seed, files, total_bytes, size_kib, inodes, batch, prefill_pct, prefilled);
+    printf(" \"build\": {\"wall_s\": %.6f, \"peak_rss_kib\": %ld, \"bytes_written\": %" PRIu64 ", \"block_bytes_written\": %" PRIu64 "},\n",
+           build.wall, build.maxrss_kib, build.wchar, build.oublock);
+    printf(" \"add\": {\"runs\": %" PRIu64 ", \"failed\": %" PRIu64 ", \"wall_s\": %.6f, \"peak_rss_kib\": %ld, "
+           "\"bytes_written\": %" PRIu64 ", \"block_bytes_written\": %" PRIu64 ", "
+           "\"latency_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}},\n",
+           runs, failed, add_wall, add_rss, add_wchar, add_oublock,
+           percentile(lat, runs, 50), percentile(lat, runs, 90), percentile(lat, runs, 99), runs ? lat[runs - 1] : 0.0);
+    printf(" \"throughput\": {\"mb_per_s\": %.3f, \"files_per_s\": %.1f}, \"image_bytes_allocated\": %" PRIu64 "}\n",
+           ingest > 0 ? (double)total_bytes / 1e6 / ingest : 0.0, ingest > 0 ? (double)files / ingest : 0.0, image_alloc);
+    if (failed) rc = 1;
+    free(lat);
+    free(aargv);
+
+out:
+    for (uint64_t i = 0; i < files; i++) free(paths[i]);
+    free(paths);
+    if (!keep && workdir) { nftw(src, rm_entry, 16, FTW_DEPTH | FTW_PHYS); remove(image); } // only what we created
+    else if (!keep) nftw(dir, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return rc;
+}
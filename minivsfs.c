@@ -0,0 +1,3821 @@
+// minivsfs.c - libminivsfs, the MiniVSFS image engine behind mkfs_builder and
+// mkfs_adder (see minivsfs.h for the API).
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread -c minivsfs.c
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#define VSFS_STATS_IMPLEMENTATION
+#include "vsfs_stats.h"
+#include "vsfs_crc.h"
+#include "vsfs_bitmap.h"
+#include "vsfs_format.h"
+#include "vsfs_lz.h"
+#include "vsfs_io.h"
+#include "minivsfs.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define COPY_CHUNK_BLOCKS 256u  // host data is streamed in 1 MiB pieces
+#define COPY_PIPE 4u            // chunks in flight when host data is bounced through memory
+#define BITS_PER_BLOCK (BS * 8u)
+// block numbers and dirent inode numbers are 32-bit on disk
+#define MAX_SIZE_KIB ((uint64_t)UINT32_MAX * (BS / 1024))
+#define MAX_INODES ((uint64_t)UINT32_MAX - 1)
+_Static_assert(BS == VSFS_BS, "block size mismatch");
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
+
+// the helpers below keep their original names in the source; exported from a
+// library they would collide with zlib's crc32() or the host program's own
+#define CRC32_TAB vsfs_ref_crc32_tab
+#define crc32_init vsfs_ref_crc32_init
+#define crc32 vsfs_ref_crc32
+#define inode_crc_finalize vsfs_inode_crc_finalize
+#define dirent_checksum_finalize vsfs_dirent_checksum_finalize
+
+// ==========================DO NOT CHANGE THIS PORTION=========================
+// These functions are there for your help. You should refer to the specifications to see how you can use them.
+// ====================================CRC32====================================
+uint32_t CRC32_TAB[256];
+void crc32_init(void){
+    for (uint32_t i=0;i<256;i++){
+        uint32_t c=i;
+        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
+        CRC32_TAB[i]=c;
+    }
+}
+uint32_t crc32(const void* data, size_t n){
+    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
+    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
+    return c ^ 0xFFFFFFFFu;
+}
+// ====================================CRC32====================================
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+static uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = vsfs_crc32((void *) sb, BS - 4); // same value as crc32(), accelerated kernel
+    sb->checksum = s;
+    return s;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = vsfs_crc32(tmp, 120); // same value as crc32(), accelerated kernel
+    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    de->checksum = x;
+}
+// ==========================DO NOT CHANGE THIS PORTION=========================
+
+// An open image (vsfs_image_t).
+// Only the metadata region (superblock .. end of inode table) is held in memory;
+// data-region blocks are read on demand into a cache, new file data is
+// written straight to the image file, and only dirty blocks are written back.
+typedef struct {
+    uint64_t blk;            // 0 = empty slot (block 0 is the superblock, never cached)
+    int dirty;
+    uint8_t *buf;
+} cached_block_t;
+
+// blocks [first, first + n)
+typedef struct {
+    uint64_t first, n;
+} block_range_t;
+
+// Block deduplication (--dedup). A sidecar file next to the image records every
+// data block written in dedup mode: its CRC32, its block number and how many
+// inode pointers reference it. Candidates are always compared byte for byte
+// before sharing, so a stale or colliding entry can only cost a lookup.
+#define DEDUP_MAGIC 0x50444456u  // "VDDP"
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t total_blocks;       // geometry of the image the table belongs to
+    uint64_t data_region_start;
+    uint64_t count;
+} dedup_file_hdr_t;
+
+typedef struct {
+    uint32_t crc;
+    uint32_t block;              // absolute block number
+    uint32_t refs;               // 0 = dead entry (dropped on save)
+    uint32_t pad;
+} dedup_entry_t;
+#pragma pack(pop)
+
+typedef struct {
+    int enabled;
+    char *path;
+    dedup_entry_t *entries;      // append-only, so indices stay valid
+    size_t count, cap;
+    uint32_t *slots;             // open-addressed by crc: entry index + 1, 0 = empty
+    uint32_t *bslots;            // the same entries open-addressed by block number
+    size_t nslots;               // size of both tables
+    int64_t zero_entry;          // entry holding the all-zero block, -1 if none
+} dedup_t;
+
+// in-memory state of a directory: its block list and its hashed index
+typedef struct {
+    uint64_t inode_index;
+    uint32_t *blocks;        // absolute block numbers of the directory's dirent blocks
+    uint64_t nblocks, cap_blocks;
+    uint64_t index_blk;      // first block of the index run (0 = none yet)
+    dirindex_slot_t *mem;    // the slots while the index is only in memory (index_blk 0)
+    dirindex_hdr_t hdr;      // copy of the on-disk header, written back on change
+} dir_t;
+
+struct vsfs_image {
+    superblock_t sb;
+    int fd;                  // image being updated (the output, or the input in place)
+    uint8_t *meta;           // blocks [0, meta_blocks)
+    uint64_t meta_blocks;
+    uint8_t *meta_dirty;     // one flag per metadata block
+    cached_block_t *cache;   // open-addressed by block number (power-of-two size)
+    size_t n_cache, cap_cache;
+    dir_t root;
+    dedup_t dedup;
+    vsfs_bitmap_t inode_bm;  // over the inode bitmap block inside meta
+    vsfs_bitmap_t data_bm;   // over the data bitmap block inside meta
+    int alloc_policy;        // VSFS_ALLOC_*
+    int zero_copy;           // host data moved with copy_file_range (cleared if unsupported)
+    vsfs_io_t io;            // queue for data and metadata reads and writes (vsfs_io.h)
+    int compress;            // store files compressed when that saves blocks
+    int pack_small;          // inline tiny files and pack tails into shared tail blocks
+    uint64_t tail_blk;       // tail block new fragments go to (0 = none open)
+    uint64_t tail_fill;      // bytes of it already taken
+    int broken;              // a failed update left metadata half written; refuse to sync it
+    inode_t *inode_table;
+    time_t now;
+    uint64_t *pending;       // inodes added since the last sync, CRCs not yet final
+    size_t n_pending, cap_pending;
+    uint64_t txn_blocks;     // blocks dirtied since the last write-back
+    uint64_t txn_reserved;   // blocks adds in flight may still dirty (journaled images)
+    uint64_t journal_start;  // SBF_JOURNAL: first journal block
+    uint64_t journal_blocks; // 0 = no journal
+    uint64_t journal_next;   // journal block the next transaction goes to (0 = start over at 1)
+    uint64_t journal_seq;    // seq of the next transaction
+    uint8_t *journal_homes;  // data-region blocks logged by transactions a replay would still apply
+    size_t replayed;         // transactions replayed by image_open
+    uint32_t *deferred;      // blocks freed since the last commit, released by the next one
+    size_t n_deferred, cap_deferred;
+    pthread_mutex_t lock;    // guards everything above except fd and sb, which never change, and io
+    pthread_cond_t idle;     // signalled when inflight drops to 0 or a commit ends
+    size_t inflight;         // adds copying data with the lock dropped
+    int committing;          // a sync is waiting for in-flight adds or writing back
+    // vsfs_open_delta: every block range written is recorded, under its own lock
+    // because adds record their data writes with the image lock dropped
+    int track;
+    int track_lost;          // a range could not be recorded (out of memory)
+    block_range_t *written;  // in write order, possibly overlapping
+    size_t n_written, cap_written;
+    pthread_mutex_t track_lock;
+    int base_fd;             // the input, left untouched
+    char *scratch_path;      // the copy the adds go to
+    char *delta_path;
+    int delta_done;          // vsfs_write_delta() already ran
+};
+typedef vsfs_image_t image_t;
+
+static int pread_full(int fd, void *buf, size_t n, uint64_t off) {
+    uint8_t *p = buf;
+    STAT_ADD(bytes_read, n);
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { if (r == 0) errno = EIO; return -1; }
+        p += r; n -= (size_t)r; off += (uint64_t)r;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t n, uint64_t off) {
+    const uint8_t *p = buf;
+    STAT_ADD(bytes_written, n);
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, (off_t)off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        p += w; n -= (size_t)w; off += (uint64_t)w;
+    }
+    return 0;
+}
+
+// records that [off, off + len) of the image was written, for the delta
+static void image_wrote(image_t *im, uint64_t off, uint64_t len) {
+    if (!im->track || len == 0) return;
+    uint64_t first = off / BS, end = (off + len + BS - 1) / BS;
+    pthread_mutex_lock(&im->track_lock);
+    block_range_t *last = im->n_written ? &im->written[im->n_written - 1] : NULL;
+    if (last && first >= last->first && first <= last->first + last->n) {
+        if (end > last->first + last->n) last->n = end - last->first;
+    } else {
+        if (im->n_written == im->cap_written) {
+            size_t ncap = im->cap_written ? im->cap_written * 2 : 256;
+            block_range_t *nw = realloc(im->written, ncap * sizeof(block_range_t));
+            if (nw) { im->written = nw; im->cap_written = ncap; }
+        }
+        if (im->n_written < im->cap_written) im->written[im->n_written++] = (block_range_t){ first, end - first };
+        else im->track_lost = 1;
+    }
+    pthread_mutex_unlock(&im->track_lock);
+}
+
+// every write to the image goes through one of these, so a delta sees it
+static int image_pwrite(image_t *im, const void *buf, size_t n, uint64_t off) {
+    image_wrote(im, off, n);
+    return pwrite_full(im->fd, buf, n, off);
+}
+
+static void image_queue_write(image_t *im, vsfs_io_batch_t *b, const void *buf, size_t n, uint64_t off) {
+    image_wrote(im, off, n);
+    vsfs_io_write(&im->io, b, im->fd, buf, n, off);
+}
+
+static cached_block_t *cache_slot(image_t *im, uint64_t blk) {
+    if (im->cap_cache == 0) return NULL;
+    size_t mask = im->cap_cache - 1;
+    for (size_t i = (size_t)(blk * 0x9E3779B97F4A7C15ull >> 20) & mask; ; i = (i + 1) & mask) {
+        if (im->cache[i].blk == blk || im->cache[i].blk == 0) return &im->cache[i];
+    }
+}
+
+static cached_block_t *cache_insert(image_t *im, uint64_t blk, uint8_t *buf) {
+    if ((im->n_cache + 1) * 2 > im->cap_cache) {
+        size_t ncap = im->cap_cache ? im->cap_cache * 2 : 64;
+        cached_block_t *old = im->cache;
+        size_t ocap = im->cap_cache;
+        cached_block_t *nc = calloc(ncap, sizeof(cached_block_t));
+        if (!nc) return NULL;
+        im->cache = nc;
+        im->cap_cache = ncap;
+        for (size_t i = 0; i < ocap; i++) if (old[i].blk) *cache_slot(im, old[i].blk) = old[i];
+        free(old);
+    }
+    cached_block_t *c = cache_slot(im, blk);
+    *c = (cached_block_t){ .blk = blk, .dirty = 0, .buf = buf };
+    im->n_cache++;
+    return c;
+}
+
+// drops blk from the cache (backward-shift deletion keeps probe chains intact);
+// used when a block is freed so a stale copy can never be written over new data
+static void cache_forget(image_t *im, uint64_t blk) {
+    cached_block_t *c = cache_slot(im, blk);
+    if (!c || c->blk != blk) return;
+    free(c->buf);
+    if (c->dirty) im->txn_blocks--;
+    size_t mask = im->cap_cache - 1;
+    size_t i = (size_t)(c - im->cache);
+    for (size_t j = (i + 1) & mask; im->cache[j].blk; j = (j + 1) & mask) {
+        size_t home = (size_t)(im->cache[j].blk * 0x9E3779B97F4A7C15ull >> 20) & mask;
+        // move j into the hole unless its home lies cyclically in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) { im->cache[i] = im->cache[j]; i = j; }
+    }
+    im->cache[i] = (cached_block_t){0};
+    im->n_cache--;
+}
+
+static void mark_dirty(image_t *im, uint64_t blk) {
+    if (blk < im->meta_blocks) {
+        if (!im->meta_dirty[blk]) im->txn_blocks++;
+        im->meta_dirty[blk] = 1;
+        return;
+    }
+    cached_block_t *c = cache_slot(im, blk);
+    if (c && c->blk == blk && !c->dirty) { c->dirty = 1; im->txn_blocks++; }
+}
+
+// returns a writable BS-sized view of block blk, reading it from the image on first use
+static uint8_t *image_block(image_t *im, uint64_t blk) {
+    if (blk < im->meta_blocks) return im->meta + blk * BS;
+    cached_block_t *c = cache_slot(im, blk);
+    if (c && c->blk == blk) return c->buf;
+    if (blk >= im->sb.total_blocks) { errno = EINVAL; return NULL; }
+    uint8_t *buf = malloc(BS);
+    if (!buf) return NULL;
+    if (pread_full(im->fd, buf, BS, blk * BS) != 0) { free(buf); return NULL; }
+    if (!cache_insert(im, blk, buf)) { free(buf); return NULL; }
+    return buf;
+}
+
+// like image_block() for a block that was just allocated: starts zeroed and dirty, no read
+static uint8_t *image_block_new(image_t *im, uint64_t blk) {
+    uint8_t *buf;
+    cached_block_t *c = cache_slot(im, blk);
+    if (c && c->blk == blk) buf = c->buf;
+    else {
+        buf = malloc(BS);
+        if (!buf || !(c = cache_insert(im, blk, buf))) { free(buf); return NULL; }
+    }
+    memset(buf, 0, BS);
+    if (!c->dirty) im->txn_blocks++;
+    c->dirty = 1;
+    return buf;
+}
+
+static void bitmap_set(image_t *im, vsfs_bitmap_t *bm, uint64_t bitmap_start, uint64_t idx) {
+    vsfs_bm_set(bm, idx);
+    mark_dirty(im, bitmap_start + idx / 8 / BS);
+}
+
+static void bitmap_clear(image_t *im, vsfs_bitmap_t *bm, uint64_t bitmap_start, uint64_t idx) {
+    vsfs_bm_clear(bm, idx);
+    mark_dirty(im, bitmap_start + idx / 8 / BS);
+}
+
+// seeds the free counts, hints and group counts of both bitmaps from the
+// superblock's free-space summary, or counts the bitmaps when the image has none
+// (or one that does not fit its geometry)
+static int free_summary_load(image_t *im) {
+    vsfs_bitmap_t *ibm = &im->inode_bm, *dbm = &im->data_bm;
+    dbm->group_shift = sb_free_group_shift(dbm->nbits);
+    uint64_t ngroups = vsfs_bm_groups(dbm);
+    dbm->group_free = malloc(ngroups * sizeof(uint32_t));
+    if (!dbm->group_free) return -1;
+    sb_free_t fs;
+    memcpy(&fs, im->meta + SB_FREE_OFFSET, sizeof(fs));
+    int ok = fs.magic == SBFREE_MAGIC && fs.group_shift == dbm->group_shift && fs.ngroups == ngroups &&
+             fs.free_inodes <= ibm->nbits && fs.free_blocks <= dbm->nbits &&
+             fs.inode_hint <= ibm->nbits && fs.block_hint <= dbm->nbits;
+    if (ok) {
+        memcpy(dbm->group_free, im->meta + SB_FREE_OFFSET + sizeof(fs), ngroups * sizeof(uint32_t));
+        uint64_t sum = 0;
+        for (uint64_t g = 0; g < ngroups; g++) {
+            uint64_t size = g + 1 < ngroups ? 1ull << dbm->group_shift : dbm->nbits - (g << dbm->group_shift);
+            if (dbm->group_free[g] > size) ok = 0;
+            sum += dbm->group_free[g];
+        }
+        if (sum != fs.free_blocks) ok = 0;
+    }
+    if (ok) {
+        ibm->nfree = fs.free_inodes;
+        ibm->low = fs.inode_hint;
+        dbm->nfree = fs.free_blocks;
+        dbm->low = fs.block_hint;
+    } else {
+        vsfs_bm_recount(ibm);
+        vsfs_bm_recount(dbm);
+    }
+    // nothing is free below the hints, so next-fit may as well start there
+    ibm->cursor = ibm->low;
+    dbm->cursor = dbm->low;
+    return 0;
+}
+
+// writes the free-space summary of the two bitmaps into a superblock block
+static void free_summary_store(uint8_t *sb_block, vsfs_bitmap_t *ibm, vsfs_bitmap_t *dbm) {
+    sb_free_t fs;
+    memset(&fs, 0, sizeof(fs));
+    fs.magic = SBFREE_MAGIC;
+    fs.ngroups = (uint32_t)vsfs_bm_groups(dbm);
+    fs.free_inodes = ibm->nfree;
+    fs.free_blocks = dbm->nfree;
+    fs.inode_hint = vsfs_bm_lowest_zero(ibm);
+    fs.block_hint = vsfs_bm_lowest_zero(dbm);
+    fs.group_shift = dbm->group_shift;
+    memcpy(sb_block + SB_FREE_OFFSET, &fs, sizeof(fs));
+    memcpy(sb_block + SB_FREE_OFFSET + sizeof(fs), dbm->group_free, fs.ngroups * sizeof(uint32_t));
+}
+
+static void inode_dirty(image_t *im, uint64_t inode_index) {
+    mark_dirty(im, im->sb.inode_table_start + inode_index * INODE_SIZE / BS);
+}
+
+// one free data block, marked allocated; returns its absolute number or 0 when full
+static uint64_t alloc_one_block(image_t *im) {
+    uint64_t rel = vsfs_bm_find_zero(&im->data_bm);
+    if (rel == VSFS_BM_NONE) return 0;
+    bitmap_set(im, &im->data_bm, im->sb.data_bitmap_start, rel);
+    im->data_bm.cursor = rel + 1;
+    return im->sb.data_region_start + rel;
+}
+
+// absolute block behind logical block l of an inode (0 = unmapped); -1 on read error
+static int inode_get_block(image_t *im, const inode_t *ino, uint64_t l, uint64_t *out) {
+    *out = 0;
+    if (l < DIRECT_MAX) { *out = ino->direct[l]; return 0; }
+    l -= DIRECT_MAX;
+    if (l < PTRS_PER_BLOCK) {
+        if (!ino->reserved_0) return 0;
+        uint32_t *tbl = (uint32_t*)image_block(im, ino->reserved_0);
+        if (!tbl) return -1;
+        *out = tbl[l];
+        return 0;
+    }
+    l -= PTRS_PER_BLOCK;
+    if (l >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK || !ino->reserved_1) return 0;
+    uint32_t *top = (uint32_t*)image_block(im, ino->reserved_1);
+    if (!top) return -1;
+    if (!top[l / PTRS_PER_BLOCK]) return 0;
+    uint32_t *tbl = (uint32_t*)image_block(im, top[l / PTRS_PER_BLOCK]);
+    if (!tbl) return -1;
+    *out = tbl[l % PTRS_PER_BLOCK];
+    return 0;
+}
+
+// maps logical block l of an inode to abs, allocating pointer blocks on the way
+static int inode_set_block(image_t *im, uint64_t inode_index, uint64_t l, uint32_t abs) {
+    inode_t *ino = &im->inode_table[inode_index];
+    inode_dirty(im, inode_index);
+    if (l < DIRECT_MAX) { ino->direct[l] = abs; return 0; }
+    l -= DIRECT_MAX;
+    uint32_t *tbl;
+    if (l < PTRS_PER_BLOCK) {
+        if (!ino->reserved_0) {
+            uint64_t b = alloc_one_block(im);
+            if (!b || !image_block_new(im, b)) return -1;
+            ino->reserved_0 = (uint32_t)b;
+        }
+        if (!(tbl = (uint32_t*)image_block(im, ino->reserved_0))) return -1;
+        tbl[l] = abs;
+        mark_dirty(im, ino->reserved_0);
+        return 0;
+    }
+    l -= PTRS_PER_BLOCK;
+    if (l >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK) { errno = EFBIG; return -1; }
+    if (!ino->reserved_1) {
+        uint64_t b = alloc_one_block(im);
+        if (!b || !image_block_new(im, b)) return -1;
+        ino->reserved_1 = (uint32_t)b;
+    }
+    uint32_t *top = (uint32_t*)image_block(im, ino->reserved_1);
+    if (!top) return -1;
+    if (!top[l / PTRS_PER_BLOCK]) {
+        uint64_t b = alloc_one_block(im);
+        if (!b || !image_block_new(im, b)) return -1;
+        top[l / PTRS_PER_BLOCK] = (uint32_t)b;
+        mark_dirty(im, ino->reserved_1);
+    }
+    if (!(tbl = (uint32_t*)image_block(im, top[l / PTRS_PER_BLOCK]))) return -1;
+    tbl[l % PTRS_PER_BLOCK] = abs;
+    mark_dirty(im, top[l / PTRS_PER_BLOCK]);
+    return 0;
+}
+
+// ------------------------------- directories --------------------------------
+
+static dirent64_t *dir_entry(image_t *im, dir_t *d, uint64_t pos) {
+    if (pos / DIRENTS_PER_BLOCK >= d->nblocks) { errno = EINVAL; return NULL; }
+    uint8_t *blk = image_block(im, d->blocks[pos / DIRENTS_PER_BLOCK]);
+    return blk ? (dirent64_t*)blk + pos % DIRENTS_PER_BLOCK : NULL;
+}
+
+static void dir_entry_dirty(image_t *im, dir_t *d, uint64_t pos) {
+    mark_dirty(im, d->blocks[pos / DIRENTS_PER_BLOCK]);
+}
+
+static dirindex_slot_t *dir_index_slot(image_t *im, dir_t *d, uint32_t i) {
+    if (!d->index_blk) return d->mem + i;
+    uint8_t *blk = image_block(im, d->index_blk + 1 + i / DIRINDEX_SLOTS_PER_BLOCK);
+    return blk ? (dirindex_slot_t*)blk + i % DIRINDEX_SLOTS_PER_BLOCK : NULL;
+}
+
+static void dir_index_slot_dirty(image_t *im, dir_t *d, uint32_t i) {
+    if (d->index_blk) mark_dirty(im, d->index_blk + 1 + i / DIRINDEX_SLOTS_PER_BLOCK);
+}
+
+static int dir_index_hdr_write(image_t *im, dir_t *d) {
+    if (!d->index_blk) return 0;
+    uint8_t *blk = image_block(im, d->index_blk);
+    if (!blk) return -1;
+    memcpy(blk, &d->hdr, sizeof(d->hdr));
+    mark_dirty(im, d->index_blk);
+    return 0;
+}
+
+// stores (hash, pos) in the first empty or deleted slot of its probe chain
+static int dir_index_put(image_t *im, dir_t *d, uint32_t h, uint64_t pos) {
+    uint32_t mask = d->hdr.nslots - 1;
+    for (uint32_t i = h & mask; ; i = (i + 1) & mask) {
+        dirindex_slot_t *sl = dir_index_slot(im, d, i);
+        if (!sl) return -1;
+        if (sl->pos == DIRINDEX_EMPTY || sl->pos == DIRINDEX_TOMB) {
+            if (sl->pos == DIRINDEX_TOMB) d->hdr.tombstones--;
+            sl->hash = h;
+            sl->pos = (uint32_t)(pos + 1);
+            dir_index_slot_dirty(im, d, i);
+            d->hdr.used++;
+            return 0;
+        }
+    }
+}
+
+// room for n more blocks in the deferred-free list
+static int deferred_reserve(image_t *im, size_t n) {
+    if (im->n_deferred + n <= im->cap_deferred) return 0;
+    size_t ncap = im->cap_deferred ? im->cap_deferred : 64;
+    while (ncap < im->n_deferred + n) ncap *= 2;
+    uint32_t *nd = realloc(im->deferred, ncap * sizeof(uint32_t));
+    if (!nd) { errno = ENOMEM; return -1; }
+    im->deferred = nd;
+    im->cap_deferred = ncap;
+    return 0;
+}
+
+// gives a data-region block back and drops any cached copy. With a journal the
+// committed image may still point at it, so it must not be handed out (and
+// overwritten by file data) before the update that stops using it is committed:
+// it is only freed by the next commit, whose bitmap block is dirtied now so the
+// transaction is sized for it. The caller has reserved the deferred slot.
+static void block_release(image_t *im, uint64_t blk) {
+    uint64_t rel = blk - im->sb.data_region_start;
+    if (im->journal_blocks) {
+        im->deferred[im->n_deferred++] = (uint32_t)blk;
+        mark_dirty(im, im->sb.data_bitmap_start + rel / 8 / BS);
+    } else {
+        bitmap_clear(im, &im->data_bm, im->sb.data_bitmap_start, rel);
+    }
+    cache_forget(im, blk);
+}
+
+// fills the index at d->index_blk, whose nslots slots are all empty, from the
+// directory's entries
+static int dir_index_fill(image_t *im, dir_t *d, uint32_t nslots) {
+    uint32_t free_hint = d->hdr.free_hint;
+    memset(&d->hdr, 0, sizeof(d->hdr));
+    d->hdr.magic = DIRINDEX_MAGIC;
+    d->hdr.nslots = nslots;
+    d->hdr.free_hint = free_hint;
+    for (uint64_t pos = 0; pos < d->nblocks * DIRENTS_PER_BLOCK; pos++) {
+        dirent64_t *de = dir_entry(im, d, pos);
+        if (!de) return -1;
+        if (de->inode_no && dir_index_put(im, d, name_hash(de->name), pos) != 0) return -1;
+    }
+    return dir_index_hdr_write(im, d);
+}
+
+// rebuilds the index with at most as many slots as it has at the start of its own
+// run, dropping its tombstones, and releases the rest of the run
+static int dir_index_shrink(image_t *im, dir_t *d, uint32_t nslots) {
+    uint64_t nblk = dir_index_blocks(nslots), old_nblk = dir_index_blocks(d->hdr.nslots);
+    if (im->journal_blocks && deferred_reserve(im, old_nblk - nblk) != 0) return -1;
+    for (uint64_t i = 0; i < nblk; i++) {
+        if (!image_block_new(im, d->index_blk + i)) return -1;
+    }
+    if (dir_index_fill(im, d, nslots) != 0) return -1;
+    for (uint64_t i = nblk; i < old_nblk; i++) block_release(im, d->index_blk + i);
+    return 0;
+}
+
+// (re)builds the index with nslots slots from the directory's entries into a fresh
+// run of blocks, then releases the previous run
+static int dir_index_build(image_t *im, dir_t *d, uint32_t nslots) {
+    uint64_t nblk = dir_index_blocks(nslots);
+    uint64_t old_blk = d->index_blk;
+    uint64_t old_nblk = old_blk ? dir_index_blocks(d->hdr.nslots) : 0;
+    // the old run goes through block_release(), deferred with a journal
+    if (im->journal_blocks && deferred_reserve(im, old_nblk) != 0) return -1;
+    uint64_t rel = vsfs_bm_find_run(&im->data_bm, nblk);
+    if (rel == VSFS_BM_NONE) { errno = ENOSPC; return -1; }
+    for (uint64_t i = 0; i < nblk; i++) {
+        bitmap_set(im, &im->data_bm, im->sb.data_bitmap_start, rel + i);
+        if (!image_block_new(im, im->sb.data_region_start + rel + i)) return -1;
+    }
+
+    d->index_blk = im->sb.data_region_start + rel;
+    if (dir_index_fill(im, d, nslots) != 0) return -1;
+    free(d->mem);
+    d->mem = NULL;
+
+    for (uint64_t i = 0; i < old_nblk; i++) block_release(im, old_blk + i);
+    inode_t *ino = &im->inode_table[d->inode_index];
+    ino->reserved_2 |= IFL_DIRINDEX;
+    ino->xattr_ptr = d->index_blk;
+    inode_dirty(im, d->inode_index);
+    return 0;
+}
+
+// writes an index that is only in memory to a run of its own, before the first
+// change to the directory
+static int dir_index_attach(image_t *im, dir_t *d) {
+    return d->index_blk ? 0 : dir_index_build(im, d, d->hdr.nslots);
+}
+
+// makes sure one more name fits in the index without exceeding 3/4 load
+static int dir_index_reserve(image_t *im, dir_t *d) {
+    if (((uint64_t)d->hdr.used + d->hdr.tombstones + 1) * 4 <= (uint64_t)d->hdr.nslots * 3) return dir_index_attach(im, d);
+    return dir_index_build(im, d, dir_index_size_for((uint64_t)d->hdr.used + 1));
+}
+
+// reads the directory's block list and index. Directories written before the
+// index existed (and ones whose index is damaged) get one built in memory; it
+// only reaches the image with the first insert or removal, so opening an image
+// to read it changes nothing
+static int dir_load(image_t *im, dir_t *d, uint64_t inode_index) {
+    memset(d, 0, sizeof(*d));
+    d->inode_index = inode_index;
+    const inode_t *ino = &im->inode_table[inode_index];
+    for (uint64_t l = 0; ; l++) {
+        uint64_t b;
+        if (inode_get_block(im, ino, l, &b) != 0) return -1;
+        if (b == 0) break;
+        if (d->nblocks == d->cap_blocks) {
+            uint64_t ncap = d->cap_blocks ? d->cap_blocks * 2 : 16;
+            uint32_t *nb = realloc(d->blocks, ncap * sizeof(uint32_t));
+            if (!nb) return -1;
+            d->blocks = nb;
+            d->cap_blocks = ncap;
+        }
+        d->blocks[d->nblocks++] = (uint32_t)b;
+    }
+    if (ino->reserved_2 & IFL_DIRINDEX) {
+        d->index_blk = ino->xattr_ptr;
+        uint8_t *blk = image_block(im, d->index_blk);
+        if (!blk) return -1;
+        memcpy(&d->hdr, blk, sizeof(d->hdr));
+        if (d->hdr.magic == DIRINDEX_MAGIC && d->hdr.nslots >= DIRINDEX_MIN_SLOTS && (d->hdr.nslots & (d->hdr.nslots - 1)) == 0) return 0;
+        fprintf(stderr, "Directory index of inode %" PRIu64 " is damaged, rebuilding\n", inode_index + 1);
+        memset(&d->hdr, 0, sizeof(d->hdr));
+        d->index_blk = 0; // the damaged run is left allocated rather than trusting its size
+    }
+    uint64_t entries = 0;
+    for (uint64_t pos = 0; pos < d->nblocks * DIRENTS_PER_BLOCK; pos++) {
+        dirent64_t *de = dir_entry(im, d, pos);
+        if (!de) return -1;
+        STAT_ADD(dirents_probed, 1);
+        if (de->inode_no) entries++;
+    }
+    uint32_t nslots = dir_index_size_for(entries);
+    d->mem = calloc(nslots, sizeof(dirindex_slot_t));
+    if (!d->mem) return -1;
+    return dir_index_fill(im, d, nslots);
+}
+
+// position of the entry called name, or -1 if absent (-2 on read error)
+static int64_t dir_lookup(image_t *im, dir_t *d, const char *name) {
+    uint32_t h = name_hash(name);
+    uint32_t mask = d->hdr.nslots - 1;
+    for (uint32_t i = h & mask, probes = 0; probes < d->hdr.nslots; i = (i + 1) & mask, probes++) {
+        dirindex_slot_t *sl = dir_index_slot(im, d, i);
+        if (!sl) return -2;
+        STAT_ADD(dirents_probed, 1);
+        if (sl->pos == DIRINDEX_EMPTY) return -1;
+        if (sl->pos == DIRINDEX_TOMB || sl->hash != h) continue;
+        dirent64_t *de = dir_entry(im, d, sl->pos - 1);
+        if (!de) return -2;
+        if (de->inode_no && strncmp(de->name, name, sizeof(de->name)) == 0) return (int64_t)sl->pos - 1;
+    }
+    return -1;
+}
+
+// finds a free dirent position, appending a zeroed block to the directory if all are taken
+static int dir_reserve_slot(image_t *im, dir_t *d, uint64_t *pos_out) {
+    for (uint64_t pos = d->hdr.free_hint; pos < d->nblocks * DIRENTS_PER_BLOCK; pos++) {
+        dirent64_t *de = dir_entry(im, d, pos);
+        if (!de) return -1;
+        STAT_ADD(dirents_probed, 1);
+        if (de->inode_no == 0) { d->hdr.free_hint = (uint32_t)pos; *pos_out = pos; return 0; }
+    }
+    uint64_t b = alloc_one_block(im);
+    if (!b) { errno = ENOSPC; return -1; }
+    if (!image_block_new(im, b) || inode_set_block(im, d->inode_index, d->nblocks, (uint32_t)b) != 0) return -1;
+    if (d->nblocks == d->cap_blocks) {
+        uint64_t ncap = d->cap_blocks ? d->cap_blocks * 2 : 16;
+        uint32_t *nb = realloc(d->blocks, ncap * sizeof(uint32_t));
+        if (!nb) return -1;
+        d->blocks = nb;
+        d->cap_blocks = ncap;
+    }
+    d->blocks[d->nblocks++] = (uint32_t)b;
+    *pos_out = (d->nblocks - 1) * DIRENTS_PER_BLOCK;
+    d->hdr.free_hint = (uint32_t)*pos_out;
+    return 0;
+}
+
+// writes a dirent at a position obtained from dir_reserve_slot() and indexes it
+static int dir_insert(image_t *im, dir_t *d, uint64_t pos, const char *name, uint32_t inode_no, uint8_t type) {
+    dirent64_t *de = dir_entry(im, d, pos);
+    if (!de) return -1;
+    memset(de, 0, sizeof(*de));
+    de->inode_no = inode_no;
+    de->type = type;
+    memcpy(de->name, name, sizeof(de->name));
+    dirent_checksum_finalize(de);
+    dir_entry_dirty(im, d, pos);
+    if (dir_index_put(im, d, name_hash(de->name), pos) != 0) return -1;
+    d->hdr.free_hint = (uint32_t)pos + 1;
+    return dir_index_hdr_write(im, d);
+}
+
+// clears the entry at pos and leaves a tombstone in its index slot
+static int dir_remove(image_t *im, dir_t *d, uint64_t pos) {
+    dirent64_t *de = dir_entry(im, d, pos);
+    if (!de) return -1;
+    uint32_t h = name_hash(de->name);
+    uint32_t mask = d->hdr.nslots - 1;
+    for (uint32_t i = h & mask, probes = 0; probes < d->hdr.nslots; i = (i + 1) & mask, probes++) {
+        dirindex_slot_t *sl = dir_index_slot(im, d, i);
+        if (!sl) return -1;
+        if (sl->pos == DIRINDEX_EMPTY) break;
+        if (sl->pos != pos + 1) continue;
+        sl->pos = DIRINDEX_TOMB;
+        dir_index_slot_dirty(im, d, i);
+        d->hdr.used--;
+        d->hdr.tombstones++;
+        break;
+    }
+    memset(de, 0, sizeof(*de));
+    dir_entry_dirty(im, d, pos);
+    if (pos < d->hdr.free_hint) d->hdr.free_hint = (uint32_t)pos;
+    return dir_index_hdr_write(im, d);
+}
+
+// makes output a copy of input: reflink when the filesystem can share extents,
+// otherwise copy_file_range (which stays in the kernel), otherwise plain read/write
+static int clone_image(int in_fd, int out_fd, uint64_t size) {
+#ifdef FICLONE
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) return 0;
+#endif
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t n = copy_file_range(in_fd, NULL, out_fd, NULL, size - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (uint64_t)n;
+        STAT_ADD(bytes_read, n);
+        STAT_ADD(bytes_written, n);
+    }
+    if (done == size) return 0;
+
+    uint8_t *buf = malloc(1u << 20);
+    if (!buf) return -1;
+    while (done < size) {
+        size_t chunk = size - done > (1u << 20) ? (1u << 20) : (size_t)(size - done);
+        if (pread_full(in_fd, buf, chunk, done) != 0 || pwrite_full(out_fd, buf, chunk, done) != 0) { free(buf); return -1; }
+        done += chunk;
+    }
+    free(buf);
+    return 0;
+}
+
+// ------------------------------ write-ahead journal ------------------------------
+// With SBF_JOURNAL an in-place update is crash-consistent: every metadata block a
+// sync dirtied (including pointer blocks, dirent and index blocks) is first logged
+// as one transaction and made durable with a single fdatasync; only then are the
+// blocks written to their home locations, without a flush of their own. Those
+// home writes become durable at the next flush: the one before the journal wraps
+// back to block 1, or the one in vsfs_close(), which then marks the journal clean.
+// After a crash, image_open() replays the logged transactions, which rewrites the
+// same block contents and so is harmless for transactions already checkpointed.
+// File data goes straight to freshly allocated blocks and is flushed by the same
+// fdatasync, so a crash inside that flush can leave the newest files' data short
+// but never the metadata inconsistent.
+
+static int journal_hdr_write(image_t *im, uint64_t head_seq, uint64_t next_seq) {
+    uint8_t blk[BS];
+    memset(blk, 0, BS);
+    journal_hdr_t *h = (journal_hdr_t *)blk;
+    h->magic = JOURNAL_MAGIC;
+    h->version = 1;
+    h->blocks = im->journal_blocks;
+    h->head_seq = head_seq;
+    h->next_seq = next_seq;
+    return image_pwrite(im, blk, BS, im->journal_start * BS);
+}
+
+// blocks one transaction can log
+static uint64_t journal_room(const image_t *im) {
+    return im->journal_blocks - 1 - journal_desc_blocks(im->journal_blocks);
+}
+
+// finds the journal from the superblock and applies any transactions an
+// interrupted update left committed but possibly not checkpointed
+static int journal_replay(image_t *im, char *why, size_t whylen) {
+    const superblock_t *sb = &im->sb;
+    im->journal_start = sb->data_bitmap_start + sb->data_bitmap_blocks;
+    if (sb->inode_table_start < im->journal_start + JOURNAL_MIN_BLOCKS) { snprintf(why, whylen, "invalid journal layout"); return -1; }
+    im->journal_blocks = sb->inode_table_start - im->journal_start;
+
+    uint8_t blk[BS];
+    if (pread_full(im->fd, blk, BS, im->journal_start * BS) != 0) { snprintf(why, whylen, "read journal: %s", strerror(errno)); return -1; }
+    journal_hdr_t hdr;
+    memcpy(&hdr, blk, sizeof(hdr));
+    if (hdr.magic != JOURNAL_MAGIC || hdr.blocks != im->journal_blocks) { snprintf(why, whylen, "journal header is damaged"); return -1; }
+
+    // the next round must not start with a seq an older transaction at block 1 already has
+    uint64_t next = hdr.next_seq;
+    if (pread_full(im->fd, blk, BS, (im->journal_start + 1) * BS) != 0) { snprintf(why, whylen, "read journal: %s", strerror(errno)); return -1; }
+    const journal_tx_t *first = (const journal_tx_t *)blk;
+    if (first->magic == JOURNAL_TX_MAGIC && first->seq >= next) next = first->seq + 1;
+    if (hdr.head_seq == 0) {
+        im->journal_seq = next;
+        return 0;
+    }
+
+    uint8_t *rec = NULL;
+    int rc = -1;
+    uint64_t seq = hdr.head_seq;
+    for (uint64_t at = 1; at < im->journal_blocks; ) {
+        if (pread_full(im->fd, blk, BS, (im->journal_start + at) * BS) != 0) { snprintf(why, whylen, "read journal: %s", strerror(errno)); goto out; }
+        journal_tx_t tx;
+        memcpy(&tx, blk, sizeof(tx));
+        if (tx.magic != JOURNAL_TX_MAGIC || tx.seq != seq || tx.nblocks == 0 || tx.nblocks > im->journal_blocks ||
+            tx.desc_blocks != journal_desc_blocks(tx.nblocks) || at + tx.desc_blocks + tx.nblocks > im->journal_blocks) break;
+        uint64_t len = (tx.desc_blocks + tx.nblocks) * BS;
+        free(rec);
+        if (!(rec = malloc(len))) { snprintf(why, whylen, "malloc journal record"); goto out; }
+        if (pread_full(im->fd, rec, len, (im->journal_start + at) * BS) != 0) { snprintf(why, whylen, "read journal: %s", strerror(errno)); goto out; }
+        ((journal_tx_t *)rec)->crc = 0;
+        if (vsfs_crc32(rec, len) != tx.crc) break; // torn: never committed
+
+        const uint64_t *homes = (const uint64_t *)(rec + sizeof(journal_tx_t));
+        for (uint64_t i = 0; i < tx.nblocks; i++) {
+            if (homes[i] >= sb->total_blocks || (homes[i] >= im->journal_start && homes[i] < sb->inode_table_start)) {
+                snprintf(why, whylen, "journal transaction %" PRIu64 " logs invalid block %" PRIu64, seq, homes[i]);
+                goto out;
+            }
+        }
+        vsfs_io_batch_t batch = {0};
+        for (uint64_t i = 0; i < tx.nblocks; i++) image_queue_write(im, &batch, rec + (tx.desc_blocks + i) * BS, BS, homes[i] * BS);
+        if (vsfs_io_wait(&im->io, &batch) != 0) { snprintf(why, whylen, "replay journal: %s", strerror(errno)); goto out; }
+        im->replayed++;
+        at += tx.desc_blocks + tx.nblocks;
+        if (++seq > next) next = seq;
+    }
+    // the replayed blocks are durable before the journal forgets them
+    if (fdatasync(im->fd) != 0 || journal_hdr_write(im, 0, next) != 0 || fdatasync(im->fd) != 0) {
+        snprintf(why, whylen, "replay journal: %s", strerror(errno));
+        goto out;
+    }
+    im->journal_seq = next;
+    rc = 0;
+out:
+    free(rec);
+    return rc;
+}
+
+// logs every dirty block as one transaction and flushes it; when this returns the
+// update survives a crash and the blocks may be written home
+static int journal_commit(image_t *im, char *why, size_t whylen) {
+    uint64_t n = 0;
+    for (uint64_t b = 0; b < im->meta_blocks; b++) n += im->meta_dirty[b];
+    for (size_t i = 0; i < im->cap_cache; i++) n += im->cache[i].blk && im->cache[i].dirty;
+    if (n == 0) return 0;
+    uint64_t desc = journal_desc_blocks(n);
+    if (1 + desc + n > im->journal_blocks) {
+        snprintf(why, whylen, "update of %" PRIu64 " blocks does not fit in the %" PRIu64 "-block journal", n, im->journal_blocks);
+        return -1;
+    }
+    uint8_t *rec = calloc(desc + n, BS);
+    if (!im->journal_homes) im->journal_homes = calloc((im->sb.data_region_blocks + 7) / 8, 1);
+    if (!rec || !im->journal_homes) { snprintf(why, whylen, "malloc journal record"); free(rec); return -1; }
+    uint64_t *homes = (uint64_t *)(rec + sizeof(journal_tx_t));
+    uint64_t k = 0;
+    for (uint64_t b = 0; b < im->meta_blocks; b++) {
+        if (!im->meta_dirty[b]) continue;
+        homes[k] = b;
+        memcpy(rec + (desc + k++) * BS, im->meta + b * BS, BS);
+    }
+    for (size_t i = 0; i < im->cap_cache; i++) {
+        if (!im->cache[i].blk || !im->cache[i].dirty) continue;
+        homes[k] = im->cache[i].blk;
+        memcpy(rec + (desc + k++) * BS, im->cache[i].buf, BS);
+    }
+
+    int rc = -1;
+    if (im->journal_next == 0 || im->journal_next + desc + n > im->journal_blocks) {
+        // starting over at block 1 overwrites the oldest transactions, so the home
+        // writes they cover must be durable first
+        if (im->journal_next && fdatasync(im->fd) != 0) { snprintf(why, whylen, "flush image: %s", strerror(errno)); goto out; }
+        if (journal_hdr_write(im, im->journal_seq, im->journal_seq + 1) != 0) { snprintf(why, whylen, "write journal: %s", strerror(errno)); goto out; }
+        im->journal_next = 1;
+        memset(im->journal_homes, 0, (im->sb.data_region_blocks + 7) / 8);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        if (homes[i] < im->sb.data_region_start) continue;
+        uint64_t rel = homes[i] - im->sb.data_region_start;
+        im->journal_homes[rel / 8] |= (uint8_t)(1u << (rel % 8));
+    }
+    journal_tx_t *tx = (journal_tx_t *)rec;
+    tx->magic = JOURNAL_TX_MAGIC;
+    tx->seq = im->journal_seq;
+    tx->nblocks = n;
+    tx->desc_blocks = desc;
+    tx->crc = vsfs_crc32(rec, (desc + n) * BS);
+    if (image_pwrite(im, rec, (desc + n) * BS, (im->journal_start + im->journal_next) * BS) != 0) { snprintf(why, whylen, "write journal: %s", strerror(errno)); goto out; }
+    if (fdatasync(im->fd) != 0) { snprintf(why, whylen, "flush journal: %s", strerror(errno)); goto out; }
+    im->journal_next += desc + n;
+    im->journal_seq++;
+    rc = 0;
+out:
+    free(rec);
+    return rc;
+}
+
+// makes the home writes durable and marks the journal empty, so opening the image
+// replays nothing
+static int journal_close(image_t *im, char *why, size_t whylen) {
+    if (im->journal_next == 0) return 0;
+    if (fdatasync(im->fd) != 0 || journal_hdr_write(im, 0, im->journal_seq) != 0 || fdatasync(im->fd) != 0) {
+        snprintf(why, whylen, "close journal: %s", strerror(errno));
+        return -1;
+    }
+    im->journal_next = 0;
+    if (im->journal_homes) memset(im->journal_homes, 0, (im->sb.data_region_blocks + 7) / 8);
+    return 0;
+}
+
+static void dedup_free(dedup_t *dd);
+
+static void image_close(image_t *im) {
+    for (size_t i = 0; i < im->cap_cache; i++) free(im->cache[i].buf);
+    free(im->root.blocks);
+    free(im->root.mem);
+    free(im->cache);
+    free(im->meta);
+    free(im->meta_dirty);
+    free(im->pending);
+    free(im->deferred);
+    free(im->journal_homes);
+    free(im->data_bm.group_free);
+    dedup_free(&im->dedup);
+    pthread_mutex_destroy(&im->lock);
+    pthread_cond_destroy(&im->idle);
+    vsfs_io_close(&im->io);
+    pthread_mutex_destroy(&im->track_lock);
+    free(im->written);
+    free(im->scratch_path);
+    free(im->delta_path);
+    if (im->base_fd >= 0) close(im->base_fd);
+    im->base_fd = -1;
+    if (im->fd >= 0) close(im->fd);
+    im->fd = -1;
+}
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_setup(void) {
+    crc32_init();
+    vsfs_crc_init();
+}
+
+// output == NULL updates input in place; track records every block written from
+// the start, journal replay included
+static int image_open(image_t *im, const char *input, const char *output, int track, char *why, size_t whylen) {
+    memset(im, 0, sizeof(*im));
+    im->fd = -1;
+    im->base_fd = -1;
+    im->track = track;
+    pthread_mutex_init(&im->track_lock, NULL);
+    pthread_mutex_init(&im->lock, NULL);
+    pthread_cond_init(&im->idle, NULL);
+    vsfs_io_open(&im->io);
+
+    int in_fd = open(input, output ? O_RDONLY : O_RDWR);
+    if (in_fd < 0) { snprintf(why, whylen, "open input: %s", strerror(errno)); return -1; }
+
+    uint8_t sb_block[BS];
+    if (pread_full(in_fd, sb_block, BS, 0) != 0) { snprintf(why, whylen, "failed to read superblock block"); close(in_fd); return -1; }
+
+    // interpret superblock from sb_block
+    superblock_t *sbp = (superblock_t*)sb_block;
+    if (sbp->magic != VSFS_MAGIC) { snprintf(why, whylen, "bad magic: 0x%08x", sbp->magic); close(in_fd); return -1; }
+    memcpy(&im->sb, sbp, sizeof(superblock_t));
+
+    uint64_t total_blocks = im->sb.total_blocks;
+    if (total_blocks == 0) { snprintf(why, whylen, "invalid total_blocks"); close(in_fd); return -1; }
+    uint64_t image_size = total_blocks * (uint64_t)BS;
+    struct stat st;
+    if (fstat(in_fd, &st) != 0 || (uint64_t)st.st_size < image_size) { snprintf(why, whylen, "image is shorter than total_blocks"); close(in_fd); return -1; }
+    im->meta_blocks = im->sb.inode_table_start + im->sb.inode_table_blocks;
+    // bitmaps and inode table may span several blocks each; they must lie inside the
+    // metadata region and be large enough for the counts they cover
+    if (im->meta_blocks > total_blocks || total_blocks > UINT32_MAX ||
+        im->sb.data_region_start != im->meta_blocks || im->sb.data_region_blocks != total_blocks - im->meta_blocks ||
+        im->sb.inode_bitmap_start + im->sb.inode_bitmap_blocks > im->meta_blocks ||
+        im->sb.data_bitmap_start + im->sb.data_bitmap_blocks > im->meta_blocks ||
+        im->sb.inode_bitmap_blocks * BS * 8 < im->sb.inode_count ||
+        im->sb.data_bitmap_blocks * BS * 8 < im->sb.data_region_blocks ||
+        im->sb.inode_table_blocks * BS < im->sb.inode_count * INODE_SIZE) {
+        snprintf(why, whylen, "invalid superblock layout"); close(in_fd); return -1;
+    }
+
+    if (output) {
+        int out_fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) { snprintf(why, whylen, "open output: %s", strerror(errno)); close(in_fd); return -1; }
+        if (clone_image(in_fd, out_fd, image_size) != 0) {
+            snprintf(why, whylen, "copy image: %s", strerror(errno));
+            close(out_fd); close(in_fd); unlink(output);
+            return -1;
+        }
+        close(in_fd);
+        im->fd = out_fd;
+    } else {
+        im->fd = in_fd;
+    }
+
+    // an update interrupted by a crash is completed from the journal before anything is read
+    if ((im->sb.flags & SBF_JOURNAL) && journal_replay(im, why, whylen) != 0) goto fail;
+
+    // read just the metadata region; the journal inside it is never read into memory
+    // (its part of the buffer stays untouched, so it costs no resident pages)
+    im->meta = malloc(im->meta_blocks * BS);
+    im->meta_dirty = calloc(im->meta_blocks, 1);
+    if (!im->meta || !im->meta_dirty) { snprintf(why, whylen, "malloc metadata"); goto fail; }
+    uint64_t skip_from = im->journal_blocks ? im->journal_start : im->meta_blocks;
+    uint64_t skip_to = im->journal_blocks ? im->sb.inode_table_start : im->meta_blocks;
+    if (pread_full(im->fd, im->meta, skip_from * BS, 0) != 0 ||
+        pread_full(im->fd, im->meta + skip_to * BS, (im->meta_blocks - skip_to) * BS, skip_to * BS) != 0) {
+        snprintf(why, whylen, "read metadata: %s", strerror(errno)); goto fail;
+    }
+
+    // locate bitmaps/inode table; each bitmap is contiguous across its blocks
+    vsfs_bm_init(&im->inode_bm, im->meta + im->sb.inode_bitmap_start * BS, im->sb.inode_count);
+    vsfs_bm_init(&im->data_bm, im->meta + im->sb.data_bitmap_start * BS, im->sb.data_region_blocks);
+    im->inode_table = (inode_t*)(im->meta + im->sb.inode_table_start * BS);
+    if (free_summary_load(im) != 0) { snprintf(why, whylen, "malloc metadata"); goto fail; }
+
+    if (im->inode_table[0].direct[0] == 0) { snprintf(why, whylen, "root has no data block"); goto fail; }
+    if (dir_load(im, &im->root, 0) != 0) { snprintf(why, whylen, "load root directory: %s", strerror(errno)); goto fail; }
+    im->alloc_policy = VSFS_ALLOC_CONTIGUOUS;
+    im->zero_copy = 1;
+    im->now = time(NULL);
+    return 0;
+
+fail:
+    image_close(im);
+    if (output) unlink(output);
+    return -1;
+}
+
+// number of contiguous runs in a list of block numbers
+static uint64_t count_runs(const uint32_t *blocks, uint64_t n) {
+    uint64_t runs = n ? 1 : 0;
+    for (uint64_t i = 1; i < n; i++) if (blocks[i] != blocks[i-1] + 1) runs++;
+    return runs;
+}
+
+// shortest free run of at least len bits, or VSFS_BM_NONE
+static uint64_t find_best_fit(const vsfs_bitmap_t *bm, uint64_t len) {
+    uint64_t best = VSFS_BM_NONE, best_len = UINT64_MAX;
+    uint64_t pos = 0;
+    while (pos < bm->nbits) {
+        uint64_t start = vsfs_bm_next_zero(bm, pos, bm->nbits);
+        if (start == VSFS_BM_NONE) break;
+        uint64_t end = vsfs_bm_next_one(bm, start, bm->nbits);
+        uint64_t run = end - start;
+        if (run >= len && run < best_len) {
+            best = start; best_len = run;
+            if (run == len) break; // exact fit, cannot do better
+        }
+        pos = end + 1;
+    }
+    return best;
+}
+
+// picks need data blocks (relative to the data region) according to im->alloc_policy;
+// returns how many were found (< need means the region is too full)
+static uint64_t allocate_blocks(image_t *im, uint64_t need, uint32_t *out) {
+    vsfs_bitmap_t *bm = &im->data_bm;
+    if (need > bm->nfree) return 0;
+    uint64_t start = VSFS_BM_NONE;
+    if (im->alloc_policy == VSFS_ALLOC_CONTIGUOUS) start = vsfs_bm_find_run(bm, need);
+    else if (im->alloc_policy == VSFS_ALLOC_BEST_FIT) start = find_best_fit(bm, need);
+    if (start != VSFS_BM_NONE) {
+        for (uint64_t i = 0; i < need; i++) out[i] = (uint32_t)(start + i);
+        return need;
+    }
+
+    // first-fit, and the fallback when no single run is long enough: take free blocks in next-fit order
+    uint64_t allocated = 0;
+    uint64_t scan = bm->cursor;
+    int wrapped = 0;
+    while (allocated < need) {
+        uint64_t db = vsfs_bm_next_zero(bm, scan, wrapped ? bm->cursor : bm->nbits);
+        if (db == VSFS_BM_NONE) {
+            if (wrapped || bm->cursor == 0) break;
+            wrapped = 1;
+            scan = 0;
+            continue;
+        }
+        out[allocated++] = (uint32_t)db;
+        scan = db + 1;
+    }
+    return allocated;
+}
+
+// data of a file being added: a host file (fd >= 0) or a caller buffer
+typedef struct {
+    int fd;
+    const uint8_t *buf;
+    uint64_t size;           // bytes to store
+    uint32_t flags;          // IFL_* for the inode
+    uint64_t file_size;      // with IFL_COMPRESSED: the uncompressed size
+} add_src_t;
+
+// n bytes of the source at off
+static int src_read(const add_src_t *src, void *buf, size_t n, uint64_t off) {
+    if (src->fd < 0) { memcpy(buf, src->buf + off, n); return 0; }
+    return pread_full(src->fd, buf, n, off);
+}
+
+// moves bytes of the host file at hoff to image offset dst inside the kernel
+// (copy_file_range; a reflink on filesystems that support it). Returns 1 if the
+// kernel or filesystem pair cannot do it, so the caller falls back to pread/pwrite.
+static int copy_host_range(image_t *im, int host_fd, uint64_t hoff, uint64_t dst, size_t bytes) {
+    loff_t in_off = (loff_t)hoff, out_off = (loff_t)dst;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = copy_file_range(host_fd, &in_off, im->fd, &out_off, bytes - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && done == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)) return 1;
+        if (n <= 0) { if (n == 0) errno = EIO; return -1; }
+        done += (size_t)n;
+        STAT_ADD(bytes_read, n);
+        STAT_ADD(bytes_written, n);
+    }
+    return 0;
+}
+
+// bounce buffers for copy_pipelined(), allocated on first use
+typedef struct {
+    uint8_t *buf[COPY_PIPE];
+} copy_bufs_t;
+
+static void copy_bufs_free(copy_bufs_t *cb) {
+    for (unsigned i = 0; i < COPY_PIPE; i++) free(cb->buf[i]);
+}
+
+// moves len bytes of host file in at hoff to offset dst of out with reads and writes
+// through the I/O queue, in pieces of COPY_CHUNK_BLOCKS: the reads of the next
+// COPY_PIPE - 1 pieces are in flight while a piece is written. Returns 0, or -1 with
+// errno set (EIO for a short read) and *host set when reading the host file failed.
+static int copy_pipelined(vsfs_io_t *io, copy_bufs_t *cb, int in, uint64_t hoff, int out, uint64_t dst, uint64_t len, int *host) {
+    const size_t chunk = (size_t)COPY_CHUNK_BLOCKS * BS;
+    const uint64_t ahead = COPY_PIPE - 1;
+    uint64_t nchunks = (len + chunk - 1) / chunk;
+    vsfs_io_batch_t rd[COPY_PIPE] = {{0}}, wr[COPY_PIPE] = {{0}};
+    int err = 0;
+    *host = 0;
+    for (uint64_t c = 0; c < nchunks + ahead && !err; c++) {
+        if (c < nchunks) {
+            // slot s last held piece c - COPY_PIPE, whose write is already queued
+            unsigned s = (unsigned)(c % COPY_PIPE);
+            if (vsfs_io_wait(io, &wr[s]) != 0) { err = errno; break; }
+            if (!cb->buf[s] && !(cb->buf[s] = malloc(chunk))) { err = ENOMEM; break; }
+            uint64_t at = c * chunk;
+            vsfs_io_read(io, &rd[s], in, cb->buf[s], len - at < chunk ? (size_t)(len - at) : chunk, hoff + at);
+        }
+        if (c >= ahead) {
+            uint64_t w = c - ahead;
+            unsigned s = (unsigned)(w % COPY_PIPE);
+            if (vsfs_io_wait(io, &rd[s]) != 0) { err = errno; *host = 1; break; }
+            uint64_t at = w * chunk;
+            vsfs_io_write(io, &wr[s], out, cb->buf[s], len - at < chunk ? (size_t)(len - at) : chunk, dst + at);
+        }
+    }
+    // nothing may still point into the buffers when this returns
+    for (unsigned s = 0; s < COPY_PIPE; s++) {
+        if (vsfs_io_wait(io, &rd[s]) != 0 && !err) { err = errno; *host = 1; }
+        if (vsfs_io_wait(io, &wr[s]) != 0 && !err) err = errno;
+    }
+    if (err) { errno = err; return -1; }
+    return 0;
+}
+
+// streams the source into the given absolute blocks, one copy per contiguous
+// stretch of blocks. Host data goes host -> image through copy_file_range when
+// possible, otherwise through copy_pipelined(); a buffer source is written directly,
+// every stretch queued at once. Only the tail of the last block is zero-filled.
+static int copy_host_data(image_t *im, const add_src_t *src, const uint32_t *blocks, uint64_t n, char *why, size_t whylen) {
+    static const uint8_t zeros[BS];
+    copy_bufs_t bufs = {{0}};
+    vsfs_io_batch_t batch = {0}; // buffer-source writes and zero fills
+    uint64_t hoff = 0;
+    uint64_t i = 0;
+    int rc = -1;
+    while (i < n) {
+        uint64_t run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run) run++;
+        uint64_t remaining = src->size - hoff;
+        size_t bytes = remaining < run * BS ? (size_t)remaining : (size_t)(run * BS);
+        uint64_t dst = (uint64_t)blocks[i] * BS;
+        image_wrote(im, dst, run * BS);
+
+        // zero_copy is shared by concurrent adds; it only ever goes from 1 to 0
+        if (src->fd < 0) {
+            image_queue_write(im, &batch, src->buf + hoff, bytes, dst);
+        } else if (__atomic_load_n(&im->zero_copy, __ATOMIC_RELAXED) && bytes > 0) {
+            int r = copy_host_range(im, src->fd, hoff, dst, bytes);
+            if (r < 0) { snprintf(why, whylen, "copy host file: %s", errno == EIO ? "short read" : strerror(errno)); goto out; }
+            if (r > 0) { __atomic_store_n(&im->zero_copy, 0, __ATOMIC_RELAXED); continue; } // redo this stretch with pread/pwrite
+        } else if (bytes > 0) {
+            int host;
+            if (copy_pipelined(&im->io, &bufs, src->fd, hoff, im->fd, dst, bytes, &host) != 0) {
+                if (host) snprintf(why, whylen, "read host file: %s", errno == EIO ? "short read" : strerror(errno));
+                else snprintf(why, whylen, "write data blocks: %s", strerror(errno));
+                goto out;
+            }
+        }
+        // zero the unused tail of the last block (a whole block for an empty file)
+        if (bytes < run * BS) image_queue_write(im, &batch, zeros, run * BS - bytes, dst + bytes);
+        hoff += bytes;
+        i += run;
+    }
+    rc = 0;
+out:
+    if (vsfs_io_wait(&im->io, &batch) != 0 && rc == 0) {
+        snprintf(why, whylen, "write data blocks: %s", strerror(errno));
+        rc = -1;
+    }
+    copy_bufs_free(&bufs);
+    return rc;
+}
+
+// a new pointer block: written straight to the image, or with a journal logged
+// with the rest of the metadata (the caller then holds the lock)
+static int pointer_block_write(image_t *im, uint64_t blk, const uint32_t *table) {
+    if (!im->journal_blocks) return image_pwrite(im, table, BS, blk * BS);
+    uint8_t *b = image_block_new(im, blk);
+    if (!b) return -1;
+    memcpy(b, table, BS);
+    return 0;
+}
+
+// fills ino->direct[] and writes the indirect pointer blocks (taken from ptrs in order)
+static int map_file_blocks(image_t *im, inode_t *ino, const uint32_t *data, uint64_t n, const uint32_t *ptrs, char *why, size_t whylen) {
+    uint64_t nd = n < DIRECT_MAX ? n : DIRECT_MAX;
+    for (uint64_t i = 0; i < nd; i++) ino->direct[i] = data[i];
+    if (n <= DIRECT_MAX) return 0;
+    data += DIRECT_MAX; n -= DIRECT_MAX;
+
+    uint32_t table[PTRS_PER_BLOCK];
+    uint64_t take = n < PTRS_PER_BLOCK ? n : PTRS_PER_BLOCK;
+    memset(table, 0, sizeof(table));
+    memcpy(table, data, take * sizeof(uint32_t));
+    ino->reserved_0 = *ptrs;
+    if (pointer_block_write(im, *ptrs++, table) != 0) goto io_fail;
+    data += take; n -= take;
+    if (n == 0) return 0;
+
+    uint32_t top[PTRS_PER_BLOCK];
+    memset(top, 0, sizeof(top));
+    ino->reserved_1 = *ptrs;
+    uint64_t top_blk = *ptrs++;
+    for (uint64_t t = 0; n > 0; t++) {
+        take = n < PTRS_PER_BLOCK ? n : PTRS_PER_BLOCK;
+        memset(table, 0, sizeof(table));
+        memcpy(table, data, take * sizeof(uint32_t));
+        top[t] = *ptrs;
+        if (pointer_block_write(im, *ptrs++, table) != 0) goto io_fail;
+        data += take; n -= take;
+    }
+    if (pointer_block_write(im, top_blk, top) != 0) goto io_fail;
+    return 0;
+
+io_fail:
+    snprintf(why, whylen, "write pointer block: %s", strerror(errno));
+    return -1;
+}
+
+// ---------------------------- block deduplication -----------------------------
+
+static void dedup_slot_put(dedup_t *dd, size_t idx) {
+    size_t mask = dd->nslots - 1;
+    size_t i = (dd->entries[idx].crc * 0x9E3779B1u) & mask;
+    while (dd->slots[i]) i = (i + 1) & mask;
+    dd->slots[i] = (uint32_t)idx + 1;
+    i = (dd->entries[idx].block * 0x9E3779B1u) & mask;
+    while (dd->bslots[i]) i = (i + 1) & mask;
+    dd->bslots[i] = (uint32_t)idx + 1;
+}
+
+static int64_t dedup_add(dedup_t *dd, uint32_t crc, uint32_t block, uint32_t refs) {
+    if (dd->count == dd->cap) {
+        size_t ncap = dd->cap ? dd->cap * 2 : 1024;
+        dedup_entry_t *ne = realloc(dd->entries, ncap * sizeof(dedup_entry_t));
+        if (!ne) return -1;
+        dd->entries = ne;
+        dd->cap = ncap;
+    }
+    if ((dd->count + 1) * 2 > dd->nslots) {
+        size_t nslots = dd->nslots ? dd->nslots * 2 : 2048;
+        uint32_t *ns = calloc(nslots, sizeof(uint32_t));
+        uint32_t *nb = calloc(nslots, sizeof(uint32_t));
+        if (!ns || !nb) { free(ns); free(nb); return -1; }
+        free(dd->slots);
+        free(dd->bslots);
+        dd->slots = ns;
+        dd->bslots = nb;
+        dd->nslots = nslots;
+        for (size_t i = 0; i < dd->count; i++) dedup_slot_put(dd, i);
+    }
+    dd->entries[dd->count] = (dedup_entry_t){ .crc = crc, .block = block, .refs = refs };
+    dedup_slot_put(dd, dd->count);
+    return (int64_t)dd->count++;
+}
+
+// live entry for absolute block blk, or -1 when the block is not in the index
+static int64_t dedup_by_block(const dedup_t *dd, uint32_t blk) {
+    if (dd->nslots == 0) return -1;
+    size_t mask = dd->nslots - 1;
+    for (size_t i = (blk * 0x9E3779B1u) & mask; dd->bslots[i]; i = (i + 1) & mask) {
+        size_t idx = dd->bslots[i] - 1;
+        if (dd->entries[idx].block == blk && dd->entries[idx].refs) return (int64_t)idx;
+    }
+    return -1;
+}
+
+static int block_is_zero(const uint8_t *blk) {
+    static const uint8_t zero[BS];
+    return memcmp(blk, zero, BS) == 0;
+}
+
+// entry whose block holds exactly data, or -1
+static int64_t dedup_find(image_t *im, uint32_t crc, const uint8_t *data) {
+    dedup_t *dd = &im->dedup;
+    if (dd->nslots == 0) return -1;
+    int zero = block_is_zero(data);
+    if (zero && dd->zero_entry >= 0 && dd->entries[dd->zero_entry].refs > 0) return dd->zero_entry;
+    uint8_t cand[BS];
+    size_t mask = dd->nslots - 1;
+    for (size_t i = (crc * 0x9E3779B1u) & mask; dd->slots[i]; i = (i + 1) & mask) {
+        size_t idx = dd->slots[i] - 1;
+        dedup_entry_t *e = &dd->entries[idx];
+        if (e->crc != crc || e->refs == 0) continue;
+        uint64_t rel = e->block - im->sb.data_region_start;
+        if (e->block < im->sb.data_region_start || rel >= im->sb.data_region_blocks || !vsfs_bm_get(&im->data_bm, rel)) continue;
+        if (pread_full(im->fd, cand, BS, (uint64_t)e->block * BS) != 0) continue;
+        if (memcmp(cand, data, BS) == 0) {
+            if (zero) dd->zero_entry = (int64_t)idx;
+            return (int64_t)idx;
+        }
+    }
+    return -1;
+}
+
+// a missing index is an image nothing was shared in yet; one that exists but cannot
+// be used is an error, since an empty index would let a removal free shared blocks
+static int dedup_load(image_t *im, const char *path, char *why, size_t whylen) {
+    dedup_t *dd = &im->dedup;
+    dd->enabled = 1;
+    dd->zero_entry = -1;
+    dd->path = strdup(path);
+    if (!dd->path) { snprintf(why, whylen, "malloc"); return -1; }
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        if (errno == ENOENT) return 0; // first dedup run on this image
+        snprintf(why, whylen, "open dedup index %s: %s", path, strerror(errno));
+        return -1;
+    }
+    dedup_file_hdr_t h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != DEDUP_MAGIC || h.version != 1) {
+        snprintf(why, whylen, "dedup index %s is unreadable", path);
+        fclose(f); return -1;
+    }
+    if (h.total_blocks != im->sb.total_blocks || h.data_region_start != im->sb.data_region_start) {
+        snprintf(why, whylen, "dedup index %s belongs to a different image geometry", path);
+        fclose(f); return -1;
+    }
+    for (uint64_t i = 0; i < h.count; i++) {
+        dedup_entry_t e;
+        if (fread(&e, sizeof(e), 1, f) != 1) {
+            snprintf(why, whylen, "dedup index %s is truncated", path);
+            fclose(f); return -1;
+        }
+        if (e.refs && (e.block < h.data_region_start || e.block >= h.total_blocks)) {
+            snprintf(why, whylen, "dedup index %s names block %u outside the data region", path, e.block);
+            fclose(f); return -1;
+        }
+        if (e.refs && dedup_add(dd, e.crc, e.block, e.refs) < 0) {
+            snprintf(why, whylen, "malloc dedup index");
+            fclose(f); return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+// rewrites the sidecar atomically (temp file + rename), dropping dead entries
+static int dedup_save(image_t *im, char *why, size_t whylen) {
+    dedup_t *dd = &im->dedup;
+    size_t plen = strlen(dd->path) + 5;
+    char *tmp = malloc(plen);
+    if (!tmp) { snprintf(why, whylen, "malloc"); return -1; }
+    snprintf(tmp, plen, "%s.tmp", dd->path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) { snprintf(why, whylen, "open dedup index: %s", strerror(errno)); free(tmp); return -1; }
+    dedup_file_hdr_t h = { .magic = DEDUP_MAGIC, .version = 1, .total_blocks = im->sb.total_blocks,
+                           .data_region_start = im->sb.data_region_start, .count = 0 };
+    for (size_t i = 0; i < dd->count; i++) if (dd->entries[i].refs) h.count++;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (size_t i = 0; ok && i < dd->count; i++) {
+        if (dd->entries[i].refs) ok = fwrite(&dd->entries[i], sizeof(dedup_entry_t), 1, f) == 1;
+    }
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, dd->path) != 0) {
+        snprintf(why, whylen, "write dedup index: %s", strerror(errno));
+        unlink(tmp); free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+static void dedup_free(dedup_t *dd) {
+    free(dd->path);
+    free(dd->entries);
+    free(dd->slots);
+    free(dd->bslots);
+}
+
+// dedup variant of copy_host_data(): hashes every block, points at an identical
+// existing block where there is one and allocates (contiguously, per chunk) and
+// writes only the rest. Data bitmap bits are set as it goes; on failure every
+// allocation and reference taken for this file is rolled back.
+static int copy_host_data_dedup(image_t *im, const add_src_t *src, uint32_t *blocks, uint64_t n, uint64_t *shared, char *why, size_t whylen) {
+    dedup_t *dd = &im->dedup;
+    superblock_t *sb = &im->sb;
+    uint8_t *buf = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    uint8_t *wbuf = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    int64_t *undo = malloc(n * sizeof(int64_t));    // entry index per block; new entries stored as -(idx + 1)
+    if (!buf || !wbuf || !undo) { snprintf(why, whylen, "malloc dedup buffers"); free(buf); free(wbuf); free(undo); return -1; }
+    uint64_t nundo = 0;
+    uint64_t remaining = src->size;
+    *shared = 0;
+    int rc = -1;
+
+    for (uint64_t base = 0; base < n; base += COPY_CHUNK_BLOCKS) {
+        uint64_t cn = n - base < COPY_CHUNK_BLOCKS ? n - base : COPY_CHUNK_BLOCKS;
+        size_t bytes = remaining < cn * BS ? (size_t)remaining : (size_t)(cn * BS);
+        if (bytes > 0 && src_read(src, buf, bytes, src->size - remaining) != 0) {
+            snprintf(why, whylen, "read host file: %s", errno == EIO ? "short read" : strerror(errno));
+            goto fail;
+        }
+        memset(buf + bytes, 0, cn * BS - bytes);
+        remaining -= bytes;
+
+        uint32_t crcs[COPY_CHUNK_BLOCKS];
+        int64_t match[COPY_CHUNK_BLOCKS];   // existing entry, or -(j + 2) for "same as new block j", or -1 new
+        uint32_t fresh[COPY_CHUNK_BLOCKS];  // chunk offsets of blocks that need writing
+        uint64_t k = 0;
+        for (uint64_t i = 0; i < cn; i++) {
+            const uint8_t *blk = buf + i * BS;
+            crcs[i] = vsfs_crc32(blk, BS);
+            match[i] = dedup_find(im, crcs[i], blk);
+            if (match[i] >= 0) continue;
+            for (uint64_t j = 0; j < k; j++) {
+                if (crcs[fresh[j]] == crcs[i] && memcmp(buf + (uint64_t)fresh[j] * BS, blk, BS) == 0) { match[i] = -(int64_t)j - 2; break; }
+            }
+            if (match[i] == -1) fresh[k++] = (uint32_t)i;
+        }
+
+        uint32_t rel[COPY_CHUNK_BLOCKS];
+        if (allocate_blocks(im, k, rel) < k) { snprintf(why, whylen, "not enough free data blocks"); goto fail; }
+        for (uint64_t j = 0; j < k; j++) memcpy(wbuf + j * BS, buf + (uint64_t)fresh[j] * BS, BS);
+        vsfs_io_batch_t batch = {0};
+        for (uint64_t j = 0; j < k; ) {
+            uint64_t run = 1;
+            while (j + run < k && rel[j + run] == rel[j] + run) run++;
+            image_queue_write(im, &batch, wbuf + j * BS, run * BS, (sb->data_region_start + rel[j]) * BS);
+            j += run;
+        }
+        if (vsfs_io_wait(&im->io, &batch) != 0) {
+            snprintf(why, whylen, "write data blocks: %s", strerror(errno));
+            goto fail;
+        }
+
+        uint8_t is_fresh[COPY_CHUNK_BLOCKS] = {0};
+        for (uint64_t j = 0; j < k; j++) {
+            bitmap_set(im, &im->data_bm, sb->data_bitmap_start, rel[j]);
+            im->data_bm.cursor = rel[j] + 1;
+            int64_t idx = dedup_add(dd, crcs[fresh[j]], (uint32_t)(sb->data_region_start + rel[j]), 1);
+            if (idx < 0) {
+                snprintf(why, whylen, "malloc dedup index");
+                for (; j < k; j++) bitmap_clear(im, &im->data_bm, sb->data_bitmap_start, rel[j]);
+                goto fail;
+            }
+            if (block_is_zero(buf + (uint64_t)fresh[j] * BS)) dd->zero_entry = idx;
+            undo[nundo++] = -idx - 1;
+            match[fresh[j]] = idx;
+            is_fresh[fresh[j]] = 1;
+        }
+        for (uint64_t i = 0; i < cn; i++) {
+            int64_t idx = match[i] <= -2 ? match[fresh[-match[i] - 2]] : match[i];
+            blocks[base + i] = dd->entries[idx].block;
+            if (is_fresh[i]) continue; // written above, its entry starts with one reference
+            dd->entries[idx].refs++;
+            undo[nundo++] = idx;
+            (*shared)++;
+        }
+    }
+    rc = 0;
+    goto out;
+
+fail:
+    while (nundo > 0) {
+        int64_t u = undo[--nundo];
+        if (u < 0) {
+            dedup_entry_t *e = &dd->entries[-u - 1];
+            e->refs = 0;
+            bitmap_clear(im, &im->data_bm, sb->data_bitmap_start, e->block - sb->data_region_start);
+        } else {
+            dd->entries[u].refs--;
+        }
+    }
+out:
+    free(buf); free(wbuf); free(undo);
+    return rc;
+}
+
+// drops the references the n data blocks of a file being rolled back took in
+// copy_host_data_dedup(), freeing the blocks it wrote; those were never committed
+static void dedup_unref(image_t *im, const uint32_t *blocks, uint64_t n) {
+    dedup_t *dd = &im->dedup;
+    for (uint64_t i = 0; i < n; i++) {
+        int64_t e = dedup_by_block(dd, blocks[i]);
+        if (e < 0 || --dd->entries[e].refs > 0) continue;
+        bitmap_clear(im, &im->data_bm, im->sb.data_bitmap_start, blocks[i] - im->sb.data_region_start);
+    }
+}
+
+// writes a tail fragment into the open tail block, first taking a new one when it
+// does not fit. Runs under the lock as the last step of an add, so a failure only
+// has to undo its own block and a fragment is never left without an owner.
+static int tail_store(image_t *im, const uint8_t *data, size_t len, uint64_t *addr, int *opened, char *why, size_t whylen) {
+    superblock_t *sb = &im->sb;
+    uint64_t prev_blk = im->tail_blk, prev_fill = im->tail_fill;
+    *opened = 0;
+    if (!im->tail_blk || im->tail_fill + len > BS) {
+        uint32_t rel;
+        uint64_t t0 = STAT_BEGIN();
+        uint64_t got = allocate_blocks(im, 1, &rel);
+        STAT_END(PH_ALLOC, t0);
+        if (got < 1) { snprintf(why, whylen, "not enough free data blocks (0 available, 1 needed for a tail block)"); return -1; }
+        bitmap_set(im, &im->data_bm, sb->data_bitmap_start, rel);
+        im->data_bm.cursor = rel + 1;
+        im->tail_blk = sb->data_region_start + rel;
+        im->tail_fill = 0;
+        *opened = 1;
+    }
+    *addr = im->tail_blk * BS + im->tail_fill;
+    if (image_pwrite(im, data, len, *addr) != 0) {
+        snprintf(why, whylen, "write tail block: %s", strerror(errno));
+        if (*opened) bitmap_clear(im, &im->data_bm, sb->data_bitmap_start, im->tail_blk - sb->data_region_start);
+        im->tail_blk = prev_blk;
+        im->tail_fill = prev_fill;
+        *opened = 0;
+        return -1;
+    }
+    im->tail_fill += len;
+    return 0;
+}
+
+// adds one file to the root directory; on rejection nothing in the image is
+// modified and *why explains it.
+// Several threads may add at once: the inode, the dirent and the blocks are taken
+// under im->lock, which is then dropped while the data is copied (dedup keeps it,
+// since sharing consults the table block by block). The new inode is published
+// under the lock again. Until then the add is in flight and vsfs_sync() waits for
+// it, so a half-added file never reaches the disk.
+// upper bound on the blocks adding a file of host_size bytes can dirty: its pointer
+// blocks, the data bitmap blocks its run spans, a rebuilt or updated root index,
+// and a handful of single blocks (superblock, two inode table blocks, inode
+// bitmap, dirent block, a new directory block and its bitmap block, a new tail
+// block's bitmap block)
+static uint64_t add_journal_estimate(const image_t *im, uint64_t host_size) {
+    uint64_t n = (host_size + BS - 1) / BS;
+    uint64_t est = 9 + pointer_blocks_for(n) + (n + pointer_blocks_for(n)) / BITS_PER_BLOCK + 2;
+    const dir_t *d = &im->root;
+    if (((uint64_t)d->hdr.used + d->hdr.tombstones + 1) * 4 > (uint64_t)d->hdr.nslots * 3)
+        est += dir_index_blocks(dir_index_size_for((uint64_t)d->hdr.used + 1)) + 1;
+    else if (!d->index_blk)
+        est += dir_index_blocks(d->hdr.nslots) + 1; // an index so far only in memory
+    else
+        est += 2; // index header and one slot block
+    return est;
+}
+
+static int add_source(image_t *im, const char *name_in, const add_src_t *src, vsfs_add_result_t *res, char *why, size_t whylen) {
+    superblock_t *sb = &im->sb;
+    uint32_t *allocated_blocks = NULL;
+    int rc = -1;
+
+    uint64_t host_size = src->size;
+    if (host_size > MAX_FILE_BLOCKS * BS) {
+        snprintf(why, whylen, "file too large: max %" PRIu64 " bytes", MAX_FILE_BLOCKS * BS);
+        return -1;
+    }
+
+    // at most 57 bytes so the 58-byte name field stays NUL-terminated
+    size_t len = strlen(name_in);
+    if (len == 0) { snprintf(why, whylen, "empty file name"); return -1; }
+    if (len > 57) { snprintf(why, whylen, "name longer than 57 bytes"); return -1; }
+    if (strchr(name_in, '/')) { snprintf(why, whylen, "name contains '/'"); return -1; }
+    char name[58];
+    memset(name, 0, sizeof(name));
+    memcpy(name, name_in, len);
+
+    // packed small files: up to VSFS_INLINE_MAX bytes go into the inode itself, and
+    // the last partial block of anything else into a shared tail block
+    int packed = im->pack_small && !(src->flags & IFL_COMPRESSED);
+    int inline_data = packed && host_size <= VSFS_INLINE_MAX;
+    size_t small_len = inline_data ? (size_t)host_size : packed ? (size_t)(host_size % BS) : 0;
+
+    uint64_t journal_need = 0; // blocks this add may dirty, held in txn_reserved while it runs
+    pthread_mutex_lock(&im->lock);
+    for (;;) {
+        while (im->committing) pthread_cond_wait(&im->idle, &im->lock);
+        if (im->broken) { snprintf(why, whylen, "image handle is unusable after an earlier write failure"); goto out; }
+        if (!im->journal_blocks) break;
+        uint64_t est = add_journal_estimate(im, host_size);
+        if (est > journal_room(im)) {
+            snprintf(why, whylen, "needs up to %" PRIu64 " journal blocks, the journal has room for %" PRIu64, est, journal_room(im));
+            goto out;
+        }
+        if (im->txn_blocks + im->txn_reserved + est <= journal_room(im)) {
+            journal_need = est;
+            im->txn_reserved += est;
+            break;
+        }
+        // commit what is pending now rather than outgrow the journal
+        pthread_mutex_unlock(&im->lock);
+        int synced = vsfs_sync(im, why, whylen) == 0;
+        pthread_mutex_lock(&im->lock);
+        if (!synced) goto out;
+    }
+
+    // room to remember the inode until the next sync (one slot per add in flight),
+    // taken before anything changes
+    if (im->n_pending + im->inflight == im->cap_pending) {
+        size_t ncap = im->cap_pending ? im->cap_pending * 2 : 64;
+        uint64_t *np = realloc(im->pending, ncap * sizeof(uint64_t));
+        if (!np) { snprintf(why, whylen, "malloc pending list"); goto out; }
+        im->pending = np;
+        im->cap_pending = ncap;
+    }
+    time_t now = time(NULL);
+    im->now = now;
+
+    uint64_t t0 = STAT_BEGIN();
+    int64_t existing = dir_lookup(im, &im->root, name);
+    STAT_END(PH_DIR, t0);
+    if (existing == -2) { snprintf(why, whylen, "read root directory: %s", strerror(errno)); goto out; }
+    if (existing >= 0) { snprintf(why, whylen, "'%s' already exists in root", name); goto out; }
+
+    // compute how many data blocks needed, plus indirect pointer blocks past DIRECT_MAX
+    uint64_t need_blocks = (host_size - small_len + BS - 1) / BS;
+    if (need_blocks == 0 && !packed) need_blocks = 1; // an unpacked zero-length file still occupies a block
+    uint64_t ptr_blocks = pointer_blocks_for(need_blocks);
+    uint64_t total_need = need_blocks + ptr_blocks;
+    int dedup = im->dedup.enabled;
+    // pointer blocks, and with dedup off the data blocks too (dedup may share the data)
+    uint64_t take = dedup ? ptr_blocks : total_need;
+
+    // the free counts turn a full image away before anything is searched or reserved
+    if (im->inode_bm.nfree == 0) { snprintf(why, whylen, "no free inode available"); goto out; }
+    // every file in root counts in its 16-bit link count (adds in flight already do)
+    if (im->inode_table[0].links == UINT16_MAX) { snprintf(why, whylen, "root directory is full (link count)"); goto out; }
+    if (take > im->data_bm.nfree) {
+        snprintf(why, whylen, "not enough free data blocks (%" PRIu64 " available, %" PRIu64 " needed)", im->data_bm.nfree, take);
+        goto out;
+    }
+
+    // find free inode (next-fit from where the previous file's inode went)
+    t0 = STAT_BEGIN();
+    uint64_t inode_index = vsfs_bm_find_zero(&im->inode_bm); // 0-based index into table
+    STAT_END(PH_ALLOC, t0);
+    if (inode_index == VSFS_BM_NONE) {
+        snprintf(why, whylen, "no free inode available"); goto out;
+    }
+    uint64_t inode_no = inode_index + 1; // 1-based inode number
+
+    // reserve the dirent slot and index room first: growing the directory allocates
+    // blocks, which must not collide with the data blocks picked below
+    uint64_t dirent_pos;
+    t0 = STAT_BEGIN();
+    int reserved = dir_reserve_slot(im, &im->root, &dirent_pos) == 0 && dir_index_reserve(im, &im->root) == 0;
+    STAT_END(PH_DIR, t0);
+    if (!reserved) { snprintf(why, whylen, "grow root directory: %s", strerror(errno)); goto out; }
+
+    allocated_blocks = malloc((total_need ? total_need : 1) * sizeof(uint32_t));
+    if (!allocated_blocks) { snprintf(why, whylen, "malloc block list"); goto out; }
+    uint64_t runs = 0, shared = 0;
+
+    // pointer blocks, and with dedup off the data blocks too; data comes first in the
+    // list so a contiguous allocation keeps the file data in one run. Bits are set
+    // right away so concurrent adds cannot pick the same blocks.
+    uint32_t *list = dedup ? allocated_blocks + need_blocks : allocated_blocks;
+    t0 = STAT_BEGIN();
+    uint64_t got = allocate_blocks(im, take, list);
+    STAT_END(PH_ALLOC, t0);
+    if (got < take) {
+        snprintf(why, whylen, "not enough free data blocks (%" PRIu64 " available, %" PRIu64 " needed)", im->data_bm.nfree, take);
+        goto out;
+    }
+    if (!dedup) runs = count_runs(allocated_blocks, need_blocks);
+    for (uint64_t i = 0; i < take; i++) {
+        bitmap_set(im, &im->data_bm, sb->data_bitmap_start, list[i]);
+        list[i] += (uint32_t)sb->data_region_start; // absolute from here on
+    }
+    if (take) im->data_bm.cursor = list[take - 1] - sb->data_region_start + 1;
+
+    // the inode bit and the entry are taken now so the name and number are ours;
+    // the inode itself is only filled in once its data is in place
+    bitmap_set(im, &im->inode_bm, sb->inode_bitmap_start, inode_index);
+    im->inode_bm.cursor = inode_index + 1;
+    t0 = STAT_BEGIN();
+    int inserted = dir_insert(im, &im->root, dirent_pos, name, (uint32_t)inode_no, 1) == 0;
+    STAT_END(PH_DIR, t0);
+    if (!inserted) {
+        // bitmaps are already taken; a half-written entry must never reach the disk
+        snprintf(why, whylen, "write root directory entry: %s", strerror(errno));
+        im->broken = 1;
+        goto out;
+    }
+    // update root inode: size increases by 64, links++ (spec says root links increases by 1)
+    im->inode_table[0].size_bytes += sizeof(dirent64_t);
+    im->inode_table[0].links += 1;
+    im->inflight++;
+
+    // write file data (and the pointer blocks), outside the lock unless deduplicating
+    if (!dedup) pthread_mutex_unlock(&im->lock);
+    t0 = STAT_BEGIN();
+    int copied = need_blocks == 0 ||
+                 (dedup ? copy_host_data_dedup(im, src, allocated_blocks, need_blocks, &shared, why, whylen) == 0
+                        : copy_host_data(im, src, allocated_blocks, need_blocks, why, whylen) == 0);
+    // a failed dedup copy has already let go of its references, a later failure must
+    int dedup_refs = dedup && copied && need_blocks > 0;
+    // the bytes stored outside whole blocks are read now and placed under the lock
+    uint8_t small[BS];
+    if (copied && small_len && src_read(src, small, small_len, host_size - small_len) != 0) {
+        snprintf(why, whylen, "read host file: %s", errno == EIO ? "short read" : strerror(errno));
+        copied = 0;
+    }
+    STAT_END(PH_COPY, t0);
+    if (dedup && copied) runs = count_runs(allocated_blocks, need_blocks);
+
+    // fill inode fields for new inode
+    inode_t new_ino;
+    memset(&new_ino, 0, sizeof(inode_t));
+    new_ino.mode = 0100000u; // regular file (octal)
+    new_ino.links = 1;
+    new_ino.uid = 0;
+    new_ino.gid = 0;
+    new_ino.size_bytes = (src->flags & IFL_COMPRESSED) ? src->file_size : host_size;
+    new_ino.reserved_2 = src->flags;
+    if (src->flags & IFL_COMPRESSED) new_ino.xattr_ptr = host_size;
+    new_ino.atime = (uint64_t)now;
+    new_ino.mtime = (uint64_t)now;
+    new_ino.ctime = (uint64_t)now;
+    new_ino.proj_id = 8;
+    // pointer blocks go through the cache when journaled, which needs the lock
+    int journaled = im->journal_blocks != 0;
+    if (copied && !journaled && map_file_blocks(im, &new_ino, allocated_blocks, need_blocks, allocated_blocks + need_blocks, why, whylen) != 0) copied = 0;
+    if (!dedup) pthread_mutex_lock(&im->lock);
+    if (copied && journaled && map_file_blocks(im, &new_ino, allocated_blocks, need_blocks, allocated_blocks + need_blocks, why, whylen) != 0) copied = 0;
+    int tail_opened = 0;
+    if (copied && inline_data) {
+        memcpy((uint8_t *)&new_ino + offsetof(inode_t, direct), small, small_len); // over direct[] and reserved_0/1
+        new_ino.reserved_2 |= IFL_INLINE;
+    } else if (copied && small_len) {
+        if (tail_store(im, small, small_len, &new_ino.xattr_ptr, &tail_opened, why, whylen) != 0) copied = 0;
+        else new_ino.reserved_2 |= IFL_TAIL;
+    }
+
+    im->inflight--;
+    if (!copied) {
+        // give back everything taken above (dedup data blocks by reference)
+        if (dedup_refs) dedup_unref(im, allocated_blocks, need_blocks);
+        for (uint64_t i = dedup ? need_blocks : 0; i < total_need; i++) {
+            bitmap_clear(im, &im->data_bm, sb->data_bitmap_start, allocated_blocks[i] - sb->data_region_start);
+            if (i >= need_blocks) cache_forget(im, allocated_blocks[i]);
+        }
+        bitmap_clear(im, &im->inode_bm, sb->inode_bitmap_start, inode_index);
+        if (dir_remove(im, &im->root, dirent_pos) != 0) im->broken = 1;
+        im->inode_table[0].size_bytes -= sizeof(dirent64_t);
+        im->inode_table[0].links -= 1;
+        goto out;
+    }
+
+    // crc is finalized once per batch in image_finalize()
+    im->inode_table[inode_index] = new_ino;
+    inode_dirty(im, inode_index);
+
+    im->pending[im->n_pending++] = inode_no;
+    res->ino = inode_no;
+    res->blocks = total_need - shared + (uint64_t)tail_opened;
+    res->runs = runs;
+    res->shared = shared;
+    res->size = new_ino.size_bytes;
+    res->stored = host_size;
+    res->packed = small_len;
+    res->inlined = inline_data;
+    rc = 0;
+
+out:
+    im->txn_reserved -= journal_need;
+    if (im->inflight == 0) pthread_cond_broadcast(&im->idle);
+    pthread_mutex_unlock(&im->lock);
+    free(allocated_blocks);
+    return rc;
+}
+
+// recomputes the CRCs touched by the batch exactly once
+static void image_finalize(image_t *im, const uint64_t *added_inodes, size_t n_added) {
+    for (size_t i = 0; i < n_added; i++) inode_crc_finalize(&im->inode_table[added_inodes[i] - 1]);
+
+    im->inode_table[0].mtime = (uint64_t)im->now;
+    im->inode_table[0].ctime = (uint64_t)im->now;
+    inode_crc_finalize(&im->inode_table[0]); // update root inode CRC
+    inode_dirty(im, 0);
+
+    // recompute superblock checksum safely and write it into meta[0..BS)
+    uint8_t tmp_sb_block[BS];
+    memset(tmp_sb_block, 0, BS);
+    memcpy(tmp_sb_block, &im->sb, sizeof(superblock_t));
+    free_summary_store(tmp_sb_block, &im->inode_bm, &im->data_bm);
+    // call finalize on block (DO NOT CHANGE function expects full block)
+    superblock_crc_finalize((superblock_t*)tmp_sb_block);
+    memcpy(im->meta, tmp_sb_block, BS);
+    mark_dirty(im, 0);
+}
+
+static int cmp_cached_blk(const void *a, const void *b) {
+    uint64_t x = (*(cached_block_t * const *)a)->blk, y = (*(cached_block_t * const *)b)->blk;
+    return x < y ? -1 : x > y;
+}
+
+// writes back only the blocks the batch touched, coalescing adjacent metadata blocks.
+// Everything is queued as one batch, so the writes are in flight together; nothing
+// is marked clean unless all of them made it.
+static int image_flush(image_t *im, char *why, size_t whylen) {
+    cached_block_t **dirty = malloc((im->n_cache + 1) * sizeof(cached_block_t*));
+    if (!dirty) { snprintf(why, whylen, "malloc"); return -1; }
+    vsfs_io_batch_t batch = {0};
+    for (uint64_t b = 0; b < im->meta_blocks; ) {
+        if (!im->meta_dirty[b]) { b++; continue; }
+        uint64_t e = b;
+        while (e < im->meta_blocks && im->meta_dirty[e]) e++;
+        image_queue_write(im, &batch, im->meta + b * BS, (e - b) * BS, b * BS);
+        b = e;
+    }
+    // dirty data-region blocks go out in block order
+    size_t nd = 0;
+    for (size_t i = 0; i < im->cap_cache; i++) if (im->cache[i].blk && im->cache[i].dirty) dirty[nd++] = &im->cache[i];
+    qsort(dirty, nd, sizeof(cached_block_t*), cmp_cached_blk);
+    for (size_t i = 0; i < nd; i++) image_queue_write(im, &batch, dirty[i]->buf, BS, dirty[i]->blk * BS);
+    if (vsfs_io_wait(&im->io, &batch) != 0) { snprintf(why, whylen, "write metadata: %s", strerror(errno)); free(dirty); return -1; }
+    memset(im->meta_dirty, 0, im->meta_blocks);
+    for (size_t i = 0; i < nd; i++) dirty[i]->dirty = 0;
+    free(dirty);
+    im->txn_blocks = 0;
+    return 0;
+}
+
+// builds the compressed stream of src (see IFL_COMPRESSED). Returns 1 with the
+// stream in *out when it takes fewer blocks than the raw data, 0 when the file is
+// better stored raw, -1 on a read error.
+static int compress_source(const add_src_t *src, uint8_t **out, uint64_t *out_len, char *why, size_t whylen) {
+    const uint64_t cluster = 1ull << ZCLUSTER_SHIFT;
+    uint64_t n = (src->size + cluster - 1) / cluster;
+    uint64_t limit = ((src->size + BS - 1) / BS - 1) * BS; // one block less than raw, or not worth it
+    uint64_t len = zstream_table_bytes(n);
+    if (len >= limit) return 0;
+
+    int rc = -1;
+    size_t cap = len + cluster < limit ? (size_t)(len + cluster) : (size_t)limit;
+    uint8_t *stream = malloc(cap);
+    uint8_t *raw = malloc(cluster);
+    uint8_t *z = malloc(cluster);
+    if (!stream || !raw || !z) { snprintf(why, whylen, "malloc compression buffers"); goto out; }
+    zstream_hdr_t hdr = { .magic = ZSTREAM_MAGIC, .cluster_shift = ZCLUSTER_SHIFT, .nclusters = n };
+    memcpy(stream, &hdr, sizeof(hdr));
+    uint64_t *offsets = (uint64_t *)(stream + sizeof(hdr));
+    for (uint64_t i = 0; i < n; i++) {
+        size_t rn = src->size - i * cluster < cluster ? (size_t)(src->size - i * cluster) : (size_t)cluster;
+        if (src_read(src, raw, rn, i * cluster) != 0) {
+            snprintf(why, whylen, "read host file: %s", errno == EIO ? "short read" : strerror(errno));
+            goto out;
+        }
+        // a cluster that does not shrink is kept raw
+        size_t zn = vsfs_lz_compress(raw, rn, z, rn - 1);
+        const uint8_t *piece = zn ? z : raw;
+        size_t pn = zn ? zn : rn;
+        if (len + pn >= limit) { rc = 0; goto out; }
+        if (len + pn > cap) {
+            while (cap < len + pn) cap = cap * 2 < limit ? cap * 2 : (size_t)limit;
+            uint8_t *ns = realloc(stream, cap);
+            if (!ns) { snprintf(why, whylen, "malloc compression buffers"); goto out; }
+            stream = ns;
+            offsets = (uint64_t *)(stream + sizeof(hdr));
+        }
+        offsets[i] = len;
+        memcpy(stream + len, piece, pn);
+        len += pn;
+    }
+    offsets[n] = len;
+    *out = stream;
+    *out_len = len;
+    stream = NULL;
+    rc = 1;
+out:
+    free(stream);
+    free(raw);
+    free(z);
+    return rc;
+}
+
+// adds src, compressed first when the handle asks for it and that saves blocks;
+// compression runs before add_source() so it never holds the image lock
+static int add_file(image_t *im, const char *name, const add_src_t *src, vsfs_add_result_t *res, char *why, size_t whylen) {
+    if (!im->compress || src->size <= BS) return add_source(im, name, src, res, why, whylen);
+    uint8_t *stream = NULL;
+    uint64_t len = 0;
+    uint64_t t0 = STAT_BEGIN();
+    int packed = compress_source(src, &stream, &len, why, whylen);
+    STAT_END(PH_COMPRESS, t0);
+    if (packed < 0) return -1;
+    if (packed == 0) return add_source(im, name, src, res, why, whylen);
+    add_src_t zs = { .fd = -1, .buf = stream, .size = len, .flags = IFL_COMPRESSED, .file_size = src->size };
+    int rc = add_source(im, name, &zs, res, why, whylen);
+    free(stream);
+    return rc;
+}
+
+// ---------------------------------- API ------------------------------------
+
+int vsfs_open(const char *input, const char *output, vsfs_image_t **out, char *why, size_t whylen) {
+    pthread_once(&crc_once, crc_setup);
+    image_t *im = malloc(sizeof(*im));
+    if (!im) { snprintf(why, whylen, "malloc"); return -1; }
+    uint64_t t0 = STAT_BEGIN();
+    int opened = image_open(im, input, output, 0, why, whylen) == 0;
+    STAT_END(PH_OPEN, t0);
+    if (!opened) { free(im); return -1; }
+    *out = im;
+    return 0;
+}
+
+void vsfs_set_alloc_policy(vsfs_image_t *im, int policy) {
+    im->alloc_policy = policy;
+}
+
+void vsfs_set_compression(vsfs_image_t *im, int on) {
+    im->compress = on;
+}
+
+void vsfs_set_packing(vsfs_image_t *im, int on) {
+    im->pack_small = on;
+    im->tail_blk = 0;
+    im->tail_fill = 0;
+    if (!on) return;
+    // keep filling the tail block holding the highest fragment, which is where the
+    // last run left off; the inode table is in memory, so two passes are cheap
+    uint64_t top = 0;
+    for (uint64_t i = 0; i < im->sb.inode_count; i++) {
+        const inode_t *in = &im->inode_table[i];
+        if (in->mode && (in->reserved_2 & IFL_TAIL) && in->xattr_ptr > top) top = in->xattr_ptr;
+    }
+    if (top == 0) return;
+    im->tail_blk = top / BS;
+    for (uint64_t i = 0; i < im->sb.inode_count; i++) {
+        const inode_t *in = &im->inode_table[i];
+        if (!in->mode || !(in->reserved_2 & IFL_TAIL) || in->xattr_ptr / BS != im->tail_blk) continue;
+        uint64_t end = in->xattr_ptr % BS + in->size_bytes % BS;
+        if (end > im->tail_fill) im->tail_fill = end;
+    }
+}
+
+int vsfs_enable_dedup(vsfs_image_t *im, const char *index_path, char *why, size_t whylen) {
+    return vsfs_enable_dedup_from(im, index_path, NULL, why, whylen);
+}
+
+int vsfs_enable_dedup_from(vsfs_image_t *im, const char *index_path, const char *seed_path, char *why, size_t whylen) {
+    if (im->dedup.enabled) return 0;
+    char *path = NULL;
+    if (dedup_load(im, seed_path ? seed_path : index_path, why, whylen) != 0) goto fail;
+    if (seed_path && !(path = strdup(index_path))) {
+        snprintf(why, whylen, "malloc");
+        goto fail;
+    }
+    if (seed_path) {
+        // the copy exists from now on, even if nothing is ever committed
+        free(im->dedup.path);
+        im->dedup.path = path;
+        if (dedup_save(im, why, whylen) != 0) goto fail;
+    }
+    return 0;
+fail:
+    dedup_free(&im->dedup);
+    memset(&im->dedup, 0, sizeof(im->dedup));
+    return -1;
+}
+
+int vsfs_add_fd(vsfs_image_t *im, const char *name, int fd, vsfs_add_result_t *res, char *why, size_t whylen) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) { snprintf(why, whylen, "stat host file: %s", strerror(errno)); return -1; }
+    if (!S_ISREG(st.st_mode)) { snprintf(why, whylen, "not a regular file"); return -1; }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    add_src_t src = { .fd = fd, .buf = NULL, .size = (uint64_t)st.st_size };
+    return add_file(im, name, &src, res, why, whylen);
+}
+
+int vsfs_add_buffer(vsfs_image_t *im, const char *name, const void *data, size_t len,
+                    vsfs_add_result_t *res, char *why, size_t whylen) {
+    add_src_t src = { .fd = -1, .buf = data, .size = len };
+    return add_file(im, name, &src, res, why, whylen);
+}
+
+static int lookup_locked(image_t *im, const char *name, vsfs_stat_t *st) {
+    if (strlen(name) > 57) { errno = ENOENT; return -1; }
+    int64_t pos = dir_lookup(im, &im->root, name);
+    if (pos == -2) return -1;
+    if (pos < 0) { errno = ENOENT; return -1; }
+    dirent64_t *de = dir_entry(im, &im->root, (uint64_t)pos);
+    if (!de) return -1;
+    if (de->inode_no == 0 || de->inode_no > im->sb.inode_count) { errno = EIO; return -1; }
+    const inode_t *ino = &im->inode_table[de->inode_no - 1];
+    if (ino->mode == 0) { errno = ENOENT; return -1; } // still being added
+    st->ino = de->inode_no;
+    st->mode = ino->mode;
+    st->links = ino->links;
+    st->size = ino->size_bytes;
+    st->mtime = ino->mtime;
+    return 0;
+}
+
+int vsfs_lookup(vsfs_image_t *im, const char *name, vsfs_stat_t *st) {
+    pthread_mutex_lock(&im->lock);
+    int rc = lookup_locked(im, name, st);
+    pthread_mutex_unlock(&im->lock);
+    return rc;
+}
+
+// copies [off, off + len) of the bytes an inode's blocks hold. Reads of adjacent
+// blocks are merged, and all of them are queued before waiting once.
+static int read_stored(image_t *im, const inode_t *in, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    size_t done = 0;
+    vsfs_io_batch_t batch = {0};
+    size_t run_at = 0, run_len = 0; // pending read into p + run_at from image offset run_off
+    uint64_t run_off = 0;
+    int rc = -1;
+    while (done < len) {
+        uint64_t pos = off + done;
+        uint64_t b;
+        size_t boff = (size_t)(pos % BS);
+        size_t n = BS - boff < len - done ? BS - boff : len - done;
+        if ((in->reserved_2 & IFL_TAIL) && pos / BS == in->size_bytes / BS) {
+            // the last partial block is a fragment of a shared tail block
+            uint64_t a = in->xattr_ptr;
+            if (a / BS < im->sb.data_region_start || a / BS >= im->sb.total_blocks || a % BS + in->size_bytes % BS > BS) { errno = EIO; goto out; }
+            vsfs_io_read(&im->io, &batch, im->fd, p + run_at, run_len, run_off);
+            run_len = 0;
+            vsfs_io_read(&im->io, &batch, im->fd, p + done, n, a + boff);
+            done += n;
+            continue;
+        }
+        if (inode_get_block(im, in, pos / BS, &b) != 0) goto out;
+        if (b == 0) {
+            memset(p + done, 0, n);
+        } else if (b >= im->sb.total_blocks) {
+            errno = EIO;
+            goto out;
+        } else {
+            // blocks still held in the cache (directories, pointer blocks) are read from there
+            cached_block_t *c = b < im->meta_blocks ? NULL : cache_slot(im, b);
+            if (b < im->meta_blocks) memcpy(p + done, im->meta + b * BS + boff, n);
+            else if (c && c->blk == b) memcpy(p + done, c->buf + boff, n);
+            else if (run_len && run_at + run_len == done && run_off + run_len == b * BS + boff) run_len += n;
+            else {
+                vsfs_io_read(&im->io, &batch, im->fd, p + run_at, run_len, run_off);
+                run_at = done;
+                run_off = b * BS + boff;
+                run_len = n;
+            }
+        }
+        done += n;
+    }
+    vsfs_io_read(&im->io, &batch, im->fd, p + run_at, run_len, run_off);
+    rc = 0;
+out:
+    if (vsfs_io_wait(&im->io, &batch) != 0) rc = -1;
+    return rc;
+}
+
+// reads [off, off + len) of a compressed file, decompressing the clusters it spans
+static int read_compressed(image_t *im, const inode_t *in, uint8_t *buf, size_t len, uint64_t off) {
+    zstream_hdr_t hdr;
+    if (in->xattr_ptr < sizeof(hdr) || read_stored(im, in, &hdr, sizeof(hdr), 0) != 0) return -1;
+    const uint64_t cluster = 1ull << ZCLUSTER_SHIFT;
+    if (hdr.magic != ZSTREAM_MAGIC || hdr.cluster_shift != ZCLUSTER_SHIFT ||
+        hdr.nclusters != (in->size_bytes + cluster - 1) / cluster || zstream_table_bytes(hdr.nclusters) > in->xattr_ptr) {
+        errno = EIO;
+        return -1;
+    }
+    int rc = -1;
+    uint8_t *raw = malloc(cluster), *z = malloc(cluster);
+    if (!raw || !z) goto out;
+    for (size_t done = 0; done < len; ) {
+        uint64_t i = (off + done) >> ZCLUSTER_SHIFT;
+        uint64_t o[2];
+        if (read_stored(im, in, o, sizeof(o), sizeof(hdr) + i * sizeof(uint64_t)) != 0) goto out;
+        size_t rn = in->size_bytes - i * cluster < cluster ? (size_t)(in->size_bytes - i * cluster) : (size_t)cluster;
+        if (o[1] < o[0] || o[1] - o[0] > rn || o[1] > in->xattr_ptr) { errno = EIO; goto out; }
+        size_t zn = (size_t)(o[1] - o[0]);
+        if (read_stored(im, in, z, zn, o[0]) != 0) goto out;
+        if (zn == rn) memcpy(raw, z, rn);
+        else if (vsfs_lz_decompress(z, zn, raw, rn) != (long)rn) { errno = EIO; goto out; }
+        size_t from = (size_t)(off + done - i * cluster);
+        size_t n = rn - from < len - done ? rn - from : len - done;
+        memcpy(buf + done, raw + from, n);
+        done += n;
+    }
+    rc = 0;
+out:
+    free(raw);
+    free(z);
+    return rc;
+}
+
+static ssize_t read_locked(image_t *im, uint64_t ino, void *buf, size_t len, uint64_t off) {
+    if (ino == 0 || ino > im->sb.inode_count || !vsfs_bm_get(&im->inode_bm, ino - 1)) { errno = ENOENT; return -1; }
+    const inode_t *in = &im->inode_table[ino - 1];
+    if (off >= in->size_bytes) return 0;
+    if (len > in->size_bytes - off) len = (size_t)(in->size_bytes - off);
+    if (in->reserved_2 & IFL_INLINE) {
+        if (in->size_bytes > VSFS_INLINE_MAX) { errno = EIO; return -1; }
+        memcpy(buf, (const uint8_t *)in + offsetof(inode_t, direct) + off, len);
+        return (ssize_t)len;
+    }
+    int rc = (in->reserved_2 & IFL_COMPRESSED) ? read_compressed(im, in, buf, len, off) : read_stored(im, in, buf, len, off);
+    return rc == 0 ? (ssize_t)len : -1;
+}
+
+ssize_t vsfs_read(vsfs_image_t *im, uint64_t ino, void *buf, size_t len, uint64_t off) {
+    pthread_mutex_lock(&im->lock);
+    ssize_t n = read_locked(im, ino, buf, len, off);
+    pthread_mutex_unlock(&im->lock);
+    return n;
+}
+
+size_t vsfs_replayed(const vsfs_image_t *im) {
+    return im->replayed;
+}
+
+size_t vsfs_pending(vsfs_image_t *im) {
+    pthread_mutex_lock(&im->lock);
+    size_t n = im->n_pending;
+    pthread_mutex_unlock(&im->lock);
+    return n;
+}
+
+void vsfs_free_space(vsfs_image_t *im, uint64_t *inodes, uint64_t *blocks) {
+    pthread_mutex_lock(&im->lock);
+    *inodes = im->inode_bm.nfree;
+    // blocks released under a journal are free as soon as the next commit lands
+    *blocks = im->data_bm.nfree + im->n_deferred;
+    pthread_mutex_unlock(&im->lock);
+}
+
+// writes back everything changed since the last commit in one pass; the caller
+// holds the lock with committing set and no adds in flight
+static int commit_locked(image_t *im, char *why, size_t whylen) {
+    int rc = 0;
+    if (im->broken) {
+        snprintf(why, whylen, "image handle is unusable after an earlier write failure");
+        rc = -1;
+    } else if (im->n_pending > 0 || im->txn_blocks > 0) {
+        // blocks whose release waited for this commit become free as part of it.
+        // One that a logged transaction wrote (a pointer, directory or index block)
+        // would get those old contents back from a replay after new file data went
+        // there, so then the journal is emptied once this commit is home.
+        int relogged = 0;
+        for (size_t i = 0; i < im->n_deferred; i++) {
+            uint64_t rel = im->deferred[i] - im->sb.data_region_start;
+            if (im->journal_homes && (im->journal_homes[rel / 8] >> (rel % 8)) & 1) relogged = 1;
+            bitmap_clear(im, &im->data_bm, im->sb.data_bitmap_start, rel);
+        }
+        im->n_deferred = 0;
+        uint64_t t0 = STAT_BEGIN();
+        image_finalize(im, im->pending, im->n_pending);
+        STAT_END(PH_CRC, t0);
+        t0 = STAT_BEGIN();
+        if (im->journal_blocks) {
+            rc = journal_commit(im, why, whylen);
+            if (rc == 0) rc = image_flush(im, why, whylen);
+            if (rc == 0 && relogged) rc = journal_close(im, why, whylen);
+            // the transaction may be logged while its blocks are not home yet; only a
+            // replay at the next open can tell, so this handle writes nothing more
+            if (rc != 0) im->broken = 1;
+        } else {
+            rc = image_flush(im, why, whylen);
+        }
+        // the index is only written after the blocks it describes are in the image
+        if (rc == 0 && im->dedup.enabled) rc = dedup_save(im, why, whylen);
+        STAT_END(PH_WRITE, t0);
+        if (rc == 0) im->n_pending = 0;
+    }
+    return rc;
+}
+
+// group commit: waits for the adds in flight, then writes back everything added
+// since the last sync in one pass; new adds wait until it is done
+int vsfs_sync(vsfs_image_t *im, char *why, size_t whylen) {
+    pthread_mutex_lock(&im->lock);
+    while (im->committing) pthread_cond_wait(&im->idle, &im->lock);
+    im->committing = 1;
+    while (im->inflight) pthread_cond_wait(&im->idle, &im->lock);
+    int rc = commit_locked(im, why, whylen);
+    im->committing = 0;
+    pthread_cond_broadcast(&im->idle);
+    pthread_mutex_unlock(&im->lock);
+    return rc;
+}
+
+int vsfs_close(vsfs_image_t *im, char *why, size_t whylen) {
+    int rc = im->track && !im->delta_done ? vsfs_write_delta(im, NULL, why, whylen) : vsfs_sync(im, why, whylen);
+    // after a failure the journal is left as it is, for the next open to replay
+    if (rc == 0 && im->journal_blocks && !im->broken) rc = journal_close(im, why, whylen);
+    if (im->track) unlink(im->scratch_path); // the delta holds everything it was for
+    image_close(im);
+    free(im);
+    return rc;
+}
+
+// ----------------------------- removal and compaction -----------------------------
+
+// the blocks a regular file owns: its n data blocks (n = inode_mapped_blocks) and
+// then its pointer blocks, in the order map_file_blocks() lays them out. Returns
+// the number of pointer blocks, or -1 with errno set (EIO for a mapping that points
+// outside the data region).
+static int64_t file_blocks(image_t *im, const inode_t *ino, uint64_t n, uint32_t *data, uint32_t *ptrs) {
+    for (uint64_t l = 0; l < n; l++) {
+        uint64_t b;
+        if (inode_get_block(im, ino, l, &b) != 0) return -1;
+        if (b < im->sb.data_region_start || b >= im->sb.total_blocks) { errno = EIO; return -1; }
+        data[l] = (uint32_t)b;
+    }
+    // every data block is mapped, so every pointer block on the way exists
+    int64_t np = 0;
+    if (n > DIRECT_MAX) ptrs[np++] = ino->reserved_0;
+    if (n > DIRECT_MAX + PTRS_PER_BLOCK) {
+        const uint32_t *top = (const uint32_t *)image_block(im, ino->reserved_1);
+        if (!top) return -1;
+        ptrs[np++] = ino->reserved_1;
+        for (uint64_t t = 0; t * PTRS_PER_BLOCK < n - DIRECT_MAX - PTRS_PER_BLOCK; t++) ptrs[np++] = top[t];
+    }
+    for (int64_t i = 0; i < np; i++) {
+        if (ptrs[i] < im->sb.data_region_start || ptrs[i] >= im->sb.total_blocks) { errno = EIO; return -1; }
+    }
+    return np;
+}
+
+// whether a file other than inode index skip keeps a tail fragment in block blk
+static int tail_block_shared(const image_t *im, uint64_t blk, uint64_t skip) {
+    for (uint64_t i = 0; i < im->sb.inode_count; i++) {
+        const inode_t *in = &im->inode_table[i];
+        if (i != skip && in->mode && (in->reserved_2 & IFL_TAIL) && in->xattr_ptr / BS == blk) return 1;
+    }
+    return 0;
+}
+
+int vsfs_remove(vsfs_image_t *im, const char *name, uint64_t *freed, char *why, size_t whylen) {
+    superblock_t *sb = &im->sb;
+    dedup_t *dd = &im->dedup;
+    uint32_t *blocks = NULL;
+    uint64_t journal_need = 0;
+    int rc = -1;
+    if (freed) *freed = 0;
+
+    pthread_mutex_lock(&im->lock);
+    int64_t pos;
+    uint64_t idx, n;
+    for (;;) {
+        while (im->committing) pthread_cond_wait(&im->idle, &im->lock);
+        if (im->broken) { snprintf(why, whylen, "image handle is unusable after an earlier write failure"); goto out; }
+        pos = strlen(name) <= 57 ? dir_lookup(im, &im->root, name) : -1;
+        const dirent64_t *de = pos >= 0 ? dir_entry(im, &im->root, (uint64_t)pos) : NULL;
+        if (pos == -2 || (pos >= 0 && !de)) { snprintf(why, whylen, "read root directory: %s", strerror(errno)); goto out; }
+        // a file still being added has its entry but no inode yet
+        if (!de || de->inode_no == 0 || (de->inode_no <= sb->inode_count && im->inode_table[de->inode_no - 1].mode == 0)) {
+            snprintf(why, whylen, "no file '%s' in root", name);
+            goto out;
+        }
+        if (de->inode_no > sb->inode_count) { snprintf(why, whylen, "'%s' names invalid inode %u", name, de->inode_no); goto out; }
+        idx = de->inode_no - 1;
+        const inode_t *ino = &im->inode_table[idx];
+        if ((ino->mode & 0170000u) != 0100000u) { snprintf(why, whylen, "'%s' is not a regular file", name); goto out; }
+        n = inode_mapped_blocks(ino);
+        if (n > MAX_FILE_BLOCKS) { snprintf(why, whylen, "'%s' has a size no block map can hold", name); goto out; }
+        if (!im->journal_blocks) break;
+        // the inode table, inode bitmap, dirent, index slot and index header blocks,
+        // the superblock, and the data bitmap blocks of the released blocks
+        uint64_t spread = n + pointer_blocks_for(n) + 1;
+        uint64_t est = 6 + (spread < sb->data_bitmap_blocks ? spread : sb->data_bitmap_blocks);
+        if (!im->root.index_blk) est += dir_index_blocks(im->root.hdr.nslots) + 1; // written out first
+        if (est > journal_room(im)) {
+            snprintf(why, whylen, "needs up to %" PRIu64 " journal blocks, the journal has room for %" PRIu64, est, journal_room(im));
+            goto out;
+        }
+        if (im->txn_blocks + im->txn_reserved + est <= journal_room(im)) {
+            journal_need = est;
+            im->txn_reserved += est;
+            break;
+        }
+        pthread_mutex_unlock(&im->lock);
+        int synced = vsfs_sync(im, why, whylen) == 0;
+        pthread_mutex_lock(&im->lock);
+        if (!synced) goto out;
+    }
+
+    // everything that can fail is done before the image is touched
+    inode_t *ino = &im->inode_table[idx];
+    uint64_t np = pointer_blocks_for(n);
+    blocks = malloc((n + np + 1) * sizeof(uint32_t));
+    if (!blocks) { snprintf(why, whylen, "malloc block list"); goto out; }
+    if (file_blocks(im, ino, n, blocks, blocks + n) < 0) { snprintf(why, whylen, "read block map of '%s': %s", name, strerror(errno)); goto out; }
+    // a tail block goes with the last fragment in it
+    uint64_t tail = 0;
+    if ((ino->reserved_2 & IFL_TAIL) && ino->xattr_ptr / BS >= sb->data_region_start && ino->xattr_ptr / BS < sb->total_blocks &&
+        !tail_block_shared(im, ino->xattr_ptr / BS, idx)) tail = ino->xattr_ptr / BS;
+    if (im->journal_blocks && deferred_reserve(im, n + np + 1) != 0) { snprintf(why, whylen, "malloc deferred list"); goto out; }
+    if (dir_index_attach(im, &im->root) != 0) { snprintf(why, whylen, "write root directory index: %s", strerror(errno)); goto out; }
+
+    // a data block shared through the dedup index only loses a reference
+    uint64_t released = 0;
+    for (uint64_t i = 0; i < n + np; i++) {
+        if (i < n && dd->enabled) {
+            int64_t e = dedup_by_block(dd, blocks[i]);
+            if (e >= 0 && --dd->entries[e].refs > 0) continue;
+        }
+        block_release(im, blocks[i]);
+        released++;
+    }
+    if (tail) {
+        block_release(im, tail);
+        released++;
+        if (im->tail_blk == tail) { im->tail_blk = 0; im->tail_fill = 0; }
+    }
+
+    // a file added since the last sync no longer needs its CRC finalized
+    for (size_t i = 0; i < im->n_pending; i++) {
+        if (im->pending[i] == idx + 1) { im->pending[i] = im->pending[--im->n_pending]; break; }
+    }
+    memset(ino, 0, sizeof(*ino));
+    inode_dirty(im, idx);
+    bitmap_clear(im, &im->inode_bm, sb->inode_bitmap_start, idx);
+    if (dir_remove(im, &im->root, (uint64_t)pos) != 0) {
+        snprintf(why, whylen, "remove root directory entry: %s", strerror(errno));
+        im->broken = 1;
+        goto out;
+    }
+    im->inode_table[0].size_bytes -= sizeof(dirent64_t);
+    im->inode_table[0].links -= 1;
+    im->now = time(NULL);
+    if (freed) *freed = released;
+    rc = 0;
+
+out:
+    im->txn_reserved -= journal_need;
+    pthread_mutex_unlock(&im->lock);
+    free(blocks);
+    return rc;
+}
+
+// vsfs_compact() has the handle to itself: adds, reads and syncs wait for it. It
+// first packs the root directory, moving its last entries into the first free
+// slots and releasing the directory blocks left empty. Then it visits the files in
+// the order their data lies in the data region and slides each one down into the
+// lowest free run that holds it in one piece, so the holes left by removed files
+// close up and the free space gathers at the end. A file is copied before its inode points at the copy, and
+// its old blocks are released with block_release(), so with a journal a crash
+// leaves every file either where it was or where it went. Blocks referenced by
+// more than one file (dedup) are left where they are.
+
+// longest run of free bits
+static uint64_t largest_free_run(const vsfs_bitmap_t *bm) {
+    uint64_t best = 0;
+    for (uint64_t pos = 0; pos < bm->nbits; ) {
+        uint64_t start = vsfs_bm_next_zero(bm, pos, bm->nbits);
+        if (start == VSFS_BM_NONE) break;
+        uint64_t end = vsfs_bm_next_one(bm, start, bm->nbits);
+        if (end - start > best) best = end - start;
+        pos = end + 1;
+    }
+    return best;
+}
+
+// commits the work done so far when est more dirty blocks might not fit in the
+// current journal transaction; returns 1 if they never fit
+static int compact_room(image_t *im, uint64_t est, char *why, size_t whylen) {
+    if (!im->journal_blocks) return 0;
+    if (est > journal_room(im)) return 1;
+    if (im->txn_blocks + est <= journal_room(im)) return 0;
+    return commit_locked(im, why, whylen);
+}
+
+// shortens directory d to its first keep blocks, releasing the others and the
+// pointer blocks that only mapped them; returns the number released or -1
+static int64_t dir_truncate(image_t *im, dir_t *d, uint64_t keep) {
+    inode_t *ino = &im->inode_table[d->inode_index];
+    int64_t released = 0;
+    if (im->journal_blocks && deferred_reserve(im, d->nblocks - keep + pointer_blocks_for(d->nblocks)) != 0) return -1;
+    for (uint64_t l = keep; l < d->nblocks; l++) {
+        if (inode_set_block(im, d->inode_index, l, 0) != 0) return -1;
+        block_release(im, d->blocks[l]);
+        released++;
+    }
+    if (ino->reserved_1) {
+        uint32_t *top = (uint32_t *)image_block(im, ino->reserved_1);
+        if (!top) return -1;
+        for (uint64_t t = 0; t < PTRS_PER_BLOCK; t++) {
+            if (!top[t] || DIRECT_MAX + PTRS_PER_BLOCK + t * PTRS_PER_BLOCK < keep) continue;
+            block_release(im, top[t]);
+            top[t] = 0;
+            mark_dirty(im, ino->reserved_1);
+            released++;
+        }
+        if (keep <= DIRECT_MAX + PTRS_PER_BLOCK) { block_release(im, ino->reserved_1); ino->reserved_1 = 0; released++; }
+    }
+    if (ino->reserved_0 && keep <= DIRECT_MAX) { block_release(im, ino->reserved_0); ino->reserved_0 = 0; released++; }
+    inode_dirty(im, d->inode_index);
+    d->nblocks = keep;
+    return released;
+}
+
+static int compact_dir(image_t *im, vsfs_compact_result_t *res, char *why, size_t whylen) {
+    dir_t *d = &im->root;
+    uint64_t hole = 0, end = d->nblocks * DIRENTS_PER_BLOCK; // no entry at or past end
+    int dense = 0;
+    for (;;) {
+        dirent64_t *de = NULL;
+        for (; hole < end; hole++) {
+            if (!(de = dir_entry(im, d, hole))) goto io_fail;
+            if (!de->inode_no) break;
+        }
+        for (; end > hole; end--) {
+            if (!(de = dir_entry(im, d, end - 1))) goto io_fail;
+            if (de->inode_no) break;
+        }
+        if (hole >= end) { dense = 1; break; }
+        // two dirent blocks, two index slot blocks and the index header, and before
+        // the first move an index so far only in memory, with its bitmap blocks and
+        // the root inode
+        uint64_t nblk = d->index_blk ? 0 : dir_index_blocks(d->hdr.nslots);
+        int r = compact_room(im, 5 + (nblk ? 2 * nblk + 1 : 0), why, whylen);
+        if (r < 0) return -1;
+        if (r > 0) break;
+        if (!(de = dir_entry(im, d, end - 1))) goto io_fail;
+        dirent64_t e = *de;
+        if (dir_index_attach(im, d) != 0) {
+            if (errno != ENOSPC) goto broken;
+            break; // the entries stay where they are
+        }
+        if (dir_remove(im, d, end - 1) != 0 || dir_insert(im, d, hole, e.name, e.inode_no, e.type) != 0) goto broken;
+        res->dirents_moved++;
+        hole++;
+        end--;
+    }
+    if (!dense) return 0;
+
+    d->hdr.free_hint = (uint32_t)end;
+    uint64_t keep = (end + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+    if (keep == 0) keep = 1;
+    if (keep < d->nblocks) {
+        // the inode table block, the pointer blocks and the data bitmap blocks
+        uint64_t ptrs = pointer_blocks_for(d->nblocks), spread = d->nblocks - keep + ptrs;
+        int r = compact_room(im, 1 + ptrs + (spread < im->sb.data_bitmap_blocks ? spread : im->sb.data_bitmap_blocks), why, whylen);
+        if (r < 0) return -1;
+        if (r == 0) {
+            int64_t k = dir_truncate(im, d, keep);
+            if (k < 0) goto broken;
+            res->dir_blocks_freed = (uint64_t)k;
+        }
+    }
+
+    // a fresh index drops the tombstones and fits the entries left. One no larger
+    // is rewritten at the start of the run the old one has, so nothing moves
+    uint32_t want = dir_index_size_for(d->hdr.used);
+    // an index within the load dir_index_reserve() allows keeps its size
+    if (want > d->hdr.nslots && (uint64_t)d->hdr.used * 4 <= (uint64_t)d->hdr.nslots * 3) want = d->hdr.nslots;
+    if (!d->index_blk) {
+        // one only in memory was built for the entries there are
+    } else if (want < d->hdr.nslots || (want == d->hdr.nslots && d->hdr.tombstones)) {
+        uint64_t old = dir_index_blocks(d->hdr.nslots), spread = old - dir_index_blocks(want);
+        int r = compact_room(im, 2 + old + (spread < im->sb.data_bitmap_blocks ? spread : im->sb.data_bitmap_blocks), why, whylen);
+        if (r < 0) return -1;
+        if (r == 0) {
+            if (dir_index_shrink(im, d, want) != 0) goto broken;
+            res->dir_blocks_freed += spread;
+            return 0;
+        }
+    } else if (want > d->hdr.nslots) {
+        uint64_t old = dir_index_blocks(d->hdr.nslots), nblk = dir_index_blocks(want) + old;
+        int r = compact_room(im, 2 + nblk + (nblk < im->sb.data_bitmap_blocks ? nblk : im->sb.data_bitmap_blocks), why, whylen);
+        if (r < 0) return -1;
+        if (r == 0) {
+            // the new run is searched from the start, like the files' runs below
+            im->data_bm.cursor = im->data_bm.low;
+            if (dir_index_build(im, d, want) == 0) {
+                res->index_blocks_moved = dir_index_blocks(want);
+                res->dir_blocks_freed += old;
+                return 0;
+            }
+            if (errno != ENOSPC) goto broken; // without room for a new run the old index stays
+        }
+    }
+    if (dir_index_hdr_write(im, d) != 0) goto broken;
+    return 0;
+
+io_fail:
+    snprintf(why, whylen, "read root directory: %s", strerror(errno));
+    return -1;
+broken:
+    snprintf(why, whylen, "rewrite root directory: %s", strerror(errno));
+    im->broken = 1;
+    return -1;
+}
+
+// copies len bytes of the image from src to dst (the ranges do not overlap),
+// inside the kernel when it can, otherwise through copy_pipelined()
+static int image_copy(image_t *im, copy_bufs_t *bufs, uint64_t src, uint64_t dst, uint64_t len) {
+    image_wrote(im, dst, len);
+    if (__atomic_load_n(&im->zero_copy, __ATOMIC_RELAXED)) {
+        int r = copy_host_range(im, im->fd, src, dst, (size_t)len);
+        if (r <= 0) return r;
+        __atomic_store_n(&im->zero_copy, 0, __ATOMIC_RELAXED);
+    }
+    int host;
+    return copy_pipelined(&im->io, bufs, im->fd, src, im->fd, dst, len, &host);
+}
+
+// points the dedup entries of blocks a file moved away from at the blocks it moved to
+static void dedup_moved(image_t *im, const uint32_t *old, const uint32_t *now, uint64_t n) {
+    dedup_t *dd = &im->dedup;
+    for (uint64_t i = 0; i < n; i++) {
+        int64_t e = dedup_by_block(dd, old[i]);
+        if (e < 0) continue;
+        uint32_t crc = dd->entries[e].crc, refs = dd->entries[e].refs;
+        dd->entries[e].refs = 0;
+        // without memory for the new entry the block just stops being shareable
+        int64_t ne = dedup_add(dd, crc, now[i], refs);
+        if (dd->zero_entry == e) dd->zero_entry = ne;
+    }
+}
+
+// copies a file's data into the free run starting at data-region block rel,
+// points the inode at the copy and releases the old blocks: the n data and np
+// pointer blocks in old, as file_blocks() returned them. The pointer blocks go
+// right after the data when that is free, else into the first run below limit
+// (or anywhere), so a file exactly the size of a hole still fits in it.
+// 1 when there is no run for the pointer blocks.
+static int move_file(image_t *im, uint64_t idx, const uint32_t *old, uint64_t n, uint64_t np, uint64_t rel,
+                     uint64_t limit, copy_bufs_t *bufs, char *why, size_t whylen) {
+    superblock_t *sb = &im->sb;
+    vsfs_bitmap_t *bm = &im->data_bm;
+    uint64_t need = n + np;
+    uint32_t *blocks = malloc(need * sizeof(uint32_t));
+    if (!blocks || (im->journal_blocks && deferred_reserve(im, need) != 0)) {
+        snprintf(why, whylen, "malloc block list");
+        free(blocks);
+        return -1;
+    }
+    for (uint64_t i = 0; i < n; i++) bitmap_set(im, bm, sb->data_bitmap_start, rel + i);
+    uint64_t prel = rel + n;
+    if (np > 0 && vsfs_bm_find_run_in(bm, np, prel, prel + 1) != prel) {
+        prel = np <= limit ? vsfs_bm_find_run_in(bm, np, 0, limit - np + 1) : VSFS_BM_NONE;
+        if (prel == VSFS_BM_NONE) prel = vsfs_bm_find_run_in(bm, np, 0, bm->nbits);
+        if (prel == VSFS_BM_NONE) {
+            for (uint64_t i = 0; i < n; i++) bitmap_clear(im, bm, sb->data_bitmap_start, rel + i);
+            free(blocks);
+            return 1;
+        }
+    }
+    for (uint64_t i = 0; i < np; i++) bitmap_set(im, bm, sb->data_bitmap_start, prel + i);
+    for (uint64_t i = 0; i < need; i++)
+        blocks[i] = (uint32_t)(sb->data_region_start + (i < n ? rel + i : prel + i - n));
+    int rc = -1;
+    // one copy per stretch of the old data that is contiguous
+    for (uint64_t i = 0; i < n; ) {
+        uint64_t run = 1;
+        while (i + run < n && old[i + run] == old[i] + run) run++;
+        if (image_copy(im, bufs, (uint64_t)old[i] * BS, (uint64_t)blocks[i] * BS, run * BS) != 0) {
+            snprintf(why, whylen, "copy data blocks: %s", strerror(errno));
+            goto undo;
+        }
+        i += run;
+    }
+    inode_t ino = im->inode_table[idx];
+    memset(ino.direct, 0, sizeof(ino.direct));
+    ino.reserved_0 = 0;
+    ino.reserved_1 = 0;
+    if (map_file_blocks(im, &ino, blocks, n, blocks + n, why, whylen) != 0) goto undo;
+    inode_crc_finalize(&ino);
+    im->inode_table[idx] = ino;
+    inode_dirty(im, idx);
+    if (im->dedup.enabled) dedup_moved(im, old, blocks, n);
+    for (uint64_t i = 0; i < need; i++) block_release(im, old[i]);
+    rc = 0;
+    goto out;
+
+undo:
+    for (uint64_t i = 0; i < need; i++) {
+        bitmap_clear(im, bm, sb->data_bitmap_start, blocks[i] - sb->data_region_start);
+        if (i >= n) cache_forget(im, blocks[i]);
+    }
+out:
+    free(blocks);
+    return rc;
+}
+
+#define COMPACT_ROUNDS 4u  // passes over the files at most, while any of them move
+
+typedef struct {
+    uint32_t ino;            // inode index
+    uint32_t need;           // data and pointer blocks
+    uint32_t first;          // lowest of them, relative to the data region
+    uint32_t shared;         // a block also belongs to another file (dedup): it stays
+    uint32_t at;             // dry run: the run the file went to, UINT32_MAX if none yet
+} compact_file_t;
+
+// in the order the files lie in the data region
+static int cmp_compact_file(const void *a, const void *b) {
+    const compact_file_t *x = a, *y = b;
+    if (x->first != y->first) return x->first < y->first ? -1 : 1;
+    return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+typedef struct {
+    vsfs_bitmap_t *bm;       // the data bitmap, or a copy of it for a dry run
+    int dry;                 // only work out where the files would go
+    int keep_fragmented;     // leave fragmented files where they are
+    uint64_t floor;          // no move may leave every free run shorter than this, 0 = any move
+    uint64_t big;            // start of a free run of floor blocks, once one was looked for
+    compact_file_t *files;
+    size_t nfiles;
+    uint32_t *list;          // blocks of the file being placed
+    uint64_t *mine;          // the same as a bitmap
+    uint64_t *pend;          // blocks released but not committed yet, NULL without a journal
+    uint32_t *pended;        // the blocks set in pend
+    size_t npended, cap_pended;
+    copy_bufs_t bufs;
+} compact_state_t;
+
+// the 64 blocks from 64*w on that a file sliding down may take: free ones, its own
+// (mine) and ones released but not committed yet (pend, NULL to leave those out)
+static uint64_t slide_word(const vsfs_bitmap_t *bm, const uint64_t *mine, const uint64_t *pend, uint64_t w) {
+    return ~vsfs_bm_word(bm, w) | mine[w] | (pend ? pend[w] : 0);
+}
+
+// first block in [from, to) the file may take (take = 1) or may not (take = 0), or to
+static uint64_t slide_next(const vsfs_bitmap_t *bm, const uint64_t *mine, const uint64_t *pend, int take,
+                           uint64_t from, uint64_t to) {
+    while (from < to) {
+        uint64_t w = from / 64;
+        uint64_t v = slide_word(bm, mine, pend, w);
+        if (!take) v = ~v;
+        v &= ~(uint64_t)0 << (from % 64);
+        if (v) {
+            uint64_t idx = w * 64 + (uint64_t)__builtin_ctzll(v);
+            return idx < to ? idx : to;
+        }
+        from = (w + 1) * 64;
+    }
+    return to;
+}
+
+// lowest start at or after from of need blocks the file may take, or VSFS_BM_NONE
+static uint64_t slide_target(const vsfs_bitmap_t *bm, const uint64_t *mine, const uint64_t *pend,
+                             uint64_t need, uint64_t from) {
+    for (;;) {
+        from = slide_next(bm, mine, pend, 1, from, bm->nbits);
+        if (need > bm->nbits - from) return VSFS_BM_NONE;
+        uint64_t stop = slide_next(bm, mine, pend, 0, from, from + need);
+        if (stop == from + need) return from;
+        from = stop + 1;
+    }
+}
+
+// the blocks of file cf into cs->list (data, then pointer blocks) relative to the
+// data region: where a dry run put it, else as its inode maps them
+static int compact_blocks(image_t *im, compact_state_t *cs, const compact_file_t *cf, char *why, size_t whylen) {
+    const inode_t *ino = &im->inode_table[cf->ino];
+    uint64_t n = inode_mapped_blocks(ino);
+    if (cs->dry && cf->at != UINT32_MAX) {
+        for (uint64_t k = 0; k < cf->need; k++) cs->list[k] = cf->at + (uint32_t)k;
+        return 0;
+    }
+    if (file_blocks(im, ino, n, cs->list, cs->list + n) < 0) {
+        snprintf(why, whylen, "read block map of inode %" PRIu64 ": %s", (uint64_t)cf->ino + 1, strerror(errno));
+        return -1;
+    }
+    for (uint64_t k = 0; k < cf->need; k++) cs->list[k] -= (uint32_t)im->sb.data_region_start;
+    return 0;
+}
+
+// moves file cf to data-region block to, through the free run at via first unless
+// that is VSFS_BM_NONE; 1 if it stayed where it was
+static int compact_move(image_t *im, compact_state_t *cs, const compact_file_t *cf, uint64_t to, uint64_t via,
+                        uint64_t est, char *why, size_t whylen) {
+    superblock_t *sb = &im->sb;
+    uint64_t n = inode_mapped_blocks(&im->inode_table[cf->ino]), np = cf->need - n;
+    for (uint64_t k = 0; k < cf->need; k++) cs->list[k] += (uint32_t)sb->data_region_start;
+    if (via != VSFS_BM_NONE) {
+        int r = move_file(im, cf->ino, cs->list, n, np, via, cs->bm->nbits, &cs->bufs, why, whylen);
+        if (r != 0) return r;
+        // its old blocks are only free once the move is committed
+        if (im->journal_blocks && commit_locked(im, why, whylen) != 0) return -1;
+        if (compact_blocks(im, cs, cf, why, whylen) != 0) return -1;
+        for (uint64_t k = 0; k < cf->need; k++) cs->list[k] += (uint32_t)sb->data_region_start;
+        if (compact_room(im, est, why, whylen) < 0) return -1;
+    }
+    return move_file(im, cf->ino, cs->list, n, np, to, cs->bm->nbits, &cs->bufs, why, whylen);
+}
+
+// One pass over the files in the order they lie in the data region: each one
+// slides down to the lowest run that holds its data and pointer blocks, counting
+// its own blocks as free, so the blocks in use close up and the free ones gather
+// at the end. When that run overlaps the file, the file goes through a free run
+// further up first. A file in one piece that fits nowhere lower stays; a
+// fragmented one takes the first run that fits. Blocks released by earlier moves
+// are committed when a file needs them. Returns the number of files moved or -1.
+static int64_t compact_pass(image_t *im, compact_state_t *cs, vsfs_compact_result_t *res, char *why, size_t whylen) {
+    vsfs_bitmap_t *bm = cs->bm;
+    uint32_t *list = cs->list;
+    for (size_t f = 0; f < cs->nfiles; f++) {
+        compact_file_t *cf = &cs->files[f];
+        if (compact_blocks(im, cs, cf, why, whylen) != 0) return -1;
+        cf->first = UINT32_MAX;
+        for (uint64_t k = 0; k < cf->need; k++) if (list[k] < cf->first) cf->first = list[k];
+    }
+    qsort(cs->files, cs->nfiles, sizeof(compact_file_t), cmp_compact_file);
+
+    int64_t moved = 0;
+    for (size_t f = 0; f < cs->nfiles; f++) {
+        compact_file_t *cf = &cs->files[f];
+        uint64_t need = cf->need, n = inode_mapped_blocks(&im->inode_table[cf->ino]), np = need - n;
+        if (compact_blocks(im, cs, cf, why, whylen) != 0) return -1;
+        int fragmented = count_runs(list, n) > 1;
+        if (cf->shared || (fragmented && cs->keep_fragmented)) { res->skipped += fragmented; continue; }
+
+        // the inode table block, the superblock, the new pointer blocks and the data
+        // bitmap blocks of the new run and of the old blocks
+        uint64_t runs = count_runs(list, n);
+        uint64_t spread = runs + np < im->sb.data_bitmap_blocks ? runs + np : im->sb.data_bitmap_blocks;
+        uint64_t est = 4 + np + need / BITS_PER_BLOCK + spread;
+        int r = cs->dry ? im->journal_blocks && est > journal_room(im) : compact_room(im, est, why, whylen);
+        if (r < 0) return -1;
+        if (r > 0) { res->skipped += fragmented; continue; }
+
+        // the file's own blocks and the released ones count as free while looking
+        uint64_t from = bm->low;
+        for (uint64_t k = 0; k < need; k++) {
+            cs->mine[list[k] / 64] |= 1ull << (list[k] % 64);
+            if (list[k] < from) from = list[k];
+        }
+        uint64_t *pend = cs->dry ? NULL : cs->pend;
+        if (pend) {
+            for (size_t k = 0; k < cs->npended; k++) pend[cs->pended[k] / 64] = 0;
+            cs->npended = 0;
+            if (im->n_deferred > cs->cap_pended) {
+                uint32_t *pl = realloc(cs->pended, im->n_deferred * sizeof(uint32_t));
+                if (!pl) { snprintf(why, whylen, "malloc block list"); return -1; }
+                cs->pended = pl;
+                cs->cap_pended = im->n_deferred;
+            }
+            for (size_t k = 0; k < im->n_deferred; k++) {
+                uint64_t rel = im->deferred[k] - im->sb.data_region_start;
+                pend[rel / 64] |= 1ull << (rel % 64);
+                cs->pended[cs->npended++] = (uint32_t)rel;
+                if (rel < from) from = rel;
+            }
+        }
+        uint64_t to = slide_target(bm, cs->mine, pend, need, from), end = 0;
+        int waits = 0, overlaps = 0, in_place = 1;
+        if (to != VSFS_BM_NONE) {
+            end = slide_next(bm, cs->mine, pend, 0, to, bm->nbits);
+            waits = slide_next(bm, cs->mine, NULL, 0, to, to + need) != to + need;
+        }
+        for (uint64_t k = 0; k < need; k++) {
+            cs->mine[list[k] / 64] &= ~(1ull << (list[k] % 64));
+            if (to != VSFS_BM_NONE && list[k] >= to && list[k] < to + need) overlaps = 1;
+            else in_place = 0;
+        }
+        if (to == VSFS_BM_NONE) { res->skipped += fragmented; continue; }
+        if (!fragmented && (in_place || to > cf->first)) continue;
+        // the rest of the run is free after the move; unless that or another free
+        // run still holds floor blocks, the move would shorten the longest one
+        if (end - to - need < cs->floor) {
+            uint64_t big = cs->big, fl = cs->floor;
+            if (big == VSFS_BM_NONE || (big < end && big + fl > to) || vsfs_bm_next_one(bm, big, big + fl) != big + fl) {
+                big = vsfs_bm_find_run_in(bm, fl, 0, to);
+                if (big == VSFS_BM_NONE) big = vsfs_bm_find_run_in(bm, fl, end, bm->nbits);
+                cs->big = big;
+            }
+            if (big == VSFS_BM_NONE) { res->skipped += fragmented; continue; }
+        }
+        // blocks released by earlier moves are free once those are committed
+        if (waits && commit_locked(im, why, whylen) != 0) return -1;
+        uint64_t via = VSFS_BM_NONE;
+        if (overlaps) {
+            // a free run past the new place, to copy the file through
+            via = vsfs_bm_find_run_in(bm, need, to + need, bm->nbits);
+            if (via == VSFS_BM_NONE && !cs->dry && im->n_deferred > 0) {
+                if (commit_locked(im, why, whylen) != 0) return -1;
+                via = vsfs_bm_find_run_in(bm, need, to + need, bm->nbits);
+            }
+            if (via == VSFS_BM_NONE) { res->skipped += fragmented; continue; }
+        }
+        if (cs->dry) {
+            for (uint64_t k = 0; k < need; k++) vsfs_bm_clear(bm, list[k]);
+            for (uint64_t k = 0; k < need; k++) vsfs_bm_set(bm, to + k);
+            cf->at = (uint32_t)to;
+        } else {
+            r = compact_move(im, cs, cf, to, via, est, why, whylen);
+            if (r < 0) return -1;
+            if (r > 0) { res->skipped += fragmented; continue; }
+        }
+        moved++;
+        res->moved++;
+        res->blocks_moved += via == VSFS_BM_NONE ? need : 2 * need;
+        res->defragmented += fragmented;
+    }
+    return moved;
+}
+
+// Slides the files down (see compact_pass()), in passes while files move. Dry
+// runs on a copy of the data bitmap come first, with every file and then with
+// the fragmented ones left alone (whose old blocks may end up in holes no other
+// file fits): the first to end with a free run of floor blocks (the longest
+// before compaction) is done, the moves on the way there shortening that run for
+// a while at most. When neither does, no move may leave every run shorter.
+static int compact_files(image_t *im, uint64_t floor, vsfs_compact_result_t *res, char *why, size_t whylen) {
+    superblock_t *sb = &im->sb;
+    vsfs_bitmap_t *bm = &im->data_bm, sim = *bm;
+    uint64_t words = (bm->nbits + 63) / 64;
+    uint64_t *seen = calloc(words, sizeof(uint64_t));
+    uint64_t *dup = calloc(words, sizeof(uint64_t));
+    compact_state_t cs = { .big = VSFS_BM_NONE };
+    cs.mine = calloc(words, sizeof(uint64_t));
+    cs.pend = im->journal_blocks ? calloc(words, sizeof(uint64_t)) : NULL;
+    sim.bits = malloc((bm->nbits + 7) / 8);
+    sim.group_free = NULL;
+    size_t cap_files = 0;
+    uint64_t cap_list = 0;
+    int rc = -1;
+    if (!seen || !dup || !cs.mine || (im->journal_blocks && !cs.pend) || !sim.bits) {
+        snprintf(why, whylen, "malloc block maps");
+        goto out;
+    }
+
+    // every block of every file, to tell the blocks two files share
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        const inode_t *ino = &im->inode_table[i];
+        if ((ino->mode & 0170000u) != 0100000u) continue;
+        uint64_t n = inode_mapped_blocks(ino);
+        if (n == 0 || n > MAX_FILE_BLOCKS) continue;
+        uint64_t total = n + pointer_blocks_for(n);
+        if (total > cap_list) {
+            uint32_t *nl = realloc(cs.list, total * sizeof(uint32_t));
+            if (!nl) { snprintf(why, whylen, "malloc block list"); goto out; }
+            cs.list = nl;
+            cap_list = total;
+        }
+        if (cs.nfiles == cap_files) {
+            size_t ncap = cap_files ? cap_files * 2 : 256;
+            compact_file_t *nf = realloc(cs.files, ncap * sizeof(compact_file_t));
+            if (!nf) { snprintf(why, whylen, "malloc file list"); goto out; }
+            cs.files = nf;
+            cap_files = ncap;
+        }
+        compact_file_t *cf = &cs.files[cs.nfiles++];
+        *cf = (compact_file_t){ (uint32_t)i, (uint32_t)total, 0, 0, UINT32_MAX };
+        if (compact_blocks(im, &cs, cf, why, whylen) != 0) goto out;
+        for (uint64_t k = 0; k < total; k++) {
+            uint64_t rel = cs.list[k], m = 1ull << (rel % 64);
+            if (seen[rel / 64] & m) dup[rel / 64] |= m;
+            seen[rel / 64] |= m;
+        }
+        res->files++;
+        res->fragmented += count_runs(cs.list, n) > 1;
+    }
+    for (size_t f = 0; f < cs.nfiles; f++) {
+        compact_file_t *cf = &cs.files[f];
+        if (compact_blocks(im, &cs, cf, why, whylen) != 0) goto out;
+        for (uint64_t k = 0; k < cf->need && !cf->shared; k++) cf->shared = (dup[cs.list[k] / 64] >> (cs.list[k] % 64)) & 1;
+    }
+
+    cs.bm = &sim;
+    cs.dry = 1;
+    for (cs.keep_fragmented = 0; ; cs.keep_fragmented = 1) {
+        memcpy(sim.bits, bm->bits, (bm->nbits + 7) / 8);
+        sim.nfree = bm->nfree;
+        sim.low = bm->low;
+        for (size_t f = 0; f < cs.nfiles; f++) cs.files[f].at = UINT32_MAX;
+        for (unsigned round = 0; round < COMPACT_ROUNDS; round++) {
+            vsfs_compact_result_t r = {0};
+            int64_t moved = compact_pass(im, &cs, &r, why, whylen);
+            if (moved < 0) goto out;
+            if (moved == 0) break;
+        }
+        if (largest_free_run(&sim) >= floor) break;
+        if (cs.keep_fragmented) {
+            cs.keep_fragmented = 0;
+            cs.floor = floor;
+            break;
+        }
+    }
+
+    cs.bm = bm;
+    cs.dry = 0;
+    // a move leaves holes a later file may fit in, so go again while files move
+    for (unsigned round = 0; round < COMPACT_ROUNDS; round++) {
+        vsfs_compact_result_t r = {0};
+        int64_t moved = compact_pass(im, &cs, &r, why, whylen);
+        res->skipped = r.skipped;
+        res->moved += r.moved;
+        res->blocks_moved += r.blocks_moved;
+        res->defragmented += r.defragmented;
+        if (moved < 0 || commit_locked(im, why, whylen) != 0) goto out;
+        if (moved == 0) break;
+    }
+    rc = 0;
+out:
+    copy_bufs_free(&cs.bufs);
+    free(seen);
+    free(dup);
+    free(sim.bits);
+    free(cs.mine);
+    free(cs.pend);
+    free(cs.pended);
+    free(cs.files);
+    free(cs.list);
+    return rc;
+}
+
+int vsfs_compact(vsfs_image_t *im, vsfs_compact_result_t *res, char *why, size_t whylen) {
+    memset(res, 0, sizeof(*res));
+    pthread_mutex_lock(&im->lock);
+    while (im->committing) pthread_cond_wait(&im->idle, &im->lock);
+    im->committing = 1;
+    while (im->inflight) pthread_cond_wait(&im->idle, &im->lock);
+    // committing first puts the blocks earlier updates released back in the free pool
+    int rc = commit_locked(im, why, whylen);
+    res->largest_free_before = largest_free_run(&im->data_bm);
+    im->now = time(NULL);
+    if (rc == 0) rc = compact_dir(im, res, why, whylen);
+    if (rc == 0) rc = commit_locked(im, why, whylen);
+    if (rc == 0) rc = compact_files(im, res->largest_free_before, res, why, whylen);
+    res->largest_free_after = largest_free_run(&im->data_bm);
+    // later adds fill the space from the start again
+    im->data_bm.cursor = im->data_bm.low;
+    im->committing = 0;
+    pthread_cond_broadcast(&im->idle);
+    pthread_mutex_unlock(&im->lock);
+    return rc;
+}
+
+// ------------------------------------ deltas ------------------------------------
+// vsfs_open_delta() runs the update against a scratch copy of the input and
+// records every block range written to it (image_wrote). The delta then holds,
+// of those blocks, the ones whose contents differ from the input, which stays
+// untouched; see delta_hdr_t for the file layout.
+
+int vsfs_open_delta(const char *input, const char *delta, vsfs_image_t **out, char *why, size_t whylen) {
+    pthread_once(&crc_once, crc_setup);
+    size_t len = strlen(delta);
+    char *scratch = malloc(len + sizeof(".scratch"));
+    char *delta_path = strdup(delta);
+    image_t *im = malloc(sizeof(*im));
+    if (!scratch || !delta_path || !im) {
+        snprintf(why, whylen, "malloc");
+        free(scratch); free(delta_path); free(im);
+        return -1;
+    }
+    memcpy(scratch, delta, len);
+    memcpy(scratch + len, ".scratch", sizeof(".scratch"));
+    uint64_t t0 = STAT_BEGIN();
+    int opened = image_open(im, input, scratch, 1, why, whylen) == 0;
+    STAT_END(PH_OPEN, t0);
+    if (!opened) { free(scratch); free(delta_path); free(im); return -1; }
+    im->scratch_path = scratch;
+    im->delta_path = delta_path;
+    im->base_fd = open(input, O_RDONLY);
+    if (im->base_fd < 0) {
+        snprintf(why, whylen, "open input: %s", strerror(errno));
+        unlink(scratch);
+        image_close(im);
+        free(im);
+        return -1;
+    }
+    *out = im;
+    return 0;
+}
+
+static int cmp_range(const void *a, const void *b) {
+    uint64_t x = ((const block_range_t *)a)->first, y = ((const block_range_t *)b)->first;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    delta_entry_t *v;
+    size_t n, cap;
+} delta_list_t;
+
+// compares k written blocks with the base and appends the ones that changed to
+// the delta (contents) and to dl (entries)
+static int delta_chunk(image_t *im, int out, const uint64_t *blks, size_t k, uint8_t *cur, uint8_t *base, delta_list_t *dl) {
+    vsfs_io_batch_t batch = {0};
+    for (size_t j = 0; j < k; j++) {
+        vsfs_io_read(&im->io, &batch, im->fd, cur + j * BS, BS, blks[j] * BS);
+        vsfs_io_read(&im->io, &batch, im->base_fd, base + j * BS, BS, blks[j] * BS);
+    }
+    if (vsfs_io_wait(&im->io, &batch) != 0) return -1;
+    for (size_t j = 0; j < k; j++) {
+        if (memcmp(cur + j * BS, base + j * BS, BS) == 0) continue;
+        if (dl->n == dl->cap) {
+            size_t ncap = dl->cap ? dl->cap * 2 : 256;
+            delta_entry_t *nv = realloc(dl->v, ncap * sizeof(delta_entry_t));
+            if (!nv) { errno = ENOMEM; vsfs_io_wait(&im->io, &batch); return -1; }
+            dl->v = nv;
+            dl->cap = ncap;
+        }
+        dl->v[dl->n] = (delta_entry_t){ blks[j], delta_block_hash(base + j * BS), delta_block_hash(cur + j * BS) };
+        vsfs_io_write(&im->io, &batch, out, cur + j * BS, BS, (1 + dl->n) * BS);
+        dl->n++;
+    }
+    return vsfs_io_wait(&im->io, &batch);
+}
+
+// writes the delta file; the image is synced and its journal closed
+static int delta_write(image_t *im, uint64_t *blocks_out, char *why, size_t whylen) {
+    if (im->track_lost) { snprintf(why, whylen, "write delta: out of memory recording changed blocks"); return -1; }
+    // merge the recorded ranges
+    qsort(im->written, im->n_written, sizeof(block_range_t), cmp_range);
+    size_t nr = 0;
+    for (size_t i = 0; i < im->n_written; i++) {
+        block_range_t r = im->written[i];
+        block_range_t *last = nr ? &im->written[nr - 1] : NULL;
+        if (last && r.first <= last->first + last->n) {
+            if (r.first + r.n > last->first + last->n) last->n = r.first + r.n - last->first;
+        } else {
+            im->written[nr++] = r;
+        }
+    }
+    im->n_written = nr;
+    // journal transactions are dead once the journal is closed; only its header matters
+    uint64_t skip_from = im->journal_blocks ? im->journal_start + 1 : 0;
+    uint64_t skip_to = im->journal_blocks ? im->sb.inode_table_start : 0;
+
+    delta_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    superblock_t sb_base, sb_new;
+    if (pread_full(im->base_fd, &sb_base, sizeof(sb_base), 0) != 0 || pread_full(im->fd, &sb_new, sizeof(sb_new), 0) != 0) {
+        snprintf(why, whylen, "write delta: read superblock: %s", strerror(errno));
+        return -1;
+    }
+    int out = open(im->delta_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) { snprintf(why, whylen, "open delta: %s", strerror(errno)); return -1; }
+    delta_list_t dl = {0};
+    uint64_t blks[COPY_CHUNK_BLOCKS];
+    uint8_t *cur = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    uint8_t *base = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    int rc = -1;
+    if (!cur || !base) { errno = ENOMEM; goto fail; }
+    size_t k = 0;
+    for (size_t r = 0; r < nr; r++) {
+        for (uint64_t b = im->written[r].first; b < im->written[r].first + im->written[r].n && b < im->sb.total_blocks; b++) {
+            if (b >= skip_from && b < skip_to) continue;
+            blks[k++] = b;
+            if (k == COPY_CHUNK_BLOCKS) {
+                if (delta_chunk(im, out, blks, k, cur, base, &dl) != 0) goto fail;
+                k = 0;
+            }
+        }
+    }
+    if (k && delta_chunk(im, out, blks, k, cur, base, &dl) != 0) goto fail;
+
+    // entry table after the contents, then the header, so a torn delta has none
+    hdr.magic = DELTA_MAGIC;
+    hdr.version = DELTA_VERSION;
+    hdr.total_blocks = im->sb.total_blocks;
+    hdr.base_sb_crc = sb_base.checksum;
+    hdr.new_sb_crc = sb_new.checksum;
+    hdr.nblocks = dl.n;
+    hdr.entries_crc = vsfs_crc32(dl.v, dl.n * sizeof(delta_entry_t));
+    hdr.hdr_crc = vsfs_crc32(&hdr, sizeof(hdr));
+    uint8_t hdr_block[BS];
+    memset(hdr_block, 0, BS);
+    memcpy(hdr_block, &hdr, sizeof(hdr));
+    if ((dl.n && pwrite_full(out, dl.v, dl.n * sizeof(delta_entry_t), (1 + dl.n) * BS) != 0) ||
+        fdatasync(out) != 0 || pwrite_full(out, hdr_block, BS, 0) != 0 || fdatasync(out) != 0) goto fail;
+    if (blocks_out) *blocks_out = dl.n;
+    rc = 0;
+fail:
+    if (rc != 0) snprintf(why, whylen, "write delta: %s", strerror(errno));
+    free(cur);
+    free(base);
+    free(dl.v);
+    if (close(out) != 0 && rc == 0) { snprintf(why, whylen, "close delta: %s", strerror(errno)); rc = -1; }
+    if (rc != 0) unlink(im->delta_path);
+    return rc;
+}
+
+int vsfs_write_delta(vsfs_image_t *im, uint64_t *blocks, char *why, size_t whylen) {
+    if (!im->track) { snprintf(why, whylen, "image was not opened with vsfs_open_delta"); return -1; }
+    if (im->delta_done) { snprintf(why, whylen, "delta already written"); return -1; }
+    if (vsfs_sync(im, why, whylen) != 0) return -1;
+    if (im->journal_blocks && journal_close(im, why, whylen) != 0) return -1;
+    uint64_t t0 = STAT_BEGIN();
+    int rc = delta_write(im, blocks, why, whylen);
+    STAT_END(PH_WRITE, t0);
+    if (rc == 0) im->delta_done = 1;
+    return rc;
+}
+
+int vsfs_apply_delta(const char *image, const char *delta, int dry_run, vsfs_patch_result_t *res, char *why, size_t whylen) {
+    pthread_once(&crc_once, crc_setup);
+    memset(res, 0, sizeof(*res));
+    int rc = -1;
+    int fd = -1, dfd = -1;
+    delta_entry_t *ents = NULL;
+    uint8_t *pending = NULL, *buf = NULL, *blk = NULL;
+    vsfs_io_t io;
+    vsfs_io_open(&io);
+    vsfs_io_batch_t batch = {0};
+
+    fd = open(image, dry_run ? O_RDONLY : O_RDWR);
+    if (fd < 0) { snprintf(why, whylen, "open image: %s", strerror(errno)); goto out; }
+    dfd = open(delta, O_RDONLY);
+    if (dfd < 0) { snprintf(why, whylen, "open delta: %s", strerror(errno)); goto out; }
+
+    // the base: an intact superblock with the checksum the delta was made against
+    uint8_t sb_block[BS];
+    if (pread_full(fd, sb_block, BS, 0) != 0) { snprintf(why, whylen, "failed to read superblock block"); goto out; }
+    superblock_t sb;
+    memcpy(&sb, sb_block, sizeof(sb));
+    if (sb.magic != VSFS_MAGIC || superblock_crc_finalize((superblock_t *)sb_block) != sb.checksum) {
+        snprintf(why, whylen, "image superblock is damaged (bad magic or CRC)");
+        goto out;
+    }
+    delta_hdr_t hdr;
+    if (pread_full(dfd, &hdr, sizeof(hdr), 0) != 0) { snprintf(why, whylen, "read delta: %s", errno == EIO ? "file is truncated" : strerror(errno)); goto out; }
+    uint32_t hdr_crc = hdr.hdr_crc;
+    hdr.hdr_crc = 0;
+    if (hdr.magic != DELTA_MAGIC || hdr.version != DELTA_VERSION || vsfs_crc32(&hdr, sizeof(hdr)) != hdr_crc) {
+        snprintf(why, whylen, "not a MiniVSFS delta, or its header is damaged");
+        goto out;
+    }
+    if (hdr.total_blocks != sb.total_blocks || hdr.nblocks > hdr.total_blocks) {
+        snprintf(why, whylen, "delta is for a %" PRIu64 "-block image, this one has %" PRIu64, hdr.total_blocks, sb.total_blocks);
+        goto out;
+    }
+    if (sb.checksum != hdr.base_sb_crc && sb.checksum != hdr.new_sb_crc) {
+        snprintf(why, whylen, "image is not the base of this delta (superblock CRC %08x, delta expects %08x)", sb.checksum, hdr.base_sb_crc);
+        goto out;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sb.total_blocks * BS) { snprintf(why, whylen, "image is shorter than total_blocks"); goto out; }
+
+    uint64_t n = hdr.nblocks;
+    ents = malloc(n * sizeof(delta_entry_t) + 1);
+    pending = calloc(n + 1, 1);
+    buf = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    blk = malloc((size_t)COPY_CHUNK_BLOCKS * BS);
+    if (!ents || !pending || !buf || !blk) { snprintf(why, whylen, "malloc"); goto out; }
+    if (n && pread_full(dfd, ents, n * sizeof(delta_entry_t), (1 + n) * BS) != 0) {
+        snprintf(why, whylen, "read delta: %s", errno == EIO ? "file is truncated" : strerror(errno));
+        goto out;
+    }
+    if (vsfs_crc32(ents, n * sizeof(delta_entry_t)) != hdr.entries_crc) { snprintf(why, whylen, "delta block table is damaged"); goto out; }
+    for (uint64_t i = 0; i < n; i++) {
+        if (ents[i].block >= sb.total_blocks || (i && ents[i].block <= ents[i - 1].block)) {
+            snprintf(why, whylen, "delta block table is damaged");
+            goto out;
+        }
+    }
+
+    // every block must hold its base or its new contents before anything is written
+    for (uint64_t at = 0; at < n; at += COPY_CHUNK_BLOCKS) {
+        uint64_t cn = n - at < COPY_CHUNK_BLOCKS ? n - at : COPY_CHUNK_BLOCKS;
+        vsfs_io_read(&io, &batch, dfd, buf, cn * BS, (1 + at) * BS);
+        for (uint64_t j = 0; j < cn; j++) vsfs_io_read(&io, &batch, fd, blk + j * BS, BS, ents[at + j].block * BS);
+        if (vsfs_io_wait(&io, &batch) != 0) { snprintf(why, whylen, "read: %s", errno == EIO ? "delta is truncated" : strerror(errno)); goto out; }
+        for (uint64_t j = 0; j < cn; j++) {
+            const delta_entry_t *e = &ents[at + j];
+            if (delta_block_hash(buf + j * BS) != e->new_hash) {
+                snprintf(why, whylen, "delta is damaged: new contents of block %" PRIu64 " fail their hash", e->block);
+                goto out;
+            }
+            uint64_t h = delta_block_hash(blk + j * BS);
+            if (h == e->new_hash) continue;
+            if (h != e->base_hash) {
+                snprintf(why, whylen, "block %" PRIu64 " holds neither the base nor the patched contents; nothing applied", e->block);
+                goto out;
+            }
+            pending[at + j] = 1;
+            res->applied++;
+        }
+    }
+    res->blocks = n;
+    if (dry_run || res->applied == 0) { rc = 0; goto out; }
+
+    // the superblock goes last, after everything else is durable
+    uint8_t sb_new[BS];
+    int sb_pending = 0;
+    for (uint64_t at = 0; at < n; at += COPY_CHUNK_BLOCKS) {
+        uint64_t cn = n - at < COPY_CHUNK_BLOCKS ? n - at : COPY_CHUNK_BLOCKS;
+        if (pread_full(dfd, buf, cn * BS, (1 + at) * BS) != 0) { snprintf(why, whylen, "read delta: %s", strerror(errno)); goto out; }
+        for (uint64_t j = 0; j < cn; j++) {
+            if (!pending[at + j]) continue;
+            if (ents[at + j].block == 0) { memcpy(sb_new, buf + j * BS, BS); sb_pending = 1; continue; }
+            vsfs_io_write(&io, &batch, fd, buf + j * BS, BS, ents[at + j].block * BS);
+        }
+        if (vsfs_io_wait(&io, &batch) != 0) { snprintf(why, whylen, "write image: %s", strerror(errno)); goto out; }
+    }
+    if (fdatasync(fd) != 0 || (sb_pending && (pwrite_full(fd, sb_new, BS, 0) != 0 || fdatasync(fd) != 0))) {
+        snprintf(why, whylen, "write image: %s", strerror(errno));
+        goto out;
+    }
+    rc = 0;
+out:
+    vsfs_io_close(&io);
+    free(ents);
+    free(pending);
+    free(buf);
+    free(blk);
+    if (dfd >= 0) close(dfd);
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+// from_dir: every host file and directory becomes one node. Nodes are kept in
+// breadth-first order, so a directory's children are contiguous and node i is
+// inode i+1 (the source directory itself is the root).
+typedef struct {
+    char *path;
+    char name[58];
+    int is_dir;
+    uint64_t size;
+    uint64_t parent;
+    uint64_t first_child, nchildren;
+    uint64_t first_blk, nblocks;  // data blocks (file) or dirent blocks (directory)
+    uint64_t ptr_blk, nptr;       // pointer blocks for whatever does not fit in direct[]
+    uint64_t idx_blk, nidx;       // directory name index, only for multi-block directories
+    uint32_t flags;               // IFL_INLINE or IFL_TAIL for a packed small file
+    uint64_t tail_addr;           // IFL_TAIL: byte address of the file's tail fragment
+} tree_node_t;
+
+typedef struct {
+    tree_node_t *v;
+    uint64_t n, cap;
+} tree_t;
+
+static int tree_push(tree_t *t, const tree_node_t *nd) {
+    if (t->n == t->cap) {
+        uint64_t cap = t->cap ? t->cap * 2 : 64;
+        tree_node_t *v = realloc(t->v, cap * sizeof(*v));
+        if (!v) return -1;
+        t->v = v; t->cap = cap;
+    }
+    t->v[t->n++] = *nd;
+    return 0;
+}
+
+static void tree_free(tree_t *t) {
+    for (uint64_t i = 0; i < t->n; i++) free(t->v[i].path);
+    free(t->v);
+}
+
+static int cmp_node_name(const void *a, const void *b) {
+    return strcmp(((const tree_node_t *)a)->name, ((const tree_node_t *)b)->name);
+}
+
+// walks the host tree breadth first; anything but regular files and directories
+// (and names that do not fit a dirent) is skipped with a warning on stderr
+static int tree_scan(tree_t *t, const char *dir, char *why, size_t whylen) {
+    tree_node_t root;
+    memset(&root, 0, sizeof(root));
+    root.path = strdup(dir);
+    root.is_dir = 1;
+    if (!root.path || tree_push(t, &root) != 0) { free(root.path); snprintf(why, whylen, "malloc"); return -1; }
+
+    for (uint64_t i = 0; i < t->n; i++) {
+        if (!t->v[i].is_dir) continue;
+        const char *parent = t->v[i].path; // the string itself never moves
+        DIR *dp = opendir(parent);
+        if (!dp) { snprintf(why, whylen, "%s: %s", parent, strerror(errno)); return -1; }
+        uint64_t first = t->n;
+        struct dirent *e;
+        while ((e = readdir(dp)) != NULL) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            size_t len = strlen(e->d_name);
+            tree_node_t nd;
+            memset(&nd, 0, sizeof(nd));
+            nd.path = malloc(strlen(parent) + len + 2);
+            if (!nd.path) { snprintf(why, whylen, "malloc"); closedir(dp); return -1; }
+            sprintf(nd.path, "%s/%s", parent, e->d_name);
+            if (len > 57) {
+                fprintf(stderr, "Skipping '%s': name longer than 57 bytes\n", nd.path);
+                free(nd.path);
+                continue;
+            }
+            struct stat st;
+            if (lstat(nd.path, &st) != 0) { snprintf(why, whylen, "%s: %s", nd.path, strerror(errno)); free(nd.path); closedir(dp); return -1; }
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+                fprintf(stderr, "Skipping '%s': not a regular file or directory\n", nd.path);
+                free(nd.path);
+                continue;
+            }
+            memcpy(nd.name, e->d_name, len);
+            nd.is_dir = S_ISDIR(st.st_mode);
+            nd.size = nd.is_dir ? 0 : (uint64_t)st.st_size;
+            nd.parent = i;
+            if (tree_push(t, &nd) != 0) { snprintf(why, whylen, "malloc"); free(nd.path); closedir(dp); return -1; }
+        }
+        closedir(dp);
+        t->v[i].first_child = first;
+        t->v[i].nchildren = t->n - first;
+        qsort(t->v + first, t->n - first, sizeof(tree_node_t), cmp_node_name); // same image for the same tree
+    }
+    return 0;
+}
+
+// bytes of a packed node stored outside whole blocks (inline or as a tail fragment)
+static uint64_t tree_small_bytes(const tree_node_t *nd) {
+    if (nd->flags & IFL_INLINE) return nd->size;
+    if (nd->flags & IFL_TAIL) return nd->size % BS;
+    return 0;
+}
+
+// assigns every node its blocks with a bump allocator from the start of the data
+// region: root's first dirent block stays at data_region_start, and each file's
+// data is one contiguous run followed by its pointer blocks. With pack, tails are
+// appended to the current tail block, and a new one is bumped when one does not fit.
+static int tree_plan(tree_t *t, const superblock_t *sb, int pack, uint64_t *used_blocks, char *why, size_t whylen) {
+    if (t->n > sb->inode_count) {
+        snprintf(why, whylen, "the tree needs %" PRIu64 " inodes but the image has %" PRIu64, t->n, sb->inode_count);
+        return -1;
+    }
+    uint64_t next = sb->data_region_start;
+    uint64_t tail_blk = 0, tail_fill = 0;
+    for (uint64_t i = 0; i < t->n; i++) {
+        tree_node_t *nd = &t->v[i];
+        if (nd->is_dir) {
+            // every entry counts in the directory's 16-bit link count
+            if (nd->nchildren > UINT16_MAX - 2) {
+                snprintf(why, whylen, "'%s' has %" PRIu64 " entries, a directory holds at most %u",
+                         nd->path, nd->nchildren, UINT16_MAX - 2);
+                return -1;
+            }
+            uint64_t entries = 2 + nd->nchildren;
+            nd->nblocks = (entries + DIRENTS_PER_BLOCK - 1) / DIRENTS_PER_BLOCK;
+            if (nd->nblocks > 1) nd->nidx = dir_index_blocks(dir_index_size_for(entries));
+        } else {
+            if (pack && nd->size <= VSFS_INLINE_MAX) nd->flags = IFL_INLINE;
+            else if (pack && nd->size % BS) nd->flags = IFL_TAIL;
+            uint64_t whole = nd->size - tree_small_bytes(nd);
+            nd->nblocks = whole || pack ? (whole + BS - 1) / BS : 1;
+            if (nd->nblocks > MAX_FILE_BLOCKS) {
+                snprintf(why, whylen, "'%s' is larger than the maximum file size", nd->path);
+                return -1;
+            }
+        }
+        nd->nptr = pointer_blocks_for(nd->nblocks);
+        nd->first_blk = next; next += nd->nblocks;
+        nd->ptr_blk = next;   next += nd->nptr;
+        nd->idx_blk = next;   next += nd->nidx;
+        if (nd->flags & IFL_TAIL) {
+            uint64_t len = nd->size % BS;
+            if (!tail_blk || tail_fill + len > BS) { tail_blk = next++; tail_fill = 0; }
+            nd->tail_addr = tail_blk * BS + tail_fill;
+            tail_fill += len;
+        }
+    }
+    *used_blocks = next - sb->data_region_start;
+    if (*used_blocks > sb->data_region_blocks) {
+        snprintf(why, whylen, "the tree needs %" PRIu64 " data blocks but the image has %" PRIu64,
+                 *used_blocks, sb->data_region_blocks);
+        return -1;
+    }
+    return 0;
+}
+
+// points the inode at the node's contiguous run; ptrs (nptr zeroed blocks) gets the
+// single indirect block, the double indirect block and then its second-level blocks
+static void tree_map(inode_t *ino, const tree_node_t *nd, uint32_t *ptrs) {
+    for (uint64_t l = 0; l < nd->nblocks; l++) {
+        uint32_t b = (uint32_t)(nd->first_blk + l);
+        if (l < DIRECT_MAX) {
+            ino->direct[l] = b;
+        } else if (l < DIRECT_MAX + PTRS_PER_BLOCK) {
+            ino->reserved_0 = (uint32_t)nd->ptr_blk;
+            ptrs[l - DIRECT_MAX] = b;
+        } else {
+            uint64_t k = l - DIRECT_MAX - PTRS_PER_BLOCK;
+            uint64_t second = 2 + k / PTRS_PER_BLOCK;
+            ino->reserved_1 = (uint32_t)(nd->ptr_blk + 1);
+            ptrs[PTRS_PER_BLOCK + k / PTRS_PER_BLOCK] = (uint32_t)(nd->ptr_blk + second);
+            ptrs[second * PTRS_PER_BLOCK + k % PTRS_PER_BLOCK] = b;
+        }
+    }
+}
+
+static void tree_inode(inode_t *ino, const tree_node_t *nd, time_t now) {
+    memset(ino, 0, sizeof(*ino));
+    ino->mode = nd->is_dir ? 0040000u : 0100000u;
+    ino->links = nd->is_dir ? (uint16_t)(2 + nd->nchildren) : 1; // same count the adder keeps for root
+    ino->size_bytes = nd->is_dir ? (2 + nd->nchildren) * sizeof(dirent64_t) : nd->size;
+    ino->atime = (uint64_t)now;
+    ino->mtime = (uint64_t)now;
+    ino->ctime = (uint64_t)now;
+    ino->proj_id = 8;
+    ino->reserved_2 = nd->flags;
+    if (nd->flags & IFL_TAIL) ino->xattr_ptr = nd->tail_addr;
+}
+
+// maps the node and writes its pointer blocks
+static int tree_write_map(int fd, inode_t *ino, const tree_node_t *nd) {
+    uint32_t *ptrs = NULL;
+    if (nd->nptr) {
+        ptrs = calloc(nd->nptr, BS);
+        if (!ptrs) return -1;
+    }
+    tree_map(ino, nd, ptrs);
+    int rc = nd->nptr ? pwrite_full(fd, ptrs, nd->nptr * BS, nd->ptr_blk * BS) : 0;
+    free(ptrs);
+    return rc;
+}
+
+static void tree_dirent(dirent64_t *de, uint64_t inode_no, uint8_t type, const char *name) {
+    de->inode_no = (uint32_t)inode_no;
+    de->type = type;
+    strncpy(de->name, name, sizeof(de->name));
+    dirent_checksum_finalize(de);
+}
+
+// writes a directory's entries, pointer blocks and (multi-block only) name index;
+// the inode CRC is left to the caller
+static int tree_write_dir(int fd, inode_t *table, const tree_t *t, uint64_t i, time_t now) {
+    const tree_node_t *nd = &t->v[i];
+    uint64_t entries = 2 + nd->nchildren;
+    dirent64_t *de = calloc(nd->nblocks, BS);
+    if (!de) return -1;
+    tree_dirent(&de[0], i + 1, 2, ".");
+    tree_dirent(&de[1], nd->parent + 1, 2, ".."); // root's parent is itself
+    for (uint64_t k = 0; k < nd->nchildren; k++) {
+        const tree_node_t *c = &t->v[nd->first_child + k];
+        tree_dirent(&de[2 + k], nd->first_child + k + 1, c->is_dir ? 2 : 1, c->name);
+    }
+    int rc = pwrite_full(fd, de, nd->nblocks * BS, nd->first_blk * BS);
+
+    tree_inode(&table[i], nd, now);
+    if (rc == 0) rc = tree_write_map(fd, &table[i], nd);
+
+    if (rc == 0 && nd->nidx) {
+        uint8_t *idx = calloc(nd->nidx, BS);
+        if (!idx) { free(de); return -1; }
+        dirindex_hdr_t *hdr = (dirindex_hdr_t *)idx;
+        dirindex_slot_t *slots = (dirindex_slot_t *)(idx + BS);
+        hdr->magic = DIRINDEX_MAGIC;
+        hdr->nslots = dir_index_size_for(entries);
+        hdr->used = (uint32_t)entries;
+        hdr->free_hint = (uint32_t)entries;
+        uint32_t mask = hdr->nslots - 1;
+        for (uint64_t pos = 0; pos < entries; pos++) {
+            uint32_t h = name_hash(de[pos].name);
+            uint32_t s = h & mask;
+            while (slots[s].pos != DIRINDEX_EMPTY) { s = (s + 1) & mask; STAT_ADD(dirents_probed, 1); }
+            slots[s].hash = h;
+            slots[s].pos = (uint32_t)(pos + 1);
+        }
+        rc = pwrite_full(fd, idx, nd->nidx * BS, nd->idx_blk * BS);
+        free(idx);
+        table[i].reserved_2 |= IFL_DIRINDEX;
+        table[i].xattr_ptr = nd->idx_blk;
+    }
+    free(de);
+    return rc;
+}
+
+typedef struct {
+    const tree_t *tree;
+    inode_t *inode_table;   // each worker touches only the inodes of its own files
+    int fd;
+    vsfs_io_t *io;
+    time_t now;
+    _Atomic uint64_t next;  // next node to claim
+    atomic_int failed;
+    char why[256];          // written by whoever sets failed first
+} copy_job_t;
+
+// records the first failure and stops the other workers
+static void job_fail(copy_job_t *job, const char *fmt, ...) {
+    if (atomic_exchange(&job->failed, 1) != 0) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(job->why, sizeof(job->why), fmt, ap);
+    va_end(ap);
+}
+
+// copies one host file into its preassigned run: copy_file_range first, then
+// copy_pipelined() for whatever it could not move (other filesystem, no support).
+// The bytes of a packed file past its whole blocks go into the inode or its tail fragment.
+static int tree_copy_file(copy_job_t *job, const tree_node_t *nd, inode_t *ino, copy_bufs_t *bufs) {
+    int fd = job->fd;
+    int in = open(nd->path, O_RDONLY);
+    if (in < 0) { job_fail(job, "%s: %s", nd->path, strerror(errno)); return -1; }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != nd->size) {
+        job_fail(job, "'%s' changed while the image was being built", nd->path);
+        close(in);
+        return -1;
+    }
+    off_t src = 0;
+    off_t dst = (off_t)(nd->first_blk * BS);
+    uint64_t small = tree_small_bytes(nd);
+    uint64_t left = nd->size - small;
+    while (left > 0) {
+        ssize_t n = copy_file_range(in, &src, fd, &dst, left, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        left -= (uint64_t)n;
+        STAT_ADD(bytes_read, n);
+        STAT_ADD(bytes_written, n);
+    }
+    int host;
+    if (left > 0 && copy_pipelined(job->io, bufs, in, (uint64_t)src, fd, (uint64_t)dst, left, &host) != 0) {
+        if (!host) job_fail(job, "write image: %s", strerror(errno));
+        else if (errno == EIO) job_fail(job, "short read from '%s'", nd->path);
+        else job_fail(job, "read '%s': %s", nd->path, strerror(errno));
+        close(in);
+        return -1;
+    }
+    if (small) {
+        uint8_t tail[BS];
+        if (pread_full(in, tail, (size_t)small, nd->size - small) != 0) {
+            job_fail(job, "short read from '%s'", nd->path);
+            close(in);
+            return -1;
+        }
+        if (nd->flags & IFL_INLINE) {
+            memcpy((uint8_t *)ino + offsetof(inode_t, direct), tail, (size_t)small);
+        } else if (pwrite_full(fd, tail, (size_t)small, nd->tail_addr) != 0) {
+            job_fail(job, "write image: %s", strerror(errno));
+            close(in);
+            return -1;
+        }
+    }
+    close(in);
+    return 0;
+}
+
+static void *copy_worker(void *arg) {
+    copy_job_t *job = arg;
+    copy_bufs_t bufs = {{0}};
+    while (!atomic_load(&job->failed)) {
+        uint64_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->tree->n) break;
+        const tree_node_t *nd = &job->tree->v[i];
+        if (nd->is_dir) continue;
+        inode_t *ino = &job->inode_table[i];
+        tree_inode(ino, nd, job->now);
+        uint64_t t0 = STAT_BEGIN();
+        int ok = tree_write_map(job->fd, ino, nd) == 0;
+        if (!ok) job_fail(job, "write image: %s", strerror(errno));
+        else ok = tree_copy_file(job, nd, ino, &bufs) == 0;
+        STAT_END(PH_COPY, t0);
+        if (!ok) break;
+        t0 = STAT_BEGIN();
+        inode_crc_finalize(ino);
+        STAT_END(PH_CRC, t0);
+    }
+    copy_bufs_free(&bufs);
+    return NULL;
+}
+
+int vsfs_create(const char *path, const vsfs_create_opts_t *opts, char *why, size_t whylen) {
+    pthread_once(&crc_once, crc_setup);
+    uint64_t size_kib = opts->size_kib;
+    uint64_t inode_count = opts->inodes;
+    time_t now = opts->timestamp ? (time_t)opts->timestamp : time(NULL); // every timestamp in the image comes from now
+    if (size_kib < 180 || size_kib > MAX_SIZE_KIB || size_kib % 4 != 0) {
+        snprintf(why, whylen, "size must be between 180 and %" PRIu64 " KiB and a multiple of 4", MAX_SIZE_KIB);
+        return -1;
+    }
+    if (inode_count < 128 || inode_count > MAX_INODES) {
+        snprintf(why, whylen, "inode count must be between 128 and %" PRIu64, MAX_INODES);
+        return -1;
+    }
+    uint64_t journal_blocks = opts->journal_blocks;
+    if (journal_blocks != 0 && journal_blocks < JOURNAL_MIN_BLOCKS) {
+        snprintf(why, whylen, "journal must be 0 or at least %u blocks", JOURNAL_MIN_BLOCKS);
+        return -1;
+    }
+
+    uint64_t total_blocks = size_kib * 1024 / BS;
+    superblock_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = VSFS_MAGIC;
+    sb.total_blocks = total_blocks;
+    sb.inode_count = inode_count;
+    sb.version = 1;
+    sb.block_size = BS;
+    sb.root_inode = ROOT_INO;
+    sb.mtime_epoch = now;
+    sb.flags = journal_blocks ? SBF_JOURNAL : 0;
+    // bitmaps and inode table are sized from the geometry; up to 4 MiB and 512 inodes
+    // this is the classic one block each
+    sb.inode_bitmap_start = 1;
+    sb.inode_bitmap_blocks = (inode_count + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    sb.inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS;
+    // everything but the data bitmap; the journal sits between the data bitmap and the inode table
+    uint64_t fixed_blocks = 1 + sb.inode_bitmap_blocks + journal_blocks + sb.inode_table_blocks;
+    if (fixed_blocks + 2 > total_blocks) {
+        snprintf(why, whylen, "%" PRIu64 " inodes%s do not fit in a %" PRIu64 " KiB image", inode_count,
+                 journal_blocks ? " and the journal" : "", size_kib);
+        return -1;
+    }
+    // the data bitmap covers the data region, which shrinks as the bitmap grows
+    sb.data_bitmap_blocks = 1;
+    while (sb.data_bitmap_blocks * BITS_PER_BLOCK < total_blocks - fixed_blocks - sb.data_bitmap_blocks) sb.data_bitmap_blocks++;
+    sb.data_bitmap_start = sb.inode_bitmap_start + sb.inode_bitmap_blocks;
+    sb.inode_table_start = sb.data_bitmap_start + sb.data_bitmap_blocks + journal_blocks;
+    sb.data_region_start = sb.inode_table_start + sb.inode_table_blocks;
+    if (sb.data_region_start >= total_blocks) {
+        snprintf(why, whylen, "%" PRIu64 " inodes%s do not fit in a %" PRIu64 " KiB image", inode_count,
+                 journal_blocks ? " and the journal" : "", size_kib);
+        return -1;
+    }
+    sb.data_region_blocks = sb.total_blocks - sb.data_region_start;
+
+    int rc = -1;
+    int fd = -1;
+    tree_t tree = {0};
+    vsfs_io_t io;
+    vsfs_io_open(&io);
+    uint8_t *inode_bitmap = calloc(sb.inode_bitmap_blocks, BS); // whole blocks, bits past inode_count stay 0
+    uint8_t *data_bitmap = calloc(sb.data_bitmap_blocks, BS);
+    inode_t *inode_table = calloc(inode_count, sizeof(inode_t));
+    vsfs_bitmap_t ibm, dbm;
+    vsfs_bm_init(&ibm, inode_bitmap, inode_count);
+    vsfs_bm_init(&dbm, data_bitmap, sb.data_region_blocks);
+    dbm.group_shift = sb_free_group_shift(dbm.nbits);
+    dbm.group_free = calloc(vsfs_bm_groups(&dbm), sizeof(uint32_t));
+    if (!inode_bitmap || !data_bitmap || !inode_table || !dbm.group_free) { snprintf(why, whylen, "malloc metadata"); goto out; }
+
+    // an empty journal: nothing to replay, and the first transaction gets seq 1
+    uint8_t journal_hdr[BS];
+    memset(journal_hdr, 0, BS);
+    journal_hdr_t *jh = (journal_hdr_t *)journal_hdr;
+    jh->magic = JOURNAL_MAGIC;
+    jh->version = 1;
+    jh->blocks = journal_blocks;
+    jh->next_seq = 1;
+
+    // root directory: "." and ".." both point at itself
+    inode_table[0].mode = 0040000;
+    inode_table[0].links = 2;
+    inode_table[0].atime = now;
+    inode_table[0].mtime = now;
+    inode_table[0].ctime = now;
+    inode_table[0].proj_id = 8;
+    inode_table[0].direct[0] = (uint32_t)sb.data_region_start; // first block in data region
+    inode_table[0].size_bytes = 2 * sizeof(dirent64_t);
+    inode_crc_finalize(&inode_table[0]);
+    inode_bitmap[0] |= 1;
+    data_bitmap[0] |= 1;
+
+    dirent64_t root_entries[2];
+    memset(root_entries, 0, sizeof(root_entries));
+    root_entries[0].inode_no = ROOT_INO;
+    root_entries[0].type = 2;
+    memcpy(root_entries[0].name, ".", 1);
+    dirent_checksum_finalize(&root_entries[0]);
+    root_entries[1].inode_no = ROOT_INO;
+    root_entries[1].type = 2;
+    memcpy(root_entries[1].name, "..", 2);
+    dirent_checksum_finalize(&root_entries[1]);
+
+    // with from_dir the whole tree is planned up front: root and its entries are
+    // rebuilt from the plan and every inode and block the plan uses is marked now
+    uint64_t tree_blocks = 0;
+    if (opts->from_dir) {
+        uint64_t t0 = STAT_BEGIN();
+        int scanned = tree_scan(&tree, opts->from_dir, why, whylen) == 0;
+        STAT_END(PH_SCAN, t0);
+        t0 = STAT_BEGIN();
+        if (!scanned || tree_plan(&tree, &sb, opts->pack_small, &tree_blocks, why, whylen) != 0) goto out;
+        for (uint64_t i = 0; i < tree.n; i++) inode_bitmap[i / 8] |= 1 << (i % 8);
+        for (uint64_t b = 0; b < tree_blocks; b++) data_bitmap[b / 8] |= 1 << (b % 8);
+        STAT_END(PH_PLAN, t0);
+    }
+
+    // only the metadata blocks and the root dirent block are written; the file is sized with
+    // ftruncate so the empty remainder stays sparse (it reads back as zeros all the same)
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { snprintf(why, whylen, "open %s: %s", path, strerror(errno)); goto out; }
+    uint64_t total_bytes = total_blocks * BS;
+    if (opts->preallocate) {
+        // physically reserve the image; fall back to posix_fallocate where fallocate is unsupported
+        if (fallocate(fd, 0, 0, (off_t)total_bytes) != 0) {
+            int err = posix_fallocate(fd, 0, (off_t)total_bytes);
+            if (err != 0) { snprintf(why, whylen, "preallocate: %s", strerror(err)); goto out; }
+        }
+    } else if (ftruncate(fd, (off_t)total_bytes) != 0) {
+        snprintf(why, whylen, "ftruncate: %s", strerror(errno)); goto out;
+    }
+
+    if (opts->from_dir) {
+        // workers each own a disjoint set of files, inodes and blocks; directories
+        // are written here meanwhile
+        copy_job_t job = { .tree = &tree, .inode_table = inode_table, .fd = fd, .io = &io, .now = now };
+        atomic_init(&job.next, 0);
+        atomic_init(&job.failed, 0);
+        long jobs = opts->jobs;
+        if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs < 1) jobs = 1;
+        if ((uint64_t)jobs > tree.n) jobs = (long)tree.n;
+        pthread_t *tids = calloc((size_t)jobs, sizeof(pthread_t));
+        long started = 0;
+        while (tids && started < jobs - 1 && pthread_create(&tids[started], NULL, copy_worker, &job) == 0) started++;
+
+        for (uint64_t i = 0; i < tree.n && !atomic_load(&job.failed); i++) {
+            if (!tree.v[i].is_dir) continue;
+            uint64_t t0 = STAT_BEGIN();
+            int dir_rc = tree_write_dir(fd, inode_table, &tree, i, now);
+            STAT_END(PH_DIR, t0);
+            if (dir_rc != 0) job_fail(&job, "write image: %s", strerror(errno));
+            else inode_crc_finalize(&inode_table[i]);
+        }
+        copy_worker(&job); // the main thread takes its share too
+        for (long t = 0; t < started; t++) pthread_join(tids[t], NULL);
+        free(tids);
+        if (atomic_load(&job.failed)) {
+            snprintf(why, whylen, "%s", job.why);
+            close(fd);
+            fd = -1;
+            unlink(path);
+            goto out;
+        }
+    }
+
+    // the CRC covers the whole block, free-space summary included, so finalize it
+    // over a zero-padded copy once the bitmaps are final
+    uint8_t sb_block[BS];
+    memset(sb_block, 0, BS);
+    memcpy(sb_block, &sb, sizeof(sb));
+    vsfs_bm_recount(&ibm);
+    vsfs_bm_recount(&dbm);
+    free_summary_store(sb_block, &ibm, &dbm);
+    superblock_crc_finalize((superblock_t*)sb_block);
+
+    // the metadata goes out as one batch
+    uint64_t t0 = STAT_BEGIN();
+    vsfs_io_batch_t batch = {0};
+    vsfs_io_write(&io, &batch, fd, sb_block, BS, 0);
+    vsfs_io_write(&io, &batch, fd, inode_bitmap, sb.inode_bitmap_blocks * BS, sb.inode_bitmap_start * BS);
+    vsfs_io_write(&io, &batch, fd, data_bitmap, sb.data_bitmap_blocks * BS, sb.data_bitmap_start * BS);
+    vsfs_io_write(&io, &batch, fd, inode_table, inode_count * sizeof(inode_t), sb.inode_table_start * BS);
+    if (journal_blocks) vsfs_io_write(&io, &batch, fd, journal_hdr, BS, (sb.data_bitmap_start + sb.data_bitmap_blocks) * BS);
+    // root directory entries go into the first data block (already written from the plan with from_dir)
+    if (!opts->from_dir) vsfs_io_write(&io, &batch, fd, root_entries, sizeof(root_entries), sb.data_region_start * BS);
+    if (vsfs_io_wait(&io, &batch) != 0) {
+        snprintf(why, whylen, "write image: %s", strerror(errno));
+        goto out;
+    }
+    int closed = close(fd);
+    fd = -1;
+    if (closed != 0) { snprintf(why, whylen, "close: %s", strerror(errno)); goto out; }
+    STAT_END(PH_WRITE, t0);
+    rc = 0;
+
+out:
+    if (fd >= 0) close(fd);
+    vsfs_io_close(&io);
+    tree_free(&tree);
+    free(inode_bitmap);
+    free(data_bitmap);
+    free(dbm.group_free);
+    free(inode_table);
+    return rc;
+}
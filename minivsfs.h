@@ -0,0 +1,184 @@
+// minivsfs.h - embeddable MiniVSFS image library (libminivsfs).
+// mkfs_builder, mkfs_adder, mkfs_patch and mkfs_compact are thin wrappers around it; a
+// long-running process can open an image once and add many files without
+// re-reading it. An open handle keeps the superblock, bitmaps, inode table and
+// root directory index in memory and writes back only what changed.
+//
+// Errors are reported through a caller buffer (why, whylen) holding a short
+// reason; functions return 0 on success and -1 on failure.
+//
+// A handle may be shared by several threads once it is set up (after
+// vsfs_set_alloc_policy / vsfs_enable_dedup). Adds take their inode, dirent
+// and blocks under a short internal lock and copy data without it, so
+// concurrent adds overlap their I/O; vsfs_sync() commits every add that
+// finished before it as one group.
+//
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread -c minivsfs.c && ar rcs libminivsfs.a minivsfs.o
+//        gcc -O2 -std=c17 -Wall -Wextra -pthread -fPIC -shared minivsfs.c -o libminivsfs.so
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct vsfs_image vsfs_image_t;
+
+// data block placement policies
+enum {
+    VSFS_ALLOC_FIRST_FIT,   // any free blocks, next-fit order (may scatter across holes)
+    VSFS_ALLOC_CONTIGUOUS,  // first free run long enough for the whole file (default)
+    VSFS_ALLOC_BEST_FIT,    // shortest free run long enough for the whole file
+};
+
+typedef struct {
+    uint64_t size_kib;      // 180 .. 4 * UINT32_MAX, multiple of 4
+    uint64_t inodes;        // 128 .. UINT32_MAX - 1
+    int preallocate;        // reserve every block on disk instead of leaving the image sparse
+    uint64_t timestamp;     // every timestamp in the image; 0 = now
+    const char *from_dir;   // populate the image with this host tree, NULL = empty root
+    long jobs;              // copy threads for from_dir, 0 = one per CPU
+    uint64_t journal_blocks; // write-ahead journal for crash-safe in-place updates, 0 = none
+    int pack_small;         // store small files inline and pack file tails (see vsfs_set_packing)
+} vsfs_create_opts_t;
+
+// outcome of adding one file
+typedef struct {
+    uint64_t ino;
+    uint64_t blocks;        // blocks newly allocated for it (data and pointer blocks)
+    uint64_t runs;          // contiguous extents the data ended up in (1 = unfragmented)
+    uint64_t shared;        // data blocks reused from identical existing blocks (dedup)
+    uint64_t size;          // file size
+    uint64_t stored;        // data bytes written: the file size, or less when compressed
+    uint64_t packed;        // bytes stored in the inode or a shared tail block (vsfs_set_packing)
+    int inlined;            // the whole file is in the inode
+} vsfs_add_result_t;
+
+// outcome of applying a delta
+typedef struct {
+    uint64_t blocks;        // blocks the delta replaces
+    uint64_t applied;       // of those, blocks that still held the base contents
+} vsfs_patch_result_t;
+
+// outcome of compacting an image
+typedef struct {
+    uint64_t files;          // regular files that own data blocks
+    uint64_t fragmented;     // of those, files whose data was in more than one run
+    uint64_t defragmented;   // fragmented files now in one run
+    uint64_t skipped;        // fragmented files left as they were (shared blocks, no free run)
+    uint64_t moved;          // files copied, defragmented or moved into a hole nearer the start
+    uint64_t blocks_moved;   // data and pointer blocks copied
+    uint64_t dirents_moved;  // root entries moved into earlier free slots
+    uint64_t dir_blocks_freed; // root directory, directory pointer and old index blocks released
+    uint64_t index_blocks_moved; // root index blocks written to a new run of another size
+    uint64_t largest_free_before, largest_free_after; // longest free run of data blocks
+} vsfs_compact_result_t;
+
+typedef struct {
+    uint64_t ino;
+    uint16_t mode;
+    uint16_t links;
+    uint64_t size;
+    uint64_t mtime;
+} vsfs_stat_t;
+
+// writes a new image at path (truncating any existing file)
+int vsfs_create(const char *path, const vsfs_create_opts_t *opts, char *why, size_t whylen);
+
+// opens input for adding; with output != NULL the input is cloned to output and
+// only the clone is modified, otherwise input is updated in place. An image with a
+// journal first gets any update a crash interrupted completed from it.
+int vsfs_open(const char *input, const char *output, vsfs_image_t **out, char *why, size_t whylen);
+
+// like vsfs_open(input, NULL, ...), except that input is left untouched: the
+// update goes to a scratch copy (<delta>.scratch, a reflink where the filesystem
+// allows), and vsfs_write_delta() or vsfs_close() writes the blocks it changed to
+// delta and removes the copy
+int vsfs_open_delta(const char *input, const char *delta, vsfs_image_t **out, char *why, size_t whylen);
+
+// syncs and writes the delta of a vsfs_open_delta() handle, once, after the last
+// add; *blocks (if not NULL) gets the number of blocks it holds
+int vsfs_write_delta(vsfs_image_t *im, uint64_t *blocks, char *why, size_t whylen);
+
+// patches image in place with a delta made from it. Nothing is written unless the
+// superblock and every block the delta replaces hold the contents the delta was
+// made against (or, for a rerun after an interrupted apply, their new contents);
+// the superblock is written last. dry_run only checks.
+int vsfs_apply_delta(const char *image, const char *delta, int dry_run, vsfs_patch_result_t *res, char *why, size_t whylen);
+
+// journal transactions vsfs_open() replayed (0 for an image closed cleanly)
+size_t vsfs_replayed(const vsfs_image_t *im);
+
+void vsfs_set_alloc_policy(vsfs_image_t *im, int policy);
+
+// stores files of more than one block compressed (vsfs_lz.h) whenever that takes
+// fewer blocks; reads through vsfs_read() and the tools decompress transparently
+void vsfs_set_compression(vsfs_image_t *im, int on);
+
+// stores files of at most VSFS_INLINE_MAX bytes (56) in the inode, and the last
+// partial block of other files in tail blocks shared between files; files stored
+// compressed are left as they are
+void vsfs_set_packing(vsfs_image_t *im, int on);
+
+// shares identical 4 KiB blocks between files, recording them in a sidecar index.
+// A missing index starts empty; one that exists but is damaged or was written for
+// another image geometry is an error.
+int vsfs_enable_dedup(vsfs_image_t *im, const char *index_path, char *why, size_t whylen);
+
+// the same, for an image that is a copy of another: the index starts out as the
+// one at seed_path (the original image's, empty if there is none) and is written
+// to index_path straight away, leaving the original's index as it was
+int vsfs_enable_dedup_from(vsfs_image_t *im, const char *index_path, const char *seed_path, char *why, size_t whylen);
+
+// adds a regular file to the root directory under name (1..57 bytes, no '/').
+// The data is in the image when this returns; the metadata is written by the
+// next vsfs_sync() or vsfs_close(). A rejected file leaves the image unchanged.
+// Root holds at most 65533 files, as each one counts in its 16-bit link count.
+int vsfs_add_fd(vsfs_image_t *im, const char *name, int fd, vsfs_add_result_t *res, char *why, size_t whylen);
+int vsfs_add_buffer(vsfs_image_t *im, const char *name, const void *data, size_t len,
+                    vsfs_add_result_t *res, char *why, size_t whylen);
+
+// removes the regular file called name from the root directory, releasing its
+// inode, its dirent and the blocks only it used: data and pointer blocks, a tail
+// block holding no other fragment, and with dedup enabled the shared blocks whose
+// last reference it held. An image written with dedup must have its index enabled
+// first, or blocks still shared would be freed. With a journal the blocks become
+// free with the next vsfs_sync(), which commits the removal; *freed (if not NULL)
+// gets their number.
+int vsfs_remove(vsfs_image_t *im, const char *name, uint64_t *freed, char *why, size_t whylen);
+
+// packs the root directory entries into the first slots (releasing the directory
+// blocks left empty) and slides the files down into the lowest free runs that hold
+// them in one piece, with one large copy per contiguous stretch, so the used blocks
+// close up; inodes and pointer blocks are rewritten and the whole update is
+// committed before this returns. The longest free run never gets shorter: fragmented
+// files stay where they are when moving them would shorten it. Adds, reads and
+// syncs wait for it. Blocks shared between files (dedup) are not moved.
+int vsfs_compact(vsfs_image_t *im, vsfs_compact_result_t *res, char *why, size_t whylen);
+
+// looks name up in the root directory; -1 with errno ENOENT if absent
+int vsfs_lookup(vsfs_image_t *im, const char *name, vsfs_stat_t *st);
+
+// reads up to len bytes of inode ino from offset off; returns the byte count
+// (0 at end of file) or -1 with errno set
+ssize_t vsfs_read(vsfs_image_t *im, uint64_t ino, void *buf, size_t len, uint64_t off);
+
+// files added since the last sync
+size_t vsfs_pending(vsfs_image_t *im);
+
+// free inodes and free data blocks, adds still in flight and releases still to be
+// committed counted as done. Kept as counts (and stored in the superblock), so
+// this costs no bitmap scan.
+void vsfs_free_space(vsfs_image_t *im, uint64_t *inodes, uint64_t *blocks);
+
+// finalizes the CRCs of everything added since the last sync and writes the
+// changed metadata (and the dedup index) back; a no-op when nothing is pending.
+// Waits for adds still copying data; adds started meanwhile wait for it.
+// With a journal the changed blocks are logged and flushed first, so the sync is
+// atomic across a crash; an add that would overflow the journal syncs first.
+int vsfs_sync(vsfs_image_t *im, char *why, size_t whylen);
+
+// syncs and releases the handle; the handle is freed even if the sync fails
+int vsfs_close(vsfs_image_t *im, char *why, size_t whylen);
+
+#endif
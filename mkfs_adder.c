@@ -1,363 +1,670 @@
-// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_adder.c -o mkfs_adder
-#define _FILE_OFFSET_BITS 64
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder.c minivsfs.c -o mkfs_adder
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <time.h>
-#include <assert.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "vsfs_stats.h"
+#include "minivsfs.h"
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --input <in.img> (--output <out.img> | --in-place | --delta <out.delta>) (--file <hostfile>)... [--manifest <list|->] [--remove <name>]...\n", prog);
+    fprintf(stderr, "  --file may be repeated; --manifest reads one host path per line ('-' = stdin)\n");
+    fprintf(stderr, "  --remove <name>  remove a file from the root directory before adding (may be repeated)\n");
+    fprintf(stderr, "  --in-place updates <in.img> directly, writing back only the blocks that changed\n");
+    fprintf(stderr, "  --delta leaves <in.img> as it is and writes just the blocks the update changes,\n");
+    fprintf(stderr, "          for mkfs_patch to apply to <in.img> or a copy of it\n");
+    fprintf(stderr, "  --alloc=first-fit|contiguous|best-fit  data block placement (default contiguous)\n");
+    fprintf(stderr, "  --dedup [--dedup-index <file>]  share identical 4 KiB blocks (index defaults to <image>.dedup)\n");
+    fprintf(stderr, "  --compress      store files compressed when that saves blocks\n");
+    fprintf(stderr, "  --pack-small    store files up to 56 bytes in the inode and pack file tails into shared blocks\n");
+    fprintf(stderr, "  --serve <socket> [--commit-ms N] [--commit-max N]  take files from clients on a Unix socket\n");
+    fprintf(stderr, "                   instead of --file, group-committing metadata every N ms or N files\n");
+    fprintf(stderr, "  --stats[=json]  per-phase times and I/O counters on stderr\n");
+    exit(1);
+}
 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    uint32_t checksum;            // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-    uint64_t inode_crc;   // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
+// list of host paths collected from --file and --manifest
 typedef struct {
-    uint32_t inode_no;
-    uint8_t type; // 1=file, 2=dir
-    char name[58];
-    uint8_t  checksum; // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+    char **paths;
+    size_t count;
+    size_t cap;
+} pathlist_t;
+
+static int pathlist_push(pathlist_t *pl, const char *path) {
+    if (pl->count == pl->cap) {
+        size_t ncap = pl->cap ? pl->cap * 2 : 16;
+        char **np = realloc(pl->paths, ncap * sizeof(char*));
+        if (!np) return -1;
+        pl->paths = np;
+        pl->cap = ncap;
     }
+    char *dup = strdup(path);
+    if (!dup) return -1;
+    pl->paths[pl->count++] = dup;
+    return 0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
+
+static void pathlist_free(pathlist_t *pl) {
+    for (size_t i = 0; i < pl->count; i++) free(pl->paths[i]);
+    free(pl->paths);
 }
-// ====================================CRC32====================================
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+
+// manifest: one host path per line, blank lines and lines starting with '#' are skipped
+static int read_manifest(pathlist_t *pl, const char *manifest) {
+    FILE *fm = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!fm) { perror("open manifest"); return -1; }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int rc = 0;
+    while ((len = getline(&line, &cap, fm)) >= 0) {
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+        if (len == 0 || line[0] == '#') continue;
+        if (pathlist_push(pl, line) != 0) { perror("manifest"); rc = -1; break; }
+    }
+    free(line);
+    if (fm != stdin) fclose(fm);
+    return rc;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+// adds one host file under its basename, cut to the 57 bytes a dirent name holds
+static int add_host_file(vsfs_image_t *im, const char *hostfile, vsfs_add_result_t *res, char *why, size_t whylen) {
+    char name[58];
+    const char *basename = hostfile;
+    const char *p = strrchr(hostfile, '/');
+    if (p) basename = p + 1;
+    memset(name, 0, sizeof(name));
+    strncpy(name, basename, sizeof(name)-1);
+
+    int host_fd = open(hostfile, O_RDONLY);
+    if (host_fd < 0) { snprintf(why, whylen, "open host file: %s", strerror(errno)); return -1; }
+    int rc = vsfs_add_fd(im, name, host_fd, res, why, whylen);
+    close(host_fd);
+    return rc;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
+// ------------------------------- --serve mode --------------------------------
+// Clients connect to a Unix stream socket and send one command per line:
+//   ADD <hostpath>     add a file the server opens itself (named by its basename)
+//   ADDFD <name>       add the file whose descriptor came with the message (SCM_RIGHTS)
+//   SYNC               commit now
+// and get one line back per command, in order: "OK <ino> <blocks> <runs> <shared>"
+// (or "OK" for SYNC) once the add is committed, or "ERR <reason>". Every client
+// connection has its own thread, so adds from several clients copy their data
+// concurrently. A committer thread writes the metadata back for all adds
+// finished since the last commit at once, commit_ms after the first of them or
+// as soon as commit_max are waiting. Replies to pipelined commands are sent
+// together once the last one is committed.
+
+#define SERVE_LINE_MAX 8192
+#define SERVE_MAX_FDS 64   // descriptors a client may have queued for ADDFD
+
+typedef struct conn conn_t;
+
+typedef struct {
+    vsfs_image_t *im;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // commit finished, commit wanted, or a client left
+    uint64_t next_gen;        // generation the next commit carries
+    uint64_t done_gen;        // last finished commit
+    int failed;               // a commit failed; the image is not written any further
+    char failed_why[288];
+    size_t uncommitted;       // adds finished since the last commit started
+    struct timespec first;    // when the oldest of them finished
+    int sync_requested;
+    int stopping;
+    long commit_ms;
+    size_t commit_max;
+    conn_t *conns;            // live connections
+} server_t;
+
+struct conn {
+    server_t *sv;
+    int fd;
+    pthread_t tid;
+    conn_t *next;
+};
+
+static int serve_signal_pipe[2] = { -1, -1 };
+
+static void serve_on_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    if (write(serve_signal_pipe[1], "x", 1) < 0) { /* pipe full: a stop is already pending */ }
+    errno = saved;
 }
-// ==========================DO NOT CHANGE THIS PORTION=========================
 
+static void *committer_main(void *arg) {
+    server_t *sv = arg;
+    pthread_mutex_lock(&sv->lock);
+    for (;;) {
+        while (!sv->stopping && !sv->sync_requested && sv->uncommitted < sv->commit_max) {
+            if (sv->uncommitted == 0) { pthread_cond_wait(&sv->cond, &sv->lock); continue; }
+            struct timespec deadline = sv->first;
+            deadline.tv_nsec += (sv->commit_ms % 1000) * 1000000L;
+            deadline.tv_sec += sv->commit_ms / 1000 + deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&sv->cond, &sv->lock, &deadline) == ETIMEDOUT) break;
+        }
+        if (sv->stopping && sv->uncommitted == 0 && !sv->sync_requested) break;
+        uint64_t gen = sv->next_gen++;
+        sv->uncommitted = 0;
+        sv->sync_requested = 0;
+        pthread_mutex_unlock(&sv->lock);
+
+        char why[256];
+        int rc = sv->failed ? -1 : vsfs_sync(sv->im, why, sizeof(why));
+
+        pthread_mutex_lock(&sv->lock);
+        if (rc != 0 && !sv->failed) {
+            fprintf(stderr, "Commit failed, no further updates are written: %s\n", why);
+            snprintf(sv->failed_why, sizeof(sv->failed_why), "commit failed: %s", why);
+            sv->failed = 1;
+        }
+        sv->done_gen = gen;
+        pthread_cond_broadcast(&sv->cond);
+    }
+    pthread_mutex_unlock(&sv->lock);
+    return NULL;
+}
 
-static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s --input <in.img> --output <out.img> --file <hostfile>\n", prog);
-    exit(1);
+// a finished add joins the next commit; returns the generation that will carry it
+static uint64_t serve_note_add(server_t *sv) {
+    pthread_mutex_lock(&sv->lock);
+    if (sv->uncommitted++ == 0) clock_gettime(CLOCK_MONOTONIC, &sv->first);
+    uint64_t gen = sv->next_gen;
+    if (sv->uncommitted == 1 || sv->uncommitted >= sv->commit_max) pthread_cond_broadcast(&sv->cond);
+    pthread_mutex_unlock(&sv->lock);
+    return gen;
 }
 
-static int find_first_zero_bit(uint8_t *bitmap, uint64_t bits) {
-    // returns 0-based index of first zero bit, or -1 if none
-    uint64_t bytes = (bits + 7) / 8;
-    for (uint64_t b = 0; b < bytes; b++) {
-        if (bitmap[b] != 0xFF) {
-            for (int bit = 0; bit < 8; bit++) {
-                uint64_t idx = b*8 + bit;
-                if (idx >= bits) return -1;
-                if ((bitmap[b] & (1u << bit)) == 0) return (int)idx;
-            }
+typedef struct {
+    char *text;
+    size_t len, cap;
+    size_t *ok_at;            // offsets of OK replies, rewritten if their commit fails
+    size_t n_ok, cap_ok;
+} replies_t;
+
+static int replies_add(replies_t *r, const char *line, int is_ok) {
+    size_t n = strlen(line);
+    if (r->len + n + 1 > r->cap) {
+        size_t ncap = r->cap ? r->cap * 2 : 4096;
+        while (ncap < r->len + n + 1) ncap *= 2;
+        char *nt = realloc(r->text, ncap);
+        if (!nt) return -1;
+        r->text = nt;
+        r->cap = ncap;
+    }
+    if (is_ok) {
+        if (r->n_ok == r->cap_ok) {
+            size_t ncap = r->cap_ok ? r->cap_ok * 2 : 64;
+            size_t *no = realloc(r->ok_at, ncap * sizeof(size_t));
+            if (!no) return -1;
+            r->ok_at = no;
+            r->cap_ok = ncap;
         }
+        r->ok_at[r->n_ok++] = r->len;
     }
-    return -1;
+    memcpy(r->text + r->len, line, n);
+    r->len += n;
+    return 0;
 }
 
-static int get_bit(uint8_t *bitmap, uint64_t idx) {
-    return (bitmap[idx/8] >> (idx%8)) & 1;
+static int write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        p += w; n -= (size_t)w;
+    }
+    return 0;
 }
-static void set_bit(uint8_t *bitmap, uint64_t idx) {
-    bitmap[idx/8] |= (1u << (idx%8));
+
+// waits for the commit carrying the queued replies, then sends them
+static int replies_flush(conn_t *c, replies_t *r, uint64_t wait_gen) {
+    server_t *sv = c->sv;
+    int failed = 0;
+    char failed_why[288];
+    if (wait_gen) {
+        pthread_mutex_lock(&sv->lock);
+        while (sv->done_gen < wait_gen) pthread_cond_wait(&sv->cond, &sv->lock);
+        failed = sv->failed;
+        snprintf(failed_why, sizeof(failed_why), "%s", sv->failed_why);
+        pthread_mutex_unlock(&sv->lock);
+    }
+    int rc = 0;
+    if (!failed) {
+        rc = write_all(c->fd, r->text, r->len);
+    } else {
+        // nothing in this batch reached the image: every OK becomes an error
+        size_t from = 0;
+        for (size_t i = 0; i < r->n_ok && rc == 0; i++) {
+            size_t at = r->ok_at[i];
+            const char *eol = memchr(r->text + at, '\n', r->len - at);
+            char line[300];
+            snprintf(line, sizeof(line), "ERR %s\n", failed_why);
+            rc = write_all(c->fd, r->text + from, at - from) == 0 ? write_all(c->fd, line, strlen(line)) : -1;
+            from = (size_t)(eol - r->text) + 1;
+        }
+        if (rc == 0) rc = write_all(c->fd, r->text + from, r->len - from);
+    }
+    r->len = 0;
+    r->n_ok = 0;
+    return rc;
 }
-static void clear_bit(uint8_t *bitmap, uint64_t idx) {
-    bitmap[idx/8] &= ~(1u << (idx%8));
+
+static void *conn_main(void *arg) {
+    conn_t *c = arg;
+    server_t *sv = c->sv;
+    char *buf = malloc(SERVE_LINE_MAX);
+    size_t have = 0;
+    int fds[SERVE_MAX_FDS];
+    size_t nfds = 0;
+    replies_t r = {0};
+    uint64_t wait_gen = 0;
+    int done = !buf;
+
+    while (!done) {
+        char ctrl[CMSG_SPACE(sizeof(int) * 16)];
+        struct iovec iov = { .iov_base = buf + have, .iov_len = SERVE_LINE_MAX - have };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl, .msg_controllen = sizeof(ctrl) };
+        ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+            size_t k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < k; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+                if (nfds < SERVE_MAX_FDS) fds[nfds++] = fd;
+                else close(fd);
+            }
+        }
+        have += (size_t)n;
+
+        char *line = buf, *eol;
+        while ((eol = memchr(line, '\n', have - (size_t)(line - buf))) != NULL) {
+            *eol = '\0';
+            if (eol > line && eol[-1] == '\r') eol[-1] = '\0';
+            char reply[400], why[256];
+            vsfs_add_result_t res;
+            int added = -1;
+            if (strncmp(line, "ADD ", 4) == 0) {
+                added = add_host_file(sv->im, line + 4, &res, why, sizeof(why));
+            } else if (strncmp(line, "ADDFD ", 6) == 0) {
+                if (nfds == 0) {
+                    snprintf(why, sizeof(why), "no file descriptor was passed");
+                } else {
+                    int fd = fds[0];
+                    memmove(fds, fds + 1, --nfds * sizeof(int));
+                    added = vsfs_add_fd(sv->im, line + 6, fd, &res, why, sizeof(why));
+                    close(fd);
+                }
+            } else if (strcmp(line, "SYNC") == 0) {
+                pthread_mutex_lock(&sv->lock);
+                sv->sync_requested = 1;
+                wait_gen = sv->next_gen;
+                pthread_cond_broadcast(&sv->cond);
+                pthread_mutex_unlock(&sv->lock);
+                replies_add(&r, "OK\n", 0);
+                line = eol + 1;
+                continue;
+            } else {
+                snprintf(why, sizeof(why), "unknown command");
+            }
+            if (added == 0) {
+                wait_gen = serve_note_add(sv);
+                snprintf(reply, sizeof(reply), "OK %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", res.ino, res.blocks, res.runs, res.shared);
+            } else {
+                snprintf(reply, sizeof(reply), "ERR %s\n", why);
+            }
+            if (replies_add(&r, reply, added == 0) != 0) { done = 1; break; }
+            line = eol + 1;
+        }
+        have -= (size_t)(line - buf);
+        memmove(buf, line, have);
+        if (have == SERVE_LINE_MAX) {
+            replies_add(&r, "ERR line too long\n", 0);
+            done = 1;
+        }
+        // answer once everything the client has sent so far is handled
+        if (r.len > 0 && replies_flush(c, &r, wait_gen) != 0) done = 1;
+        wait_gen = 0;
+    }
+    if (r.len > 0) replies_flush(c, &r, wait_gen);
+
+    for (size_t i = 0; i < nfds; i++) close(fds[i]);
+    free(buf);
+    free(r.text);
+    free(r.ok_at);
+    close(c->fd);
+
+    pthread_mutex_lock(&sv->lock);
+    for (conn_t **pp = &sv->conns; *pp; pp = &(*pp)->next) {
+        if (*pp == c) { *pp = c->next; break; }
+    }
+    pthread_cond_broadcast(&sv->cond);
+    pthread_mutex_unlock(&sv->lock);
+    free(c);
+    return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    crc32_init();
+// serves adds on socket_path until SIGINT or SIGTERM; returns non-zero if a commit failed
+static int serve(vsfs_image_t *im, const char *socket_path, long commit_ms, size_t commit_max) {
+    server_t sv;
+    memset(&sv, 0, sizeof(sv));
+    sv.im = im;
+    sv.next_gen = 1;
+    sv.commit_ms = commit_ms;
+    sv.commit_max = commit_max;
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&sv.cond, &ca);
+    pthread_condattr_destroy(&ca);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) { fprintf(stderr, "Socket path too long: %s\n", socket_path); return 1; }
+    strcpy(addr.sun_path, socket_path);
+    // a socket left behind by an earlier server is replaced; anything else is not touched
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+        perror("serve socket");
+        if (lfd >= 0) close(lfd);
+        return 1;
+    }
 
+    if (pipe2(serve_signal_pipe, O_CLOEXEC | O_NONBLOCK) != 0) { perror("pipe"); close(lfd); unlink(socket_path); return 1; }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t committer;
+    if (pthread_create(&committer, NULL, committer_main, &sv) != 0) { perror("pthread_create"); close(lfd); unlink(socket_path); return 1; }
+    fprintf(stderr, "Serving on %s (commit every %ld ms or %zu files)\n", socket_path, commit_ms, commit_max);
+
+    for (;;) {
+        struct pollfd pfd[2] = { { .fd = lfd, .events = POLLIN }, { .fd = serve_signal_pipe[0], .events = POLLIN } };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (pfd[1].revents) break;
+        if (!pfd[0].revents) continue;
+        int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) perror("accept");
+            continue;
+        }
+        conn_t *c = calloc(1, sizeof(*c));
+        if (!c) { close(cfd); continue; }
+        c->sv = &sv;
+        c->fd = cfd;
+        pthread_mutex_lock(&sv.lock);
+        c->next = sv.conns;
+        sv.conns = c;
+        if (pthread_create(&c->tid, NULL, conn_main, c) != 0) {
+            sv.conns = c->next;
+            pthread_mutex_unlock(&sv.lock);
+            close(cfd);
+            free(c);
+            continue;
+        }
+        pthread_detach(c->tid);
+        pthread_mutex_unlock(&sv.lock);
+    }
+
+    // stop taking connections, let every client finish what it already sent
+    close(lfd);
+    unlink(socket_path);
+    pthread_mutex_lock(&sv.lock);
+    for (conn_t *c = sv.conns; c; c = c->next) shutdown(c->fd, SHUT_RD);
+    while (sv.conns) pthread_cond_wait(&sv.cond, &sv.lock);
+    sv.stopping = 1;
+    pthread_cond_broadcast(&sv.cond);
+    pthread_mutex_unlock(&sv.lock);
+    pthread_join(committer, NULL);
+
+    close(serve_signal_pipe[0]);
+    close(serve_signal_pipe[1]);
+    pthread_mutex_destroy(&sv.lock);
+    pthread_cond_destroy(&sv.cond);
+    return sv.failed;
+}
+
+int main(int argc, char *argv[]) {
     char *input = NULL;
     char *output = NULL;
-    char *hostfile = NULL;
+    char *delta = NULL;
+    int in_place = 0;
+    int alloc_policy = VSFS_ALLOC_CONTIGUOUS;
+    int dedup = 0;
+    int compress = 0;
+    int pack_small = 0;
+    char *dedup_index = NULL;
+    pathlist_t files = {0};
+    pathlist_t removes = {0};
+    int stats_json = 0;
+    const char *serve_socket = NULL;
+    long commit_ms = 5;
+    long commit_max = 256;
 
-    if (argc < 7) usage(argv[0]);
     for (int i = 1; i < argc; i++) {
+        if (vsfs_stats_arg(argv[i], &stats_json)) continue;
         if (strcmp(argv[i],"--input")==0 && i+1<argc) input = argv[++i];
         else if (strcmp(argv[i],"--output")==0 && i+1<argc) output = argv[++i];
-        else if (strcmp(argv[i],"--file")==0 && i+1<argc) hostfile = argv[++i];
+        else if (strcmp(argv[i],"--in-place")==0) in_place = 1;
+        else if (strcmp(argv[i],"--delta")==0 && i+1<argc) delta = argv[++i];
+        else if (strcmp(argv[i],"--dedup")==0) dedup = 1;
+        else if (strcmp(argv[i],"--compress")==0) compress = 1;
+        else if (strcmp(argv[i],"--pack-small")==0) pack_small = 1;
+        else if (strcmp(argv[i],"--dedup-index")==0 && i+1<argc) { dedup = 1; dedup_index = argv[++i]; }
+        else if (strncmp(argv[i],"--alloc=",8)==0) {
+            const char *pol = argv[i] + 8;
+            if (strcmp(pol,"first-fit")==0) alloc_policy = VSFS_ALLOC_FIRST_FIT;
+            else if (strcmp(pol,"contiguous")==0) alloc_policy = VSFS_ALLOC_CONTIGUOUS;
+            else if (strcmp(pol,"best-fit")==0) alloc_policy = VSFS_ALLOC_BEST_FIT;
+            else { fprintf(stderr,"Unknown allocation policy: %s\n", pol); usage(argv[0]); }
+        }
+        else if (strcmp(argv[i],"--file")==0 && i+1<argc) {
+            if (pathlist_push(&files, argv[++i]) != 0) { perror("--file"); return 1; }
+        }
+        else if (strcmp(argv[i],"--remove")==0 && i+1<argc) {
+            if (pathlist_push(&removes, argv[++i]) != 0) { perror("--remove"); return 1; }
+        }
+        else if (strcmp(argv[i],"--serve")==0 && i+1<argc) serve_socket = argv[++i];
+        else if (strcmp(argv[i],"--commit-ms")==0 && i+1<argc) commit_ms = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i],"--commit-max")==0 && i+1<argc) commit_max = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i],"--manifest")==0 && i+1<argc) {
+            if (read_manifest(&files, argv[++i]) != 0) { pathlist_free(&files); return 1; }
+        }
         else { fprintf(stderr,"Unknown arg: %s\n", argv[i]); usage(argv[0]); }
     }
-    if (!input || !output || !hostfile) usage(argv[0]);
-
-    // open input image and read superblock block first
-    FILE *fin = fopen(input, "rb");
-    if (!fin) { perror("fopen input"); return 1; }
-
-    uint8_t sb_block[BS];
-    if (fread(sb_block, 1, BS, fin) != BS) { fprintf(stderr,"Failed to read superblock block\n"); fclose(fin); return 1; }
-
-    // interpret superblock from sb_block
-    superblock_t *sbp = (superblock_t*)sb_block;
-    if (sbp->magic != 0x4D565346u) { fprintf(stderr,"Bad magic: 0x%08x\n", sbp->magic); fclose(fin); return 1; }
-    // copy to local sb (we will modify fields only via sb_block when finalizing)
-    superblock_t sb;
-    memcpy(&sb, sbp, sizeof(superblock_t));
-
-    // now read entire image into memory (size = sb.total_blocks * BS)
-    uint64_t total_blocks = sb.total_blocks;
-    if (total_blocks == 0) { fprintf(stderr, "Invalid total_blocks\n"); fclose(fin); return 1; }
-    uint64_t image_size = total_blocks * (uint64_t)BS;
-
-    // allocate buffer and read whole file
-    uint8_t *img = malloc(image_size);
-    if (!img) { perror("malloc image"); fclose(fin); return 1; }
-    // we already read first block into sb_block; copy it
-    memcpy(img, sb_block, BS);
-    // read the rest
-    size_t toread = image_size - BS;
-    if (toread > 0) {
-        if (fread(img + BS, 1, toread, fin) != toread) { fprintf(stderr,"Failed to read full image\n"); free(img); fclose(fin); return 1; }
+    if (!input || (files.count == 0 && removes.count == 0) == !serve_socket || (!output && !in_place && !delta)) usage(argv[0]);
+    if (delta && (output || in_place)) {
+        fprintf(stderr, "--delta cannot be combined with --output or --in-place\n");
+        usage(argv[0]);
+    }
+    if (delta && dedup) {
+        // the index would describe the updated image while the input stays as it was
+        fprintf(stderr, "--dedup cannot be combined with --delta\n");
+        usage(argv[0]);
+    }
+    if (commit_ms < 0 || commit_max < 1) {
+        fprintf(stderr, "--commit-ms must be at least 0 and --commit-max at least 1\n");
+        usage(argv[0]);
     }
-    fclose(fin);
-
-    // locate bitmaps/inode table/data region offsets
-    uint8_t *inode_bitmap_block = img + sb.inode_bitmap_start * BS;
-    uint8_t *data_bitmap_block = img + sb.data_bitmap_start * BS;
-    uint8_t *inode_table_block = img + sb.inode_table_start * BS;
-    uint8_t *data_region_block = img + sb.data_region_start * BS;
-
-    uint64_t inode_count = sb.inode_count;
-    uint64_t data_region_blocks = sb.data_region_blocks;
-
-    // compute number of bytes in bitmaps (they were stored as full blocks by builder)
-    // but builder wrote full block; still, use the block pointer and treat it as a block-sized bitmap.
-    uint8_t *inode_bitmap = inode_bitmap_block; // BS-sized area
-    uint8_t *data_bitmap = data_bitmap_block;   // BS-sized area
-
-    // locate inode table as array
-    inode_t *inode_table = (inode_t*) inode_table_block;
-
-    // read host file content
-    FILE *fh = fopen(hostfile, "rb");
-    if (!fh) { perror("open host file"); free(img); return 1; }
-    if (fseek(fh, 0, SEEK_END) != 0) { perror("fseek"); fclose(fh); free(img); return 1; }
-    long host_size_l = ftell(fh);
-    if (host_size_l < 0) { perror("ftell"); fclose(fh); free(img); return 1; }
-    uint64_t host_size = (uint64_t)host_size_l;
-    rewind(fh);
-
-    if (host_size > DIRECT_MAX * (uint64_t)BS) {
-        fprintf(stderr, "File too large: max %u bytes\n", DIRECT_MAX * BS);
-        fclose(fh); free(img); return 1;
+    if (in_place && output && strcmp(input, output) != 0) {
+        fprintf(stderr, "--in-place and --output %s name different images\n", output);
+        usage(argv[0]);
+    }
+    if (output && strcmp(input, output) == 0) in_place = 1;
+    if (removes.count) {
+        // without the input's index a block shared with another file would be freed
+        // under it; a copy's default index starts out as the input's (see below)
+        char idx_path[4096];
+        snprintf(idx_path, sizeof(idx_path), "%s.dedup", input);
+        int inputs = !dedup_index || (in_place && strcmp(dedup_index, idx_path) == 0);
+        if (access(idx_path, F_OK) == 0 && (!dedup || !inputs)) {
+            fprintf(stderr, "%s exists: --remove needs --dedup with that index so shared blocks keep their other references\n", idx_path);
+            usage(argv[0]);
+        }
     }
 
-    // find free inode (first-fit)
-    int free_inode_bit = find_first_zero_bit(inode_bitmap, inode_count);
-    if (free_inode_bit < 0) {
-        fprintf(stderr, "No free inode available\n"); fclose(fh); free(img); return 1;
+    vsfs_stats_start();
+    vsfs_image_t *im;
+    char why[256];
+    int opened = delta ? vsfs_open_delta(input, delta, &im, why, sizeof(why))
+                       : vsfs_open(input, in_place ? NULL : output, &im, why, sizeof(why));
+    if (opened != 0) {
+        fprintf(stderr, "%s\n", why);
+        pathlist_free(&files);
+        pathlist_free(&removes);
+        return 1;
     }
-    uint64_t inode_index = (uint64_t)free_inode_bit; // 0-based index into table
-    uint64_t inode_no = inode_index + 1; // 1-based inode number
-
-    // compute how many data blocks needed
-    uint64_t need_blocks = (host_size + BS - 1) / BS;
-    if (need_blocks == 0) need_blocks = 1; // zero-length file -> still occupy 1 block?
-    if (need_blocks > DIRECT_MAX) { fprintf(stderr,"File requires too many blocks (>12)\n"); fclose(fh); free(img); return 1; }
-
-    // find free data blocks (first-fit, allocate any free ones)
-    uint32_t allocated_blocks[DIRECT_MAX];
-    uint64_t allocated = 0;
-    uint64_t total_data_blocks = sb.data_region_blocks;
-    for (uint64_t db = 0; db < total_data_blocks && allocated < need_blocks; db++) {
-        if (get_bit(data_bitmap, db) == 0) {
-            allocated_blocks[allocated++] = (uint32_t)db; // store relative index within data region
+    if (vsfs_replayed(im) > 0)
+        printf("Replayed %zu journal transaction(s) left by an interrupted update\n", vsfs_replayed(im));
+    vsfs_set_alloc_policy(im, alloc_policy);
+    vsfs_set_compression(im, compress);
+    vsfs_set_packing(im, pack_small);
+    char dedup_default[4096], dedup_seed[4096];
+    if (dedup) {
+        // a copy starts with the input's reference counts, kept in an index of its own
+        const char *seed = NULL;
+        if (!dedup_index) {
+            snprintf(dedup_default, sizeof(dedup_default), "%s.dedup", in_place ? input : output);
+            dedup_index = dedup_default;
+            if (!in_place) {
+                snprintf(dedup_seed, sizeof(dedup_seed), "%s.dedup", input);
+                seed = dedup_seed;
+            }
+        }
+        if (vsfs_enable_dedup_from(im, dedup_index, seed, why, sizeof(why)) != 0) {
+            fprintf(stderr, "%s\n", why);
+            vsfs_close(im, why, sizeof(why));
+            if (!in_place) unlink(output);
+            pathlist_free(&files);
+            pathlist_free(&removes);
+            return 1;
         }
     }
-    if (allocated < need_blocks) {
-        fprintf(stderr, "Not enough free data blocks (%" PRIu64 " available, %" PRIu64 " needed)\n", allocated, need_blocks);
-        fclose(fh); free(img); return 1;
+
+    if (serve_socket) {
+        int rc = serve(im, serve_socket, commit_ms, (size_t)commit_max);
+        if (vsfs_close(im, why, sizeof(why)) != 0) { fprintf(stderr, "%s\n", why); rc = 1; }
+        vsfs_stats_report(stderr, "mkfs_adder", stats_json);
+        return rc;
     }
 
-    // write file data into allocated blocks (absolute block numbers = sb.data_region_start + rel)
-    uint8_t file_block[BS];
-    size_t remaining = host_size;
-    for (uint64_t i = 0; i < need_blocks; i++) {
-        size_t toreadblock = remaining > BS ? BS : (size_t)remaining;
-        memset(file_block, 0, BS);
-        if (toreadblock > 0) {
-            if (fread(file_block, 1, toreadblock, fh) != toreadblock) { perror("read host file"); fclose(fh); free(img); return 1; }
+    size_t n_added = 0, n_rejected = 0, n_removed = 0;
+    uint64_t blocks_used = 0, runs_total = 0, fragmented = 0, shared_total = 0;
+    uint64_t bytes_in = 0, bytes_stored = 0;
+    uint64_t n_inline = 0, n_tails = 0, bytes_packed = 0;
+    uint64_t blocks_freed = 0;
+
+    // removals go first so the adds can use the space they release
+    for (size_t r = 0; r < removes.count; r++) {
+        uint64_t freed;
+        if (vsfs_remove(im, removes.paths[r], &freed, why, sizeof(why)) == 0) {
+            printf("Removed file '%s', releasing %" PRIu64 " blocks.\n", removes.paths[r], freed);
+            blocks_freed += freed;
+            n_removed++;
+        } else {
+            fprintf(stderr, "Could not remove '%s': %s\n", removes.paths[r], why);
+            n_rejected++;
         }
-        uint64_t rel = allocated_blocks[i];
-        uint64_t abs_block = sb.data_region_start + rel;
-        memcpy(img + abs_block * BS, file_block, BS);
-        remaining -= toreadblock;
-        // mark data bitmap bit (relative index)
-        set_bit(data_bitmap, rel);
     }
-    fclose(fh);
-
-    // update inode bitmap: mark inode_index as used
-    set_bit(inode_bitmap, inode_index);
-
-    // fill inode fields for new inode
-    inode_t new_ino;
-    memset(&new_ino, 0, sizeof(inode_t));
-    new_ino.mode = 0100000u; // regular file (octal)
-    new_ino.links = 1;
-    new_ino.uid = 0;
-    new_ino.gid = 0;
-    new_ino.size_bytes = host_size;
-    time_t now = time(NULL);
-    new_ino.atime = (uint64_t)now;
-    new_ino.mtime = (uint64_t)now;
-    new_ino.ctime = (uint64_t)now;
-    for (int i = 0; i < DIRECT_MAX; i++) new_ino.direct[i] = 0;
-    for (uint64_t i = 0; i < need_blocks; i++) {
-        uint64_t rel = allocated_blocks[i];
-        uint64_t abs_block = sb.data_region_start + rel;
-        new_ino.direct[i] = (uint32_t)abs_block;
+
+    for (size_t f = 0; f < files.count; f++) {
+        vsfs_add_result_t res;
+        if (add_host_file(im, files.paths[f], &res, why, sizeof(why)) == 0) {
+            printf("Added file '%s' as inode %" PRIu64 " using %" PRIu64 " blocks in %" PRIu64 " run%s",
+                   files.paths[f], res.ino, res.blocks, res.runs, res.runs == 1 ? "" : "s");
+            if (dedup) printf(", %" PRIu64 " shared", res.shared);
+            if (res.stored < res.size) printf(", compressed to %" PRIu64 " of %" PRIu64 " bytes", res.stored, res.size);
+            if (res.inlined) printf(", inline");
+            else if (res.packed) printf(", %" PRIu64 "-byte tail packed", res.packed);
+            printf(".\n");
+            if (res.inlined) n_inline++;
+            else if (res.packed) n_tails++;
+            bytes_packed += res.packed;
+            bytes_in += res.size;
+            bytes_stored += res.stored;
+            shared_total += res.shared;
+            n_added++;
+            blocks_used += res.blocks;
+            runs_total += res.runs;
+            if (res.runs > 1) fragmented++;
+        } else {
+            fprintf(stderr, "Rejected file '%s': %s\n", files.paths[f], why);
+            n_rejected++;
+        }
     }
-    new_ino.reserved_0 = new_ino.reserved_1 = new_ino.reserved_2 = 0;
-    new_ino.proj_id = 8;
-    new_ino.uid16_gid16 = 0;
-    new_ino.xattr_ptr = 0;
-    inode_crc_finalize(&new_ino);
-
-    // write new inode into inode_table (in-memory img)
-    inode_table[inode_index] = new_ino;
-
-    // Add directory entry into root directory's first data block
-    uint64_t root_abs_block = inode_table[0].direct[0]; // root's first data block (absolute)
-    if (root_abs_block == 0) { fprintf(stderr,"Root has no data block\n"); free(img); return 1; }
-    uint8_t *root_block_ptr = img + root_abs_block * BS;
-
-    // Find free dirent slot in the first block (each dirent is 64 bytes)
-    dirent64_t *dent = (dirent64_t*)root_block_ptr;
-    int found_slot = -1;
-    int max_dirents = BS / sizeof(dirent64_t);
-    for (int i = 0; i < max_dirents; i++) {
-        if (dent[i].inode_no == 0) { found_slot = i; break; }
+
+    uint64_t free_inodes, free_blocks;
+    vsfs_free_space(im, &free_inodes, &free_blocks);
+
+    // nothing is pending when every file was rejected, so closing writes nothing
+    int rc = 0;
+    uint64_t delta_blocks = 0;
+    if (delta && n_added + n_removed > 0) {
+        if (vsfs_write_delta(im, &delta_blocks, why, sizeof(why)) == 0) {
+            printf("Delta: %" PRIu64 " changed blocks (%" PRIu64 " KiB) written to %s\n", delta_blocks, delta_blocks * 4, delta);
+        } else {
+            fprintf(stderr, "%s\n", why);
+            rc = 1;
+        }
     }
-    if (found_slot == -1) {
-        fprintf(stderr, "No free directory entry in root\n"); free(img); return 1;
+    if (vsfs_close(im, why, sizeof(why)) != 0) {
+        fprintf(stderr, "%s\n", why);
+        rc = 1;
     }
-
-    // prepare dirent for new file
-    dirent64_t new_de;
-    memset(&new_de, 0, sizeof(dirent64_t));
-    new_de.inode_no = (uint32_t)inode_no;
-    new_de.type = 1; // file
-    // get basename of hostfile to use as name (strip directories)
-    const char *basename = hostfile;
-    const char *p = strrchr(hostfile, '/');
-    if (p) basename = p + 1;
-    // copy at most 57 bytes and leave last char as '\0' possibility (name field 58 bytes)
-    strncpy(new_de.name, basename, sizeof(new_de.name)-1);
-    dirent_checksum_finalize(&new_de);
-
-    // write dirent into root block at slot
-    memcpy(&dent[found_slot], &new_de, sizeof(dirent64_t));
-
-    // update root inode: size increases by 64, links++ (spec says root links increases by 1)
-    inode_table[0].size_bytes = inode_table[0].size_bytes + sizeof(dirent64_t);
-    inode_table[0].links += 1;
-    inode_table[0].mtime = (uint64_t)now;
-    inode_table[0].ctime = (uint64_t)now;
-    inode_crc_finalize(&inode_table[0]); // update root inode CRC
-
-    // recompute superblock checksum safely and write it into img[0..BS)
-    {
-        uint8_t tmp_sb_block[BS];
-        memset(tmp_sb_block, 0, BS);
-        // copy current sb into block
-        memcpy(tmp_sb_block, &sb, sizeof(superblock_t));
-        // call finalize on block (DO NOT CHANGE function expects full block)
-        superblock_crc_finalize((superblock_t*)tmp_sb_block);
-        // copy the full block back into img
-        memcpy(img, tmp_sb_block, BS);
+    if (n_added + n_removed == 0 && !in_place) {
+        // data blocks of rejected files may already sit in the copy; drop it
+        fprintf(stderr, "Nothing changed, %s not written\n", delta ? delta : output);
+        unlink(delta ? delta : output);
     }
-
-    // write modified image to output file
-    FILE *fout = fopen(output, "wb");
-    if (!fout) { perror("fopen output"); free(img); return 1; }
-    if (fwrite(img, 1, image_size, fout) != image_size) {
-        perror("write output"); fclose(fout); free(img); return 1;
+    if (files.count + removes.count > 1) {
+        printf("Summary: %zu added (%" PRIu64 " blocks), %zu removed (%" PRIu64 " blocks), %zu rejected\n",
+               n_added, blocks_used, n_removed, blocks_freed, n_rejected);
+        printf("Free: %" PRIu64 " inodes, %" PRIu64 " blocks (%" PRIu64 " KiB) left\n", free_inodes, free_blocks, free_blocks * 4);
+        if (dedup) printf("Dedup: %" PRIu64 " blocks shared instead of written\n", shared_total);
+        if (compress && bytes_in > 0)
+            printf("Compression: %" PRIu64 " bytes stored for %" PRIu64 " bytes of files (%.1f%%)\n",
+                   bytes_stored, bytes_in, 100.0 * (double)bytes_stored / (double)bytes_in);
+        if (pack_small)
+            printf("Packing: %" PRIu64 " files inline, %" PRIu64 " tails in shared blocks (%" PRIu64 " bytes outside whole blocks)\n",
+                   n_inline, n_tails, bytes_packed);
+        if (n_added > 0) {
+            printf("Fragmentation: %" PRIu64 " runs over %zu files (%.2f runs/file), %" PRIu64 " fragmented\n",
+                   runs_total, n_added, (double)runs_total / (double)n_added, fragmented);
+        }
     }
-    fclose(fout);
-    free(img);
+    if (n_rejected > 0) rc = 1;
+    vsfs_stats_report(stderr, "mkfs_adder", stats_json);
 
-    printf("Added file '%s' as inode %" PRIu64 " using %" PRIu64 " blocks.\n", hostfile, inode_no, need_blocks);
-    return 0;
+    pathlist_free(&files);
+    pathlist_free(&removes);
+    return rc;
 }
@@ -0,0 +1,634 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_check.c -o mkfs_check
+// Verifies a MiniVSFS image: superblock CRC and layout, every allocated inode's
+// CRC and block mapping, every dirent checksum, and the bitmaps against what the
+// inodes actually reference (double allocation, leaked and dangling blocks, link
+// counts). A journal that still holds committed transactions, compressed files
+// whose stream header disagrees with the inode, and packed small files whose inline
+// size or tail fragment is out of bounds (or overlaps another) are reported too, as
+// is a free-space summary in the superblock that disagrees with the bitmaps.
+// The image is mmapped read-only; the inode table, the directory blocks and the
+// bitmaps are each split into chunks that worker threads claim in turn.
+//
+// Exit status: 0 clean, 1 inconsistencies found, 2 the image could not be checked.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vsfs_crc.h"
+#include "vsfs_format.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define INODE_CHUNK 4096u      // inodes per work item
+#define DIRBLK_CHUNK 64u       // directory blocks per work item
+#define BITMAP_CHUNK 65536u    // data blocks per work item in the bitmap pass
+_Static_assert(BS == VSFS_BS, "block size mismatch");
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
+
+// error classes, in report order
+enum {
+    E_SUPERBLOCK,     // bad magic, layout or CRC
+    E_INODE_CRC,
+    E_INODE_BITMAP,   // inode in use but not marked, or marked but empty
+    E_DANGLING,       // pointer outside the data region, unmapped logical block, or block not marked allocated
+    E_DOUBLE,         // data block referenced more than once
+    E_LEAKED,         // data block marked allocated but referenced by nothing
+    E_DIRENT_CSUM,
+    E_DIRENT,         // entry naming a free or out-of-range inode, wrong type, bad name, bad . / ..
+    E_LINKS,          // link count or directory size disagrees with the entries
+    E_INDEX,          // directory name index header damaged or out of date
+    E_JOURNAL,        // journal header damaged, or committed transactions not replayed yet
+    E_ZSTREAM,        // compressed file whose stream header disagrees with its inode
+    E_PACKED,         // inline data too long, tail fragment outside its block or overlapping another
+    E_FREE_SUMMARY,   // superblock free counts, hints or group counts disagree with the bitmaps
+    E_COUNT
+};
+static const char *const err_names[E_COUNT] = {
+    "superblock", "inode_crc", "inode_bitmap", "dangling_block", "double_allocation",
+    "leaked_block", "dirent_checksum", "dirent", "link_count", "dir_index", "journal", "zstream",
+    "packed_data", "free_summary",
+};
+
+typedef struct {
+    uint32_t dir;     // directory inode index
+    uint32_t blk;     // absolute dirent block
+    uint64_t pos0;    // position of the block's first entry in the directory
+} dirblk_t;
+
+typedef struct {
+    dirblk_t *v;
+    size_t n, cap;
+} dirblk_list_t;
+
+// tail fragment of a packed file (IFL_TAIL)
+typedef struct {
+    uint64_t addr;    // byte address in the image
+    uint32_t len;
+    uint32_t ino;     // inode index
+} frag_t;
+
+typedef struct {
+    frag_t *v;
+    size_t n, cap;
+} frag_list_t;
+
+typedef struct {
+    const uint8_t *img;
+    superblock_t sb;
+    const inode_t *inodes;
+    const uint8_t *inode_bm;
+    const uint8_t *data_bm;
+
+    _Atomic uint64_t *seen;      // one bit per data block: referenced at least once
+    _Atomic uint64_t *dup;       // one bit per data block: referenced again
+    _Atomic uint32_t *refs;      // dirents naming each inode (. and .. excluded)
+    _Atomic uint32_t *children;  // live entries of each directory (. and .. excluded)
+    _Atomic uint32_t *parent;    // directory whose entry names each directory inode
+    _Atomic uint32_t *dotdot;    // what each directory's '..' entry names
+
+    dirblk_list_t dirblks;       // every directory block, filled by the inode pass
+    frag_list_t frags;           // every tail fragment, filled by the inode pass
+    pthread_mutex_t lock;        // guards dirblks merges and messages
+
+    atomic_ullong errors[E_COUNT];
+    atomic_ullong inodes_used, dirents_checked, blocks_referenced, blocks_shared;
+    char **messages;
+    size_t n_messages, max_messages;
+    int allow_shared;            // blocks shared by dedup are expected
+    _Atomic uint64_t next;       // work item cursor of the current pass
+} check_t;
+
+__attribute__((format(printf, 3, 4)))
+static void report(check_t *c, int cls, const char *fmt, ...) {
+    atomic_fetch_add(&c->errors[cls], 1);
+    pthread_mutex_lock(&c->lock);
+    if (c->n_messages < c->max_messages) {
+        char buf[256];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        c->messages[c->n_messages] = strdup(buf);
+        if (c->messages[c->n_messages]) c->n_messages++;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+static int bit_get(const uint8_t *bm, uint64_t i) {
+    return (bm[i / 8] >> (i % 8)) & 1;
+}
+
+// XOR of bytes 0..62, eight bytes at a time
+static uint8_t dirent_xor(const dirent64_t *de) {
+    uint64_t w[8];
+    memcpy(w, de, sizeof(w));
+    uint64_t x = w[0] ^ w[1] ^ w[2] ^ w[3] ^ w[4] ^ w[5] ^ w[6] ^ (w[7] & 0x00FFFFFFFFFFFFFFull);
+    x ^= x >> 32; x ^= x >> 16; x ^= x >> 8;
+    return (uint8_t)x;
+}
+
+static int in_data_region(const check_t *c, uint64_t blk) {
+    return blk >= c->sb.data_region_start && blk < c->sb.total_blocks;
+}
+
+// records one reference to blk from inode ino; returns 0 if the block is usable
+static int claim(check_t *c, uint64_t ino, uint64_t blk, const char *what) {
+    if (!in_data_region(c, blk)) {
+        report(c, E_DANGLING, "inode %" PRIu64 ": %s block %" PRIu64 " outside the data region", ino + 1, what, blk);
+        return -1;
+    }
+    uint64_t rel = blk - c->sb.data_region_start;
+    if (!bit_get(c->data_bm, rel))
+        report(c, E_DANGLING, "inode %" PRIu64 ": %s block %" PRIu64 " is not marked allocated", ino + 1, what, blk);
+    uint64_t mask = 1ull << (rel % 64);
+    if (atomic_fetch_or(&c->seen[rel / 64], mask) & mask) {
+        if (!(atomic_fetch_or(&c->dup[rel / 64], mask) & mask)) atomic_fetch_add(&c->blocks_shared, 1);
+    } else {
+        atomic_fetch_add(&c->blocks_referenced, 1);
+    }
+    return 0;
+}
+
+static const uint32_t *ptr_block(const check_t *c, uint64_t blk) {
+    return in_data_region(c, blk) ? (const uint32_t *)(c->img + blk * BS) : NULL;
+}
+
+// walks an inode's block mapping, claiming pointer blocks and data blocks. Files map
+// exactly n logical blocks; directories (n == 0) end at the first zero pointer.
+// Directory blocks are appended to out.
+static void walk_blocks(check_t *c, uint64_t idx, const inode_t *ino, uint64_t n, dirblk_list_t *out) {
+    int is_dir = n == 0;
+    uint64_t limit = is_dir ? MAX_FILE_BLOCKS : n;
+    const uint32_t *single = NULL, *dbl = NULL, *second = NULL;
+    uint64_t second_i = UINT64_MAX;
+    for (uint64_t l = 0; l < limit; l++) {
+        uint64_t b;
+        if (l < DIRECT_MAX) {
+            b = ino->direct[l];
+        } else if (l < DIRECT_MAX + PTRS_PER_BLOCK) {
+            if (l == DIRECT_MAX) {
+                if (!ino->reserved_0) { b = 0; goto unmapped; }
+                if (claim(c, idx, ino->reserved_0, "single indirect") != 0) return;
+                single = ptr_block(c, ino->reserved_0);
+            }
+            b = single[l - DIRECT_MAX];
+        } else {
+            uint64_t k = l - DIRECT_MAX - PTRS_PER_BLOCK;
+            if (k == 0) {
+                if (!ino->reserved_1) { b = 0; goto unmapped; }
+                if (claim(c, idx, ino->reserved_1, "double indirect") != 0) return;
+                dbl = ptr_block(c, ino->reserved_1);
+            }
+            if (k / PTRS_PER_BLOCK != second_i) {
+                second_i = k / PTRS_PER_BLOCK;
+                uint64_t sb2 = dbl[second_i];
+                if (!sb2) { b = 0; goto unmapped; }
+                if (claim(c, idx, sb2, "indirect") != 0) return;
+                second = ptr_block(c, sb2);
+            }
+            b = second[k % PTRS_PER_BLOCK];
+        }
+    unmapped:
+        if (b == 0) {
+            if (!is_dir) report(c, E_DANGLING, "inode %" PRIu64 ": logical block %" PRIu64 " of %" PRIu64 " is unmapped", idx + 1, l, n);
+            return;
+        }
+        if (claim(c, idx, b, is_dir ? "directory" : "data") != 0) continue;
+        if (is_dir) {
+            if (out->n == out->cap) {
+                size_t cap = out->cap ? out->cap * 2 : 64;
+                dirblk_t *v = realloc(out->v, cap * sizeof(*v));
+                if (!v) { perror("malloc"); exit(2); }
+                out->v = v; out->cap = cap;
+            }
+            out->v[out->n++] = (dirblk_t){ (uint32_t)idx, (uint32_t)b, l * DIRENTS_PER_BLOCK };
+        }
+    }
+}
+
+static void frag_push(frag_list_t *l, const frag_t *f) {
+    if (l->n == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        frag_t *v = realloc(l->v, cap * sizeof(*v));
+        if (!v) { perror("malloc"); exit(2); }
+        l->v = v; l->cap = cap;
+    }
+    l->v[l->n++] = *f;
+}
+
+static void check_inode(check_t *c, uint64_t i, dirblk_list_t *dirs, frag_list_t *frags) {
+    const inode_t *ino = &c->inodes[i];
+    int marked = bit_get(c->inode_bm, i);
+    if (ino->mode == 0) {
+        if (marked) report(c, E_INODE_BITMAP, "inode %" PRIu64 " is marked used but empty", i + 1);
+        return;
+    }
+    if (!marked) report(c, E_INODE_BITMAP, "inode %" PRIu64 " is in use but not marked in the bitmap", i + 1);
+    atomic_fetch_add(&c->inodes_used, 1);
+
+    uint8_t tmp[INODE_SIZE];
+    memcpy(tmp, ino, INODE_SIZE);
+    memset(&tmp[120], 0, 8);
+    if (vsfs_crc32(tmp, 120) != (uint32_t)ino->inode_crc || (ino->inode_crc >> 32) != 0)
+        report(c, E_INODE_CRC, "inode %" PRIu64 ": CRC mismatch", i + 1);
+
+    if ((ino->mode & 0170000u) == 0040000u) {
+        walk_blocks(c, i, ino, 0, dirs);
+        if (ino->reserved_2 & IFL_DIRINDEX) {
+            const dirindex_hdr_t *h = in_data_region(c, ino->xattr_ptr) ? (const dirindex_hdr_t *)(c->img + ino->xattr_ptr * BS) : NULL;
+            if (!h || h->magic != DIRINDEX_MAGIC || h->nslots < DIRINDEX_MIN_SLOTS || (h->nslots & (h->nslots - 1))) {
+                report(c, E_INDEX, "inode %" PRIu64 ": directory index header at block %" PRIu64 " is damaged", i + 1, ino->xattr_ptr);
+            } else {
+                uint64_t nblk = dir_index_blocks(h->nslots);
+                for (uint64_t k = 0; k < nblk; k++) claim(c, i, ino->xattr_ptr + k, "directory index");
+            }
+        }
+    } else if ((ino->mode & 0170000u) == 0100000u) {
+        uint32_t fl = ino->reserved_2;
+        if (((fl & IFL_INLINE) && (fl & (IFL_TAIL | IFL_COMPRESSED))) || ((fl & IFL_TAIL) && (fl & IFL_COMPRESSED))) {
+            report(c, E_PACKED, "inode %" PRIu64 ": flags 0x%x combine exclusive storage modes", i + 1, fl);
+            return;
+        }
+        if (fl & IFL_INLINE) {
+            if (ino->size_bytes > VSFS_INLINE_MAX)
+                report(c, E_PACKED, "inode %" PRIu64 ": inline size %" PRIu64 " exceeds %zu bytes", i + 1, ino->size_bytes, VSFS_INLINE_MAX);
+            return; // no blocks
+        }
+        if (fl & IFL_TAIL) {
+            uint64_t len = ino->size_bytes % BS;
+            if (len == 0 || !in_data_region(c, ino->xattr_ptr / BS) || ino->xattr_ptr % BS + len > BS)
+                report(c, E_PACKED, "inode %" PRIu64 ": tail fragment of %" PRIu64 " bytes at byte %" PRIu64 " is not inside a data block",
+                       i + 1, len, ino->xattr_ptr);
+            else
+                frag_push(frags, &(frag_t){ ino->xattr_ptr, (uint32_t)len, (uint32_t)i });
+        }
+        if (fl & IFL_COMPRESSED) {
+            // only the compressed stream is mapped; its header sits in the first block
+            const uint64_t cluster = 1ull << ZCLUSTER_SHIFT;
+            const zstream_hdr_t *h = in_data_region(c, ino->direct[0]) ? (const zstream_hdr_t *)(c->img + (uint64_t)ino->direct[0] * BS) : NULL;
+            if (ino->xattr_ptr < sizeof(zstream_hdr_t) || ino->xattr_ptr >= ino->size_bytes || !h ||
+                h->magic != ZSTREAM_MAGIC || h->cluster_shift != ZCLUSTER_SHIFT ||
+                h->nclusters != (ino->size_bytes + cluster - 1) / cluster || zstream_table_bytes(h->nclusters) > ino->xattr_ptr)
+                report(c, E_ZSTREAM, "inode %" PRIu64 ": compressed stream header does not match the inode", i + 1);
+        }
+        uint64_t n = inode_mapped_blocks(ino);
+        if (n > MAX_FILE_BLOCKS) {
+            report(c, E_DANGLING, "inode %" PRIu64 ": size %" PRIu64 " exceeds the largest mappable file", i + 1, ino->size_bytes);
+            return;
+        }
+        if (n) walk_blocks(c, i, ino, n, dirs); // a file that is all tail maps nothing
+    } else {
+        report(c, E_DIRENT, "inode %" PRIu64 ": unknown mode 0%o", i + 1, ino->mode);
+    }
+}
+
+static void *inode_worker(void *arg) {
+    check_t *c = arg;
+    dirblk_list_t local = {0};
+    frag_list_t frags = {0};
+    for (;;) {
+        uint64_t first = atomic_fetch_add(&c->next, INODE_CHUNK);
+        if (first >= c->sb.inode_count) break;
+        uint64_t last = first + INODE_CHUNK < c->sb.inode_count ? first + INODE_CHUNK : c->sb.inode_count;
+        for (uint64_t i = first; i < last; i++) check_inode(c, i, &local, &frags);
+    }
+    pthread_mutex_lock(&c->lock);
+    dirblk_list_t *g = &c->dirblks;
+    if (g->n + local.n > g->cap) {
+        size_t cap = g->cap ? g->cap : 64;
+        while (cap < g->n + local.n) cap *= 2;
+        dirblk_t *v = realloc(g->v, cap * sizeof(*v));
+        if (!v) { perror("malloc"); exit(2); }
+        g->v = v; g->cap = cap;
+    }
+    if (local.n) memcpy(g->v + g->n, local.v, local.n * sizeof(dirblk_t));
+    g->n += local.n;
+    for (size_t k = 0; k < frags.n; k++) frag_push(&c->frags, &frags.v[k]);
+    pthread_mutex_unlock(&c->lock);
+    free(local.v);
+    free(frags.v);
+    return NULL;
+}
+
+static int cmp_frag(const void *a, const void *b) {
+    uint64_t x = ((const frag_t *)a)->addr, y = ((const frag_t *)b)->addr;
+    return x < y ? -1 : x > y;
+}
+
+// tail fragments in address order: fragments sharing a block must not overlap, and
+// each tail block is claimed once, so a tail block that is also mapped as a whole
+// block of some file shows up as double allocation
+static void check_frags(check_t *c) {
+    frag_list_t *l = &c->frags;
+    if (l->n == 0) return;
+    qsort(l->v, l->n, sizeof(frag_t), cmp_frag);
+    const frag_t *last = NULL; // fragment reaching furthest into the current block
+    for (size_t k = 0; k < l->n; k++) {
+        const frag_t *f = &l->v[k];
+        if (last && last->addr / BS == f->addr / BS) {
+            if (last->addr + last->len > f->addr)
+                report(c, E_PACKED, "tail fragments of inodes %u and %u overlap in block %" PRIu64, last->ino + 1, f->ino + 1, f->addr / BS);
+            if (f->addr + f->len > last->addr + last->len) last = f;
+            continue;
+        }
+        last = f;
+        claim(c, f->ino, f->addr / BS, "tail");
+    }
+}
+
+// zero bits of a bitmap in [from, to)
+static uint64_t count_free(const uint8_t *bm, uint64_t from, uint64_t to) {
+    uint64_t n = 0;
+    for (; from < to && from % 64; from++) n += !bit_get(bm, from);
+    for (; from + 64 <= to; from += 64) {
+        uint64_t w;
+        memcpy(&w, bm + from / 8, 8);
+        n += 64 - (uint64_t)__builtin_popcountll(w);
+    }
+    for (; from < to; from++) n += !bit_get(bm, from);
+    return n;
+}
+
+// the free-space summary after the superblock fields, if the image has one: the
+// counts must match the bitmaps and no bit below a hint may be free
+static void check_free_summary(check_t *c) {
+    sb_free_t fs;
+    memcpy(&fs, c->img + SB_FREE_OFFSET, sizeof(fs));
+    if (fs.magic != SBFREE_MAGIC) return;
+    uint64_t nblocks = c->sb.data_region_blocks;
+    uint32_t shift = sb_free_group_shift(nblocks);
+    uint64_t ngroups = (nblocks + (1ull << shift) - 1) >> shift;
+    if (fs.group_shift != shift || fs.ngroups != ngroups) {
+        report(c, E_FREE_SUMMARY, "free-space summary has %u groups of 2^%u blocks, expected %" PRIu64 " of 2^%u",
+               fs.ngroups, fs.group_shift, ngroups, shift);
+        return;
+    }
+    uint64_t free_inodes = count_free(c->inode_bm, 0, c->sb.inode_count);
+    if (fs.free_inodes != free_inodes)
+        report(c, E_FREE_SUMMARY, "free-space summary counts %" PRIu64 " free inodes, the bitmap %" PRIu64, fs.free_inodes, free_inodes);
+    if (fs.inode_hint > c->sb.inode_count || count_free(c->inode_bm, 0, fs.inode_hint) != 0)
+        report(c, E_FREE_SUMMARY, "free-space summary inode hint %" PRIu64 " has free inodes below it", fs.inode_hint);
+    if (fs.block_hint > nblocks || count_free(c->data_bm, 0, fs.block_hint) != 0)
+        report(c, E_FREE_SUMMARY, "free-space summary block hint %" PRIu64 " has free blocks below it", fs.block_hint);
+    uint64_t free_blocks = 0;
+    for (uint64_t g = 0; g < ngroups; g++) {
+        uint64_t first = g << shift;
+        uint64_t last = first + (1ull << shift) < nblocks ? first + (1ull << shift) : nblocks;
+        uint64_t n = count_free(c->data_bm, first, last);
+        uint32_t stored;
+        memcpy(&stored, c->img + SB_FREE_OFFSET + sizeof(fs) + g * sizeof(uint32_t), sizeof(stored));
+        if (stored != n)
+            report(c, E_FREE_SUMMARY, "free-space summary counts %u free blocks in group %" PRIu64 ", the bitmap %" PRIu64, stored, g, n);
+        free_blocks += n;
+    }
+    if (fs.free_blocks != free_blocks)
+        report(c, E_FREE_SUMMARY, "free-space summary counts %" PRIu64 " free blocks, the bitmap %" PRIu64, fs.free_blocks, free_blocks);
+}
+
+static void check_dirblk(check_t *c, const dirblk_t *db) {
+    const dirent64_t *de = (const dirent64_t *)(c->img + (uint64_t)db->blk * BS);
+    for (uint64_t k = 0; k < DIRENTS_PER_BLOCK; k++, de++) {
+        if (de->inode_no == 0) continue;
+        uint64_t pos = db->pos0 + k;
+        atomic_fetch_add(&c->dirents_checked, 1);
+        if (dirent_xor(de) != de->checksum)
+            report(c, E_DIRENT_CSUM, "directory inode %u, entry %" PRIu64 ": checksum mismatch", db->dir + 1, pos);
+        if (memchr(de->name, '\0', sizeof(de->name)) == NULL || de->name[0] == '\0') {
+            report(c, E_DIRENT, "directory inode %u, entry %" PRIu64 ": name is empty or not terminated", db->dir + 1, pos);
+            continue;
+        }
+        if (de->inode_no > c->sb.inode_count || c->inodes[de->inode_no - 1].mode == 0) {
+            report(c, E_DIRENT, "directory inode %u, entry '%s': names free inode %u", db->dir + 1, de->name, de->inode_no);
+            continue;
+        }
+        int target_dir = (c->inodes[de->inode_no - 1].mode & 0170000u) == 0040000u;
+        if ((de->type == 2) != target_dir || (de->type != 1 && de->type != 2))
+            report(c, E_DIRENT, "directory inode %u, entry '%s': type %u does not match inode %u", db->dir + 1, de->name, de->type, de->inode_no);
+        if (strcmp(de->name, ".") == 0) {
+            if (de->inode_no != db->dir + 1) report(c, E_DIRENT, "directory inode %u: '.' names inode %u", db->dir + 1, de->inode_no);
+            continue;
+        }
+        if (strcmp(de->name, "..") == 0) {
+            atomic_store(&c->dotdot[db->dir], de->inode_no); // compared with the real parent once all entries are seen
+            continue;
+        }
+        if (target_dir) atomic_store(&c->parent[de->inode_no - 1], db->dir + 1);
+        atomic_fetch_add(&c->refs[de->inode_no - 1], 1);
+        atomic_fetch_add(&c->children[db->dir], 1);
+    }
+}
+
+static void *dirent_worker(void *arg) {
+    check_t *c = arg;
+    for (;;) {
+        uint64_t first = atomic_fetch_add(&c->next, DIRBLK_CHUNK);
+        if (first >= c->dirblks.n) break;
+        uint64_t last = first + DIRBLK_CHUNK < c->dirblks.n ? first + DIRBLK_CHUNK : c->dirblks.n;
+        for (uint64_t i = first; i < last; i++) check_dirblk(c, &c->dirblks.v[i]);
+    }
+    return NULL;
+}
+
+// link counts and directory sizes against the entries, then the data bitmap
+// against the blocks the inodes referenced
+static void *final_worker(void *arg) {
+    check_t *c = arg;
+    uint64_t inode_items = (c->sb.inode_count + INODE_CHUNK - 1) / INODE_CHUNK;
+    uint64_t bitmap_items = (c->sb.data_region_blocks + BITMAP_CHUNK - 1) / BITMAP_CHUNK;
+    for (;;) {
+        uint64_t item = atomic_fetch_add(&c->next, 1);
+        if (item >= inode_items + bitmap_items) break;
+        if (item < inode_items) {
+            uint64_t last = (item + 1) * INODE_CHUNK < c->sb.inode_count ? (item + 1) * INODE_CHUNK : c->sb.inode_count;
+            for (uint64_t i = item * INODE_CHUNK; i < last; i++) {
+                const inode_t *ino = &c->inodes[i];
+                if (ino->mode == 0) continue;
+                uint32_t refs = atomic_load(&c->refs[i]);
+                if ((ino->mode & 0170000u) == 0040000u) {
+                    uint32_t kids = atomic_load(&c->children[i]);
+                    if (ino->links != 2 + kids)
+                        report(c, E_LINKS, "directory inode %" PRIu64 ": links %u, expected %u", i + 1, ino->links, 2 + kids);
+                    if (ino->size_bytes != (2 + (uint64_t)kids) * sizeof(dirent64_t))
+                        report(c, E_LINKS, "directory inode %" PRIu64 ": size %" PRIu64 ", expected %" PRIu64, i + 1,
+                               ino->size_bytes, (2 + (uint64_t)kids) * sizeof(dirent64_t));
+                    if (i != ROOT_INO - 1 && refs == 0) report(c, E_LINKS, "directory inode %" PRIu64 " is not in any directory", i + 1);
+                    uint32_t parent = i == ROOT_INO - 1 ? ROOT_INO : atomic_load(&c->parent[i]);
+                    uint32_t dd = atomic_load(&c->dotdot[i]);
+                    if (parent && dd != parent)
+                        report(c, E_DIRENT, "directory inode %" PRIu64 ": '..' names inode %u, parent is %u", i + 1, dd, parent);
+                } else if (ino->links != refs) {
+                    report(c, E_LINKS, "inode %" PRIu64 ": links %u, referenced by %u entries", i + 1, ino->links, refs);
+                }
+            }
+        } else {
+            uint64_t first = (item - inode_items) * BITMAP_CHUNK;
+            uint64_t last = first + BITMAP_CHUNK < c->sb.data_region_blocks ? first + BITMAP_CHUNK : c->sb.data_region_blocks;
+            for (uint64_t b = first; b < last; b++) {
+                int used = (atomic_load(&c->seen[b / 64]) >> (b % 64)) & 1;
+                if (bit_get(c->data_bm, b) && !used)
+                    report(c, E_LEAKED, "block %" PRIu64 " is marked allocated but unreferenced", c->sb.data_region_start + b);
+                if (!c->allow_shared && ((atomic_load(&c->dup[b / 64]) >> (b % 64)) & 1))
+                    report(c, E_DOUBLE, "block %" PRIu64 " is referenced more than once", c->sb.data_region_start + b);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void run_pass(check_t *c, void *(*fn)(void *), long jobs) {
+    atomic_store(&c->next, 0);
+    pthread_t *tids = calloc((size_t)jobs, sizeof(pthread_t));
+    long started = 0;
+    while (tids && started < jobs - 1 && pthread_create(&tids[started], NULL, fn, c) == 0) started++;
+    fn(c);
+    for (long t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+}
+
+static int check_superblock(check_t *c, uint64_t file_size) {
+    const superblock_t *sb = &c->sb;
+    if (sb->magic != 0x4D565346u) { report(c, E_SUPERBLOCK, "bad magic 0x%08x", sb->magic); return -1; }
+    uint8_t blk[BS];
+    memcpy(blk, c->img, BS);
+    ((superblock_t *)blk)->checksum = 0;
+    if (vsfs_crc32(blk, BS - 4) != sb->checksum) report(c, E_SUPERBLOCK, "superblock CRC mismatch");
+    if (sb->block_size != BS) { report(c, E_SUPERBLOCK, "block size %u, expected %u", sb->block_size, BS); return -1; }
+    uint64_t meta = sb->inode_table_start + sb->inode_table_blocks;
+    if (sb->total_blocks == 0 || sb->total_blocks > UINT32_MAX || sb->total_blocks * BS > file_size ||
+        meta > sb->total_blocks || sb->data_region_start != meta || sb->data_region_blocks != sb->total_blocks - meta ||
+        sb->inode_bitmap_start + sb->inode_bitmap_blocks > meta || sb->data_bitmap_start + sb->data_bitmap_blocks > meta ||
+        sb->inode_bitmap_blocks * BS * 8 < sb->inode_count || sb->data_bitmap_blocks * BS * 8 < sb->data_region_blocks ||
+        sb->inode_table_blocks * BS < sb->inode_count * INODE_SIZE || sb->inode_count == 0 || sb->root_inode != ROOT_INO) {
+        report(c, E_SUPERBLOCK, "inconsistent layout");
+        return -1;
+    }
+    if (sb->flags & SBF_JOURNAL) {
+        uint64_t start = sb->data_bitmap_start + sb->data_bitmap_blocks;
+        if (sb->inode_table_start < start + JOURNAL_MIN_BLOCKS) { report(c, E_SUPERBLOCK, "journal does not fit before the inode table"); return -1; }
+        journal_hdr_t jh;
+        memcpy(&jh, c->img + start * BS, sizeof(jh));
+        if (jh.magic != JOURNAL_MAGIC || jh.blocks != sb->inode_table_start - start)
+            report(c, E_JOURNAL, "journal header damaged");
+        else if (jh.head_seq != 0)
+            report(c, E_JOURNAL, "journal holds transactions from seq %" PRIu64 " not replayed yet (opening the image with mkfs_adder replays them)", jh.head_seq);
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --image <image.img> [--jobs N] [--json] [--max-errors N] [--allow-shared]\n", prog);
+    fprintf(stderr, "  --allow-shared  blocks referenced by several inodes are expected (--dedup images;\n");
+    fprintf(stderr, "                  implied when <image>.dedup exists)\n");
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    vsfs_crc_init();
+    const char *image = NULL;
+    long jobs = 0;
+    int json = 0;
+    check_t c;
+    memset(&c, 0, sizeof(c));
+    c.max_messages = 50;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) image = argv[++i];
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) jobs = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) c.max_messages = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--json") == 0) json = 1;
+        else if (strcmp(argv[i], "--allow-shared") == 0) c.allow_shared = 1;
+        else { fprintf(stderr, "Unknown arg: %s\n", argv[i]); usage(argv[0]); }
+    }
+    if (!image) usage(argv[0]);
+    if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+    char sidecar[4096];
+    snprintf(sidecar, sizeof(sidecar), "%s.dedup", image);
+    if (access(sidecar, F_OK) == 0) c.allow_shared = 1;
+
+    int fd = open(image, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { perror(image); return 2; }
+    if ((uint64_t)st.st_size < BS) { fprintf(stderr, "%s: too small for a superblock\n", image); return 2; }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("mmap"); return 2; }
+    madvise(map, (size_t)st.st_size, MADV_WILLNEED);
+    c.img = map;
+    memcpy(&c.sb, c.img, sizeof(c.sb));
+    pthread_mutex_init(&c.lock, NULL);
+    c.messages = calloc(c.max_messages ? c.max_messages : 1, sizeof(char *));
+
+    int checked = 0;
+    if (check_superblock(&c, (uint64_t)st.st_size) == 0) {
+        checked = 1;
+        c.inodes = (const inode_t *)(c.img + c.sb.inode_table_start * BS);
+        c.inode_bm = c.img + c.sb.inode_bitmap_start * BS;
+        c.data_bm = c.img + c.sb.data_bitmap_start * BS;
+        uint64_t words = (c.sb.data_region_blocks + 63) / 64;
+        c.seen = calloc(words, sizeof(uint64_t));
+        c.dup = calloc(words, sizeof(uint64_t));
+        c.refs = calloc(c.sb.inode_count, sizeof(uint32_t));
+        c.children = calloc(c.sb.inode_count, sizeof(uint32_t));
+        c.parent = calloc(c.sb.inode_count, sizeof(uint32_t));
+        c.dotdot = calloc(c.sb.inode_count, sizeof(uint32_t));
+        if (!c.seen || !c.dup || !c.refs || !c.children || !c.parent || !c.dotdot || !c.messages) { perror("malloc"); return 2; }
+
+        if ((c.inodes[0].mode & 0170000u) != 0040000u) report(&c, E_DIRENT, "root inode is not a directory");
+        run_pass(&c, inode_worker, jobs);
+        check_frags(&c);
+        run_pass(&c, dirent_worker, jobs);
+        run_pass(&c, final_worker, jobs);
+        check_free_summary(&c);
+    }
+
+    uint64_t total = 0;
+    for (int e = 0; e < E_COUNT; e++) total += atomic_load(&c.errors[e]);
+    if (json) {
+        printf("{\"image\": \"%s\", \"checked\": %s, \"clean\": %s, \"inodes_used\": %llu, \"dirents_checked\": %llu, "
+               "\"blocks_referenced\": %llu, \"blocks_shared\": %llu, \"errors\": {",
+               image, checked ? "true" : "false", checked && total == 0 ? "true" : "false",
+               atomic_load(&c.inodes_used), atomic_load(&c.dirents_checked),
+               atomic_load(&c.blocks_referenced), atomic_load(&c.blocks_shared));
+        for (int e = 0; e < E_COUNT; e++) printf("%s\"%s\": %llu", e ? ", " : "", err_names[e], atomic_load(&c.errors[e]));
+        printf("}, \"messages\": [");
+        for (size_t m = 0; m < c.n_messages; m++) {
+            printf("%s\"", m ? ", " : "");
+            for (const char *p = c.messages[m]; *p; p++) {
+                if (*p == '"' || *p == '\\') putchar('\\');
+                if ((unsigned char)*p < 0x20) printf("\\u%04x", *p); else putchar(*p);
+            }
+            putchar('"');
+        }
+        printf("]}\n");
+    } else {
+        for (size_t m = 0; m < c.n_messages; m++) printf("%s\n", c.messages[m]);
+        if (total > c.n_messages) printf("... %" PRIu64 " more\n", total - c.n_messages);
+        printf("%s: %llu inodes, %llu dirents, %llu blocks referenced (%llu shared)\n", image,
+               atomic_load(&c.inodes_used), atomic_load(&c.dirents_checked),
+               atomic_load(&c.blocks_referenced), atomic_load(&c.blocks_shared));
+        if (total == 0 && checked) printf("clean\n");
+        for (int e = 0; e < E_COUNT; e++)
+            if (atomic_load(&c.errors[e])) printf("  %-18s %llu\n", err_names[e], atomic_load(&c.errors[e]));
+    }
+
+    for (size_t m = 0; m < c.n_messages; m++) free(c.messages[m]);
+    free(c.messages);
+    free(c.dirblks.v);
+    free(c.frags.v);
+    free(c.seen); free(c.dup); free(c.refs); free(c.children); free(c.parent); free(c.dotdot);
+    munmap(map, (size_t)st.st_size);
+    if (!checked) return 2;
+    return total ? 1 : 0;
+}
@@ -0,0 +1,364 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_reader.c -o mkfs_reader
+// Reads files back out of a MiniVSFS image without modifying it:
+//   mkfs_reader --image <img> ls [path]            list a directory (default /)
+//   mkfs_reader --image <img> cat <path>           write a file to stdout
+//   mkfs_reader --image <img> extract-all <dir>    recreate the whole tree under dir
+// The image is mmapped for metadata. File data never passes through user space
+// when the kernel can avoid it: each run of physically contiguous blocks becomes
+// one sendfile (stdout) or copy_file_range (extraction) call, and so does the inline
+// data or the tail fragment of a packed small file. Compressed files are
+// decompressed one 64 KiB cluster at a time as they are written out.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "vsfs_format.h"
+#include "vsfs_lz.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+_Static_assert(BS == VSFS_BS, "block size mismatch");
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size mismatch");
+
+typedef struct {
+    int fd;
+    const uint8_t *img;
+    size_t len;
+    superblock_t sb;
+    const inode_t *inodes;
+} reader_t;
+
+static int is_dir(const inode_t *ino) { return (ino->mode & 0170000u) == 0040000u; }
+
+static int valid_block(const reader_t *r, uint64_t b) {
+    return b >= r->sb.data_region_start && b < r->sb.total_blocks;
+}
+
+// absolute block behind logical block l (0 = unmapped or damaged)
+static uint64_t map_block(const reader_t *r, const inode_t *ino, uint64_t l) {
+    if (l < DIRECT_MAX) return ino->direct[l];
+    l -= DIRECT_MAX;
+    if (l < PTRS_PER_BLOCK) {
+        if (!valid_block(r, ino->reserved_0)) return 0;
+        return ((const uint32_t *)(r->img + (uint64_t)ino->reserved_0 * BS))[l];
+    }
+    l -= PTRS_PER_BLOCK;
+    if (l >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK || !valid_block(r, ino->reserved_1)) return 0;
+    uint64_t second = ((const uint32_t *)(r->img + (uint64_t)ino->reserved_1 * BS))[l / PTRS_PER_BLOCK];
+    if (!valid_block(r, second)) return 0;
+    return ((const uint32_t *)(r->img + second * BS))[l % PTRS_PER_BLOCK];
+}
+
+typedef int (*run_fn)(const reader_t *r, uint64_t off, size_t len, void *arg);
+
+// calls fn once per physically contiguous stretch of the file's data, trimmed to its
+// size. Inline bytes are a stretch of the inode table; a tail fragment is the last stretch.
+static int for_each_run(const reader_t *r, const inode_t *ino, run_fn fn, void *arg) {
+    if (ino->reserved_2 & IFL_INLINE) {
+        if (ino->size_bytes > VSFS_INLINE_MAX) { errno = EIO; return -1; }
+        uint64_t at = (uint64_t)((const uint8_t *)ino - r->img) + offsetof(inode_t, direct);
+        return ino->size_bytes ? fn(r, at, (size_t)ino->size_bytes, arg) : 0;
+    }
+    uint64_t tail = (ino->reserved_2 & IFL_TAIL) ? ino->size_bytes % BS : 0;
+    uint64_t size = ino->size_bytes - tail;
+    uint64_t n = (size + BS - 1) / BS;
+    for (uint64_t l = 0; l < n; ) {
+        uint64_t start = map_block(r, ino, l);
+        if (!valid_block(r, start)) { errno = EIO; return -1; }
+        uint64_t run = 1;
+        while (l + run < n && map_block(r, ino, l + run) == start + run) run++;
+        uint64_t bytes = run * BS;
+        if ((l + run) * BS > size) bytes = size - l * BS;
+        if (fn(r, start * BS, (size_t)bytes, arg) != 0) return -1;
+        l += run;
+    }
+    if (tail) {
+        if (!valid_block(r, ino->xattr_ptr / BS) || ino->xattr_ptr % BS + tail > BS) { errno = EIO; return -1; }
+        if (fn(r, ino->xattr_ptr, (size_t)tail, arg) != 0) return -1;
+    }
+    return 0;
+}
+
+// copies [off, off + len) of the bytes the inode's blocks hold out of the mapping
+static int read_stored(const reader_t *r, const inode_t *ino, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        uint64_t b = map_block(r, ino, off / BS);
+        if (!valid_block(r, b)) { errno = EIO; return -1; }
+        size_t boff = (size_t)(off % BS);
+        size_t n = BS - boff < len ? BS - boff : len;
+        memcpy(p, r->img + b * BS + boff, n);
+        p += n; off += n; len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+// writes a compressed file (IFL_COMPRESSED) to out, decompressing cluster by cluster
+static int write_compressed(const reader_t *r, const inode_t *ino, int out) {
+    zstream_hdr_t hdr;
+    const uint64_t cluster = 1ull << ZCLUSTER_SHIFT;
+    if (ino->xattr_ptr < sizeof(hdr) || read_stored(r, ino, &hdr, sizeof(hdr), 0) != 0) { errno = EIO; return -1; }
+    if (hdr.magic != ZSTREAM_MAGIC || hdr.cluster_shift != ZCLUSTER_SHIFT ||
+        hdr.nclusters != (ino->size_bytes + cluster - 1) / cluster || zstream_table_bytes(hdr.nclusters) > ino->xattr_ptr) {
+        errno = EIO;
+        return -1;
+    }
+    int rc = -1;
+    uint8_t *raw = malloc(cluster), *z = malloc(cluster);
+    if (!raw || !z) goto out;
+    for (uint64_t i = 0; i < hdr.nclusters; i++) {
+        uint64_t o[2];
+        if (read_stored(r, ino, o, sizeof(o), sizeof(hdr) + i * sizeof(uint64_t)) != 0) goto out;
+        size_t rn = ino->size_bytes - i * cluster < cluster ? (size_t)(ino->size_bytes - i * cluster) : (size_t)cluster;
+        if (o[1] < o[0] || o[1] - o[0] > rn || o[1] > ino->xattr_ptr) { errno = EIO; goto out; }
+        size_t zn = (size_t)(o[1] - o[0]);
+        const uint8_t *data = raw;
+        if (read_stored(r, ino, z, zn, o[0]) != 0) goto out;
+        if (zn == rn) data = z; // stored raw
+        else if (vsfs_lz_decompress(z, zn, raw, rn) != (long)rn) { errno = EIO; goto out; }
+        if (write_all(out, data, rn) != 0) goto out;
+    }
+    rc = 0;
+out:
+    free(raw);
+    free(z);
+    return rc;
+}
+
+// finds name in directory dir, through its hash index when it has one; returns the inode number or 0
+static uint32_t dir_find(const reader_t *r, const inode_t *dir, const char *name) {
+    if ((dir->reserved_2 & IFL_DIRINDEX) && valid_block(r, dir->xattr_ptr)) {
+        const dirindex_hdr_t *h = (const dirindex_hdr_t *)(r->img + dir->xattr_ptr * BS);
+        if (h->magic == DIRINDEX_MAGIC && h->nslots && (h->nslots & (h->nslots - 1)) == 0 &&
+            dir->xattr_ptr + dir_index_blocks(h->nslots) <= r->sb.total_blocks) {
+            const dirindex_slot_t *slots = (const dirindex_slot_t *)(r->img + (dir->xattr_ptr + 1) * BS);
+            uint32_t hash = name_hash(name), mask = h->nslots - 1;
+            for (uint32_t i = hash & mask, probes = 0; probes < h->nslots; i = (i + 1) & mask, probes++) {
+                if (slots[i].pos == DIRINDEX_EMPTY) return 0;
+                if (slots[i].pos == DIRINDEX_TOMB || slots[i].hash != hash) continue;
+                uint64_t pos = slots[i].pos - 1;
+                uint64_t b = map_block(r, dir, pos / DIRENTS_PER_BLOCK);
+                if (!valid_block(r, b)) continue;
+                const dirent64_t *de = (const dirent64_t *)(r->img + b * BS) + pos % DIRENTS_PER_BLOCK;
+                if (de->inode_no && strncmp(de->name, name, sizeof(de->name)) == 0) return de->inode_no;
+            }
+            return 0;
+        }
+    }
+    for (uint64_t l = 0; ; l++) {
+        uint64_t b = map_block(r, dir, l);
+        if (!valid_block(r, b)) return 0;
+        const dirent64_t *de = (const dirent64_t *)(r->img + b * BS);
+        for (uint64_t k = 0; k < DIRENTS_PER_BLOCK; k++)
+            if (de[k].inode_no && strncmp(de[k].name, name, sizeof(de[k].name)) == 0) return de[k].inode_no;
+    }
+}
+
+static const inode_t *get_inode(const reader_t *r, uint64_t ino_no) {
+    if (ino_no == 0 || ino_no > r->sb.inode_count) return NULL;
+    const inode_t *ino = &r->inodes[ino_no - 1];
+    return ino->mode ? ino : NULL;
+}
+
+// resolves a '/'-separated path from the root
+static const inode_t *lookup(const reader_t *r, const char *path) {
+    const inode_t *cur = get_inode(r, ROOT_INO);
+    char name[58];
+    while (cur && *path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        size_t len = strcspn(path, "/");
+        if (!is_dir(cur) || len >= sizeof(name)) return NULL;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        cur = get_inode(r, dir_find(r, cur, name));
+        path += len;
+    }
+    return cur;
+}
+
+typedef int (*entry_fn)(const reader_t *r, const dirent64_t *de, void *arg);
+
+static int for_each_entry(const reader_t *r, const inode_t *dir, entry_fn fn, void *arg) {
+    for (uint64_t l = 0; ; l++) {
+        uint64_t b = map_block(r, dir, l);
+        if (!valid_block(r, b)) return 0;
+        const dirent64_t *de = (const dirent64_t *)(r->img + b * BS);
+        for (uint64_t k = 0; k < DIRENTS_PER_BLOCK; k++) {
+            if (!de[k].inode_no || memchr(de[k].name, '\0', sizeof(de[k].name)) == NULL) continue;
+            if (fn(r, &de[k], arg) != 0) return -1;
+        }
+    }
+}
+
+static int print_entry(const reader_t *r, const dirent64_t *de, void *arg) {
+    (void)arg;
+    const inode_t *ino = get_inode(r, de->inode_no);
+    printf("%c %8u %12" PRIu64 "  %s\n", ino && is_dir(ino) ? 'd' : '-', de->inode_no, ino ? ino->size_bytes : 0, de->name);
+    return 0;
+}
+
+// stdout: sendfile from the image; if the kernel refuses, write from the mapping
+static int send_run(const reader_t *r, uint64_t off, size_t len, void *arg) {
+    int out = *(int *)arg;
+    off_t pos = (off_t)off;
+    while (len > 0) {
+        ssize_t n = sendfile(out, r->fd, &pos, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= (size_t)n;
+    }
+    const uint8_t *p = r->img + pos;
+    while (len > 0) {
+        ssize_t n = write(out, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+// host file: copy_file_range from the image (reflinks where the filesystem shares
+// extents), then plain writes from the mapping for whatever it could not move
+static int copy_run(const reader_t *r, uint64_t off, size_t len, void *arg) {
+    int out = *(int *)arg;
+    loff_t pos = (loff_t)off;
+    while (len > 0) {
+        ssize_t n = copy_file_range(r->fd, &pos, out, NULL, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= (size_t)n;
+    }
+    return len ? send_run(r, (uint64_t)pos, len, arg) : 0;
+}
+
+typedef struct {
+    char path[4096];
+    uint64_t files, dirs, bytes;
+} extract_t;
+
+static int extract_dir(const reader_t *r, const inode_t *dir, extract_t *x);
+
+static int extract_entry(const reader_t *r, const dirent64_t *de, void *arg) {
+    extract_t *x = arg;
+    if (strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) return 0;
+    const inode_t *ino = get_inode(r, de->inode_no);
+    if (!ino || strchr(de->name, '/')) { fprintf(stderr, "Skipping damaged entry '%s'\n", de->name); return 0; }
+    size_t base = strlen(x->path);
+    if (base + 1 + strlen(de->name) >= sizeof(x->path)) { errno = ENAMETOOLONG; return -1; }
+    sprintf(x->path + base, "/%s", de->name);
+    int rc = 0;
+    if (is_dir(ino)) {
+        if (mkdir(x->path, 0755) != 0 && errno != EEXIST) { perror(x->path); rc = -1; }
+        else { x->dirs++; rc = extract_dir(r, ino, x); }
+    } else {
+        int out = open(x->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) { perror(x->path); rc = -1; }
+        else {
+            int copied = (ino->reserved_2 & IFL_COMPRESSED) ? write_compressed(r, ino, out) : for_each_run(r, ino, copy_run, &out);
+            if (copied != 0) { perror(x->path); rc = -1; }
+            if (close(out) != 0) { perror(x->path); rc = -1; }
+            x->files++;
+            x->bytes += ino->size_bytes;
+        }
+    }
+    x->path[base] = '\0';
+    return rc;
+}
+
+static int extract_dir(const reader_t *r, const inode_t *dir, extract_t *x) {
+    return for_each_entry(r, dir, extract_entry, x);
+}
+
+static int reader_open(reader_t *r, const char *image) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(image, O_RDONLY);
+    struct stat st;
+    if (r->fd < 0 || fstat(r->fd, &st) != 0) { perror(image); return -1; }
+    if ((uint64_t)st.st_size < BS) { fprintf(stderr, "%s: not a MiniVSFS image\n", image); return -1; }
+    r->len = (size_t)st.st_size;
+    void *m = mmap(NULL, r->len, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (m == MAP_FAILED) { perror("mmap"); return -1; }
+    r->img = m;
+    memcpy(&r->sb, r->img, sizeof(r->sb));
+    if (r->sb.magic != 0x4D565346u || r->sb.block_size != BS || r->sb.total_blocks * BS > r->len ||
+        r->sb.inode_table_start + r->sb.inode_table_blocks > r->sb.total_blocks ||
+        r->sb.inode_table_blocks * BS < r->sb.inode_count * INODE_SIZE || r->sb.inode_count == 0) {
+        fprintf(stderr, "%s: not a MiniVSFS image\n", image);
+        return -1;
+    }
+    r->inodes = (const inode_t *)(r->img + r->sb.inode_table_start * BS);
+    if (!is_dir(&r->inodes[ROOT_INO - 1])) { fprintf(stderr, "%s: root inode is not a directory\n", image); return -1; }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --image <image.img> ls [path]\n", prog);
+    fprintf(stderr, "       %s --image <image.img> cat <path>\n", prog);
+    fprintf(stderr, "       %s --image <image.img> extract-all <dir>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *image = NULL;
+    int i = 1;
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) image = argv[++i];
+        else break;
+    }
+    if (!image || i >= argc) usage(argv[0]);
+    const char *cmd = argv[i];
+    const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+
+    reader_t r;
+    if (reader_open(&r, image) != 0) return 1;
+
+    int rc = 0;
+    if (strcmp(cmd, "ls") == 0) {
+        const inode_t *dir = lookup(&r, arg ? arg : "/");
+        if (!dir) { fprintf(stderr, "%s: no such file or directory\n", arg ? arg : "/"); rc = 1; }
+        else if (!is_dir(dir)) { printf("- %12" PRIu64 "  %s\n", dir->size_bytes, arg); }
+        else if (for_each_entry(&r, dir, print_entry, NULL) != 0) rc = 1;
+    } else if (strcmp(cmd, "cat") == 0 && arg) {
+        const inode_t *ino = lookup(&r, arg);
+        int out = STDOUT_FILENO;
+        if (!ino || is_dir(ino)) { fprintf(stderr, "%s: not a file in the image\n", arg); rc = 1; }
+        else if (((ino->reserved_2 & IFL_COMPRESSED) ? write_compressed(&r, ino, out) : for_each_run(&r, ino, send_run, &out)) != 0) {
+            perror("cat");
+            rc = 1;
+        }
+    } else if (strcmp(cmd, "extract-all") == 0 && arg) {
+        extract_t x;
+        memset(&x, 0, sizeof(x));
+        snprintf(x.path, sizeof(x.path), "%s", arg);
+        if (mkdir(x.path, 0755) != 0 && errno != EEXIST) { perror(x.path); rc = 1; }
+        else if (extract_dir(&r, get_inode(&r, ROOT_INO), &x) != 0) rc = 1;
+        fprintf(stderr, "Extracted %" PRIu64 " files (%" PRIu64 " bytes) and %" PRIu64 " directories into %s\n",
+                x.files, x.bytes, x.dirs, arg);
+    } else {
+        usage(argv[0]);
+    }
+
+    munmap((void *)r.img, r.len);
+    close(r.fd);
+    return rc;
+}
@@ -0,0 +1,186 @@
+// vsfs_bitmap.h - allocator over the on-disk inode and data bitmaps.
+// Bit i lives in byte i/8, bit i%8 (LSB first), so a little-endian 64-bit load
+// holds bits [64k, 64k+63] and free bits can be found with ctz instead of a
+// per-bit walk. On x86-64 fully allocated stretches are skipped 16 bytes at a
+// time with SSE2. A next-fit cursor remembers where the last allocation ended
+// so successive allocations do not rescan the full prefix of the bitmap.
+// The free count, a lower bound on the first free bit and (optionally) free
+// counts per group of 2^group_shift bits are kept up to date by set/clear once
+// vsfs_bm_recount() or the owner has seeded them; searches skip whole groups
+// that have no free bit.
+#ifndef VSFS_BITMAP_H
+#define VSFS_BITMAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// a tool may define VSFS_BM_ON_WORDS(n) before including this header to count scanned words
+#ifndef VSFS_BM_ON_WORDS
+#define VSFS_BM_ON_WORDS(n) ((void)0)
+#endif
+
+typedef struct {
+    uint8_t *bits;     // backing bytes, at least (nbits + 7) / 8 long
+    uint64_t nbits;    // number of valid bits
+    uint64_t cursor;   // next-fit hint: search starts here and wraps around
+    uint64_t nfree;    // zero bits
+    uint64_t low;      // no zero bit below this
+    uint32_t *group_free; // zero bits per group, NULL = no group counts
+    unsigned group_shift; // a group is 1 << group_shift bits, at least 64
+} vsfs_bitmap_t;
+
+#define VSFS_BM_NONE UINT64_MAX
+
+static inline void vsfs_bm_init(vsfs_bitmap_t *bm, uint8_t *bits, uint64_t nbits) {
+    bm->bits = bits;
+    bm->nbits = nbits;
+    bm->cursor = 0;
+    bm->nfree = 0;
+    bm->low = 0;
+    bm->group_free = NULL;
+    bm->group_shift = 0;
+}
+
+static inline uint64_t vsfs_bm_groups(const vsfs_bitmap_t *bm) {
+    return (bm->nbits + (1ull << bm->group_shift) - 1) >> bm->group_shift;
+}
+
+static inline int vsfs_bm_get(const vsfs_bitmap_t *bm, uint64_t idx) {
+    return (bm->bits[idx / 8] >> (idx % 8)) & 1;
+}
+static inline void vsfs_bm_set(vsfs_bitmap_t *bm, uint64_t idx) {
+    uint8_t m = (uint8_t)(1u << (idx % 8));
+    if (bm->bits[idx / 8] & m) return;
+    bm->bits[idx / 8] |= m;
+    bm->nfree--;
+    if (bm->group_free) bm->group_free[idx >> bm->group_shift]--;
+}
+static inline void vsfs_bm_clear(vsfs_bitmap_t *bm, uint64_t idx) {
+    uint8_t m = (uint8_t)(1u << (idx % 8));
+    if (!(bm->bits[idx / 8] & m)) return;
+    bm->bits[idx / 8] &= (uint8_t)~m;
+    bm->nfree++;
+    if (bm->group_free) bm->group_free[idx >> bm->group_shift]++;
+    if (idx < bm->low) bm->low = idx;
+}
+
+// 64 bits starting at bit 64*w; bits past nbits read as allocated (1)
+static inline uint64_t vsfs_bm_word(const vsfs_bitmap_t *bm, uint64_t w) {
+    uint64_t first = w * 64;
+    uint64_t v = 0;
+    VSFS_BM_ON_WORDS(1);
+    if (first + 64 <= bm->nbits) {
+        memcpy(&v, bm->bits + w * 8, 8);
+        return v;
+    }
+    uint64_t valid = bm->nbits - first;
+    memcpy(&v, bm->bits + w * 8, (valid + 7) / 8);
+    return v | (~(uint64_t)0 << valid);
+}
+
+// first zero bit in [from, to), or VSFS_BM_NONE
+static inline uint64_t vsfs_bm_next_zero(const vsfs_bitmap_t *bm, uint64_t from, uint64_t to) {
+    if (to > bm->nbits) to = bm->nbits;
+    if (from < bm->low) from = bm->low;
+    while (from < to) {
+        if (bm->group_free && bm->group_free[from >> bm->group_shift] == 0) {
+            from = ((from >> bm->group_shift) + 1) << bm->group_shift;
+            continue;
+        }
+        uint64_t w = from / 64;
+        uint64_t v = ~vsfs_bm_word(bm, w) & (~(uint64_t)0 << (from % 64));
+        if (v) {
+            uint64_t idx = w * 64 + (uint64_t)__builtin_ctzll(v);
+            return idx < to ? idx : VSFS_BM_NONE;
+        }
+        from = (w + 1) * 64;
+#if defined(__SSE2__)
+        // skip runs of fully set 128-bit chunks
+        const __m128i ones = _mm_set1_epi8((char)0xFF);
+        while (from + 128 <= to) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(bm->bits + from / 8));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(c, ones)) != 0xFFFF) break;
+            VSFS_BM_ON_WORDS(2);
+            from += 128;
+        }
+#endif
+    }
+    return VSFS_BM_NONE;
+}
+
+// first set bit in [from, to), or `to` if the range is entirely free
+static inline uint64_t vsfs_bm_next_one(const vsfs_bitmap_t *bm, uint64_t from, uint64_t to) {
+    if (to > bm->nbits) to = bm->nbits;
+    while (from < to) {
+        uint64_t w = from / 64;
+        uint64_t v = vsfs_bm_word(bm, w) & (~(uint64_t)0 << (from % 64));
+        if (v) {
+            uint64_t idx = w * 64 + (uint64_t)__builtin_ctzll(v);
+            return idx < to ? idx : to;
+        }
+        from = (w + 1) * 64;
+    }
+    return to;
+}
+
+// next-fit: first zero at or after the cursor, wrapping to the start
+static inline uint64_t vsfs_bm_find_zero(const vsfs_bitmap_t *bm) {
+    uint64_t idx = vsfs_bm_next_zero(bm, bm->cursor, bm->nbits);
+    if (idx == VSFS_BM_NONE && bm->cursor > 0) idx = vsfs_bm_next_zero(bm, 0, bm->cursor);
+    return idx;
+}
+
+// first run of `len` zero bits starting in [from, to), or VSFS_BM_NONE
+static inline uint64_t vsfs_bm_find_run_in(const vsfs_bitmap_t *bm, uint64_t len, uint64_t from, uint64_t to) {
+    if (len == 0) return from;
+    while (from < to) {
+        uint64_t start = vsfs_bm_next_zero(bm, from, to);
+        if (start == VSFS_BM_NONE) return VSFS_BM_NONE;
+        uint64_t end = vsfs_bm_next_one(bm, start, start + len > bm->nbits ? bm->nbits : start + len);
+        if (end - start >= len) return start;
+        from = end + 1;
+    }
+    return VSFS_BM_NONE;
+}
+
+// next-fit search for `len` contiguous zero bits
+static inline uint64_t vsfs_bm_find_run(const vsfs_bitmap_t *bm, uint64_t len) {
+    uint64_t idx = vsfs_bm_find_run_in(bm, len, bm->cursor, bm->nbits);
+    if (idx == VSFS_BM_NONE && bm->cursor > 0) idx = vsfs_bm_find_run_in(bm, len, 0, bm->cursor);
+    return idx;
+}
+
+// number of zero bits, by popcount over whole words
+static inline uint64_t vsfs_bm_count_free(const vsfs_bitmap_t *bm) {
+    uint64_t used = 0;
+    for (uint64_t w = 0; w * 64 < bm->nbits; w++) used += (uint64_t)__builtin_popcountll(vsfs_bm_word(bm, w));
+    uint64_t words = (bm->nbits + 63) / 64;
+    return words * 64 - used; // padding bits past nbits were counted as used
+}
+
+// recomputes nfree, low and the group counts (if any) from the bits
+static inline void vsfs_bm_recount(vsfs_bitmap_t *bm) {
+    if (bm->group_free) memset(bm->group_free, 0, vsfs_bm_groups(bm) * sizeof(uint32_t));
+    bm->nfree = 0;
+    bm->low = bm->nbits;
+    for (uint64_t w = 0; w * 64 < bm->nbits; w++) {
+        uint64_t v = vsfs_bm_word(bm, w);
+        uint64_t f = 64 - (uint64_t)__builtin_popcountll(v);
+        if (f && bm->low == bm->nbits) bm->low = w * 64 + (uint64_t)__builtin_ctzll(~v);
+        bm->nfree += f;
+        if (bm->group_free) bm->group_free[(w * 64) >> bm->group_shift] += (uint32_t)f;
+    }
+}
+
+// first zero bit (nbits when there is none); moves low up to it
+static inline uint64_t vsfs_bm_lowest_zero(vsfs_bitmap_t *bm) {
+    uint64_t idx = vsfs_bm_next_zero(bm, bm->low, bm->nbits);
+    bm->low = idx == VSFS_BM_NONE ? bm->nbits : idx;
+    return bm->low;
+}
+
+#endif
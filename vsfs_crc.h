@@ -0,0 +1,245 @@
+// vsfs_crc.h - CRC32 (IEEE, reflected 0xEDB88320) engine shared by the MiniVSFS tools.
+// Gives exactly the same results as the reference byte-at-a-time crc32() in the tools,
+// but picks the fastest kernel the CPU supports at runtime:
+//   pclmul  - x86-64 carry-less multiply folding, 64 bytes per iteration
+//   slice16 - portable slice-by-16 table lookup
+//   slice8  - portable slice-by-8 table lookup
+//   bytewise - the reference algorithm, kept for self-test and benchmarking
+// Call vsfs_crc_init() once before use. VSFS_CRC_KERNEL=<name> in the environment
+// forces a kernel (useful to compare outputs or benchmark).
+#ifndef VSFS_CRC_H
+#define VSFS_CRC_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VSFS_CRC_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
+
+// every kernel works on the raw (pre-inverted) crc state
+typedef uint32_t (*vsfs_crc_kernel_fn)(uint32_t state, const uint8_t *p, size_t n);
+
+typedef struct {
+    const char *name;
+    vsfs_crc_kernel_fn fn;
+    int available;
+} vsfs_crc_kernel_t;
+
+static uint32_t vsfs_crc_tab[16][256];
+static vsfs_crc_kernel_fn vsfs_crc_active;
+static const char *vsfs_crc_active_name;
+
+static uint32_t vsfs_crc_bytewise(uint32_t c, const uint8_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = vsfs_crc_tab[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static inline uint32_t vsfs_crc_load32(const uint8_t *p) {
+    uint32_t v; memcpy(&v, p, 4); return v; // the on-disk format is little-endian, as is every host we build for
+}
+
+static uint32_t vsfs_crc_slice8(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 8) {
+        uint32_t a = vsfs_crc_load32(p) ^ c;
+        uint32_t b = vsfs_crc_load32(p + 4);
+        c = vsfs_crc_tab[7][a & 0xFF] ^ vsfs_crc_tab[6][(a >> 8) & 0xFF] ^
+            vsfs_crc_tab[5][(a >> 16) & 0xFF] ^ vsfs_crc_tab[4][a >> 24] ^
+            vsfs_crc_tab[3][b & 0xFF] ^ vsfs_crc_tab[2][(b >> 8) & 0xFF] ^
+            vsfs_crc_tab[1][(b >> 16) & 0xFF] ^ vsfs_crc_tab[0][b >> 24];
+        p += 8; n -= 8;
+    }
+    return vsfs_crc_bytewise(c, p, n);
+}
+
+static uint32_t vsfs_crc_slice16(uint32_t c, const uint8_t *p, size_t n) {
+    while (n >= 16) {
+        uint32_t a = vsfs_crc_load32(p) ^ c;
+        uint32_t b = vsfs_crc_load32(p + 4);
+        uint32_t d = vsfs_crc_load32(p + 8);
+        uint32_t e = vsfs_crc_load32(p + 12);
+        c = vsfs_crc_tab[15][a & 0xFF] ^ vsfs_crc_tab[14][(a >> 8) & 0xFF] ^
+            vsfs_crc_tab[13][(a >> 16) & 0xFF] ^ vsfs_crc_tab[12][a >> 24] ^
+            vsfs_crc_tab[11][b & 0xFF] ^ vsfs_crc_tab[10][(b >> 8) & 0xFF] ^
+            vsfs_crc_tab[9][(b >> 16) & 0xFF] ^ vsfs_crc_tab[8][b >> 24] ^
+            vsfs_crc_tab[7][d & 0xFF] ^ vsfs_crc_tab[6][(d >> 8) & 0xFF] ^
+            vsfs_crc_tab[5][(d >> 16) & 0xFF] ^ vsfs_crc_tab[4][d >> 24] ^
+            vsfs_crc_tab[3][e & 0xFF] ^ vsfs_crc_tab[2][(e >> 8) & 0xFF] ^
+            vsfs_crc_tab[1][(e >> 16) & 0xFF] ^ vsfs_crc_tab[0][e >> 24];
+        p += 16; n -= 16;
+    }
+    return vsfs_crc_bytewise(c, p, n);
+}
+
+#ifdef VSFS_CRC_HAVE_PCLMUL
+// folds 4x128 bits per iteration, then reduces with Barrett; needs n >= 64.
+// Constants are x^(k) mod P(x) for the bit-reflected IEEE polynomial.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t vsfs_crc_pclmul_fold(uint32_t crc, const uint8_t *buf, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = k1k2;
+    buf += 64; len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+        buf += 64; len -= 64;
+    }
+
+    // fold the four lanes into one 128-bit value
+    x0 = k3k4;
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // remaining whole 16-byte blocks
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16; len -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = k5k0;
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = poly;
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t vsfs_crc_pclmul(uint32_t c, const uint8_t *p, size_t n) {
+    if (n >= 64) {
+        size_t bulk = n & ~(size_t)15;
+        c = vsfs_crc_pclmul_fold(c, p, bulk);
+        p += bulk; n -= bulk;
+    }
+    return vsfs_crc_slice16(c, p, n);
+}
+#endif
+
+static vsfs_crc_kernel_t vsfs_crc_kernels[] = {
+#ifdef VSFS_CRC_HAVE_PCLMUL
+    { "pclmul",   vsfs_crc_pclmul,   0 },
+#endif
+    { "slice16",  vsfs_crc_slice16,  1 },
+    { "slice8",   vsfs_crc_slice8,   1 },
+    { "bytewise", vsfs_crc_bytewise, 1 },
+};
+#define VSFS_CRC_NKERNELS (sizeof(vsfs_crc_kernels) / sizeof(vsfs_crc_kernels[0]))
+
+static inline void vsfs_crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        vsfs_crc_tab[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 16; t++) {
+            uint32_t prev = vsfs_crc_tab[t - 1][i];
+            vsfs_crc_tab[t][i] = vsfs_crc_tab[0][prev & 0xFF] ^ (prev >> 8);
+        }
+    }
+#ifdef VSFS_CRC_HAVE_PCLMUL
+    __builtin_cpu_init();
+    vsfs_crc_kernels[0].available = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+    // first available kernel in the table is the fastest
+    vsfs_crc_active = NULL;
+    const char *force = getenv("VSFS_CRC_KERNEL");
+    for (size_t k = 0; k < VSFS_CRC_NKERNELS; k++) {
+        if (!vsfs_crc_kernels[k].available) continue;
+        if (force && strcmp(force, vsfs_crc_kernels[k].name) != 0) continue;
+        vsfs_crc_active = vsfs_crc_kernels[k].fn;
+        vsfs_crc_active_name = vsfs_crc_kernels[k].name;
+        break;
+    }
+    if (!vsfs_crc_active) { // unknown or unavailable forced kernel
+        vsfs_crc_active = vsfs_crc_slice16;
+        vsfs_crc_active_name = "slice16";
+    }
+}
+
+// continue a crc over more bytes: vsfs_crc32_update(vsfs_crc32(a, n), b, m) == crc of a||b
+// a tool may define VSFS_CRC_ON_BYTES(n) before including this header to count hashed bytes
+#ifndef VSFS_CRC_ON_BYTES
+#define VSFS_CRC_ON_BYTES(n) ((void)0)
+#endif
+
+static inline uint32_t vsfs_crc32_update(uint32_t crc, const void *data, size_t n) {
+    VSFS_CRC_ON_BYTES(n);
+    return vsfs_crc_active(crc ^ 0xFFFFFFFFu, (const uint8_t *)data, n) ^ 0xFFFFFFFFu;
+}
+
+static inline uint32_t vsfs_crc32(const void *data, size_t n) {
+    return vsfs_crc32_update(0, data, n);
+}
+
+// checks every available kernel against a reference crc32() over assorted lengths and
+// alignments; returns 0 when they all agree, otherwise the number of mismatches
+static inline int vsfs_crc_selftest(uint32_t (*ref)(const void *, size_t)) {
+    enum { MAXLEN = 4096 + 64 };
+    uint8_t *buf = malloc(MAXLEN + 16);
+    if (!buf) return -1;
+    uint32_t x = 0x12345678u;
+    for (size_t i = 0; i < MAXLEN + 16; i++) { x = x * 1103515245u + 12345u; buf[i] = (uint8_t)(x >> 16); }
+
+    static const size_t lens[] = { 0, 1, 3, 7, 8, 15, 16, 17, 63, 64, 65, 120, 127, 128, 255, 1000, 4092, 4096, 4096 + 63 };
+    int bad = 0;
+    for (size_t k = 0; k < VSFS_CRC_NKERNELS; k++) {
+        if (!vsfs_crc_kernels[k].available) continue;
+        for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+            for (size_t off = 0; off < 16; off += 5) {
+                uint32_t want = ref(buf + off, lens[l]);
+                uint32_t got = vsfs_crc_kernels[k].fn(0xFFFFFFFFu, buf + off, lens[l]) ^ 0xFFFFFFFFu;
+                if (got != want) bad++;
+            }
+        }
+    }
+    free(buf);
+    return bad;
+}
+
+#endif
@@ -0,0 +1,294 @@
+// vsfs_format.h - on-disk layout shared by the MiniVSFS tools: the superblock,
+// inode and dirent records, plus the additions on top of the original format
+// (indirect block mapping for large files, the hashed directory index, the
+// write-ahead journal, compressed file data, packed small files and the free-space
+// summary).
+// Images that use none of the additions are exactly the original format.
+#ifndef VSFS_FORMAT_H
+#define VSFS_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define VSFS_BS 4096u
+#define VSFS_MAGIC 0x4D565346u
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+    uint32_t checksum;            // crc32(superblock[0..4091])
+} superblock_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;               // last access
+    uint64_t mtime;               // last content change
+    uint64_t ctime;               // last metadata change
+    uint32_t direct[12];          // direct pointers to data blocks
+    uint32_t reserved_0;          // single indirect block
+    uint32_t reserved_1;          // double indirect block
+    uint32_t reserved_2;          // inode flags (IFL_*)
+    uint32_t proj_id;
+    uint32_t uid16_gid16;         // lower 16 bits of uid and gid
+    uint64_t xattr_ptr;
+    uint64_t inode_crc;           // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+} inode_t;
+
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;                 // 1=file, 2=dir
+    char name[58];
+    uint8_t  checksum;            // XOR of bytes 0..62
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+_Static_assert(sizeof(inode_t) == 128, "inode size mismatch");
+_Static_assert(sizeof(dirent64_t) == 64, "dirent size mismatch");
+
+#define DIRECT_MAX 12
+// files larger than DIRECT_MAX blocks continue through reserved_0 (single indirect)
+// and reserved_1 (double indirect); pointer blocks hold absolute block numbers
+#define PTRS_PER_BLOCK (VSFS_BS / 4u)
+#define MAX_FILE_BLOCKS ((uint64_t)DIRECT_MAX + PTRS_PER_BLOCK + (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define DIRENTS_PER_BLOCK (VSFS_BS / 64u)
+
+// inode.reserved_2 holds per-inode flags
+#define IFL_DIRINDEX 0x1u       // directory with a hashed name index at xattr_ptr
+#define IFL_COMPRESSED 0x2u     // regular file stored as a compressed stream of xattr_ptr bytes
+#define IFL_INLINE 0x4u         // regular file whose bytes sit in the inode itself
+#define IFL_TAIL 0x8u           // regular file whose last partial block sits in a shared tail block
+
+// Compressed file data (IFL_COMPRESSED): the file's blocks hold a stream of
+// xattr_ptr bytes (so ceil(xattr_ptr / 4096) blocks are mapped) while size_bytes
+// stays the uncompressed size. The stream starts with zstream_hdr_t and
+// nclusters + 1 uint64_t offsets into the stream; cluster i covers file bytes
+// [i << cluster_shift, (i + 1) << cluster_shift) and is stored in stream bytes
+// [off[i], off[i + 1]), LZ4 block format (vsfs_lz.h), or raw when that is exactly
+// the cluster's length. Clusters are independent, so any range reads on its own.
+#define ZSTREAM_MAGIC 0x315A5356u   // "VSZ1"
+#define ZCLUSTER_SHIFT 16u          // 64 KiB clusters
+
+// Packed small files. IFL_INLINE: the size_bytes (at most VSFS_INLINE_MAX) bytes
+// of the file are stored from direct[0] on, over direct[] and reserved_0/1, and no
+// block is mapped (a zero-length file is inline too). IFL_TAIL: only the
+// size_bytes / 4096 whole blocks are mapped; the remaining size_bytes % 4096 bytes
+// sit at byte address xattr_ptr of the image, inside a tail block that fragments of
+// other files share. Fragments never cross a block boundary or overlap.
+#define VSFS_INLINE_MAX (offsetof(inode_t, reserved_2) - offsetof(inode_t, direct))
+
+// Hashed directory index: a contiguous run of blocks starting at the directory
+// inode's xattr_ptr. Block 0 holds dirindex_hdr_t; the following blocks are an
+// open-addressed table of dirindex_slot_t (linear probing, power-of-two size)
+// keyed by the FNV-1a hash of the entry name. pos is the entry's position in
+// the directory (block * DIRENTS_PER_BLOCK + slot) plus one.
+#define DIRINDEX_MAGIC 0x58494456u  // "VDIX"
+#define DIRINDEX_EMPTY 0u
+#define DIRINDEX_TOMB  0xFFFFFFFFu
+#define DIRINDEX_SLOTS_PER_BLOCK (VSFS_BS / 8u)
+#define DIRINDEX_MIN_SLOTS 1024u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t nslots;      // power of two
+    uint32_t used;        // live entries
+    uint32_t tombstones;  // deleted slots still in probe chains
+    uint32_t free_hint;   // lowest position that may hold a free dirent
+    uint8_t  pad[44];
+} dirindex_hdr_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t pos;         // DIRINDEX_EMPTY, DIRINDEX_TOMB or position + 1
+} dirindex_slot_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirindex_hdr_t)==64, "dirindex header size mismatch");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t cluster_shift;
+    uint64_t nclusters;
+} zstream_hdr_t;
+#pragma pack(pop)
+
+// bytes before the first cluster of a stream with n clusters
+static inline uint64_t zstream_table_bytes(uint64_t n) {
+    return sizeof(zstream_hdr_t) + (n + 1) * sizeof(uint64_t);
+}
+
+// hash of a dirent name (at most 58 bytes, NUL-terminated if shorter)
+static inline uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < 58 && name[i]; i++) { h ^= (uint8_t)name[i]; h *= 16777619u; }
+    return h;
+}
+
+// index size for a directory of `entries` names: at most half full, power of two
+static inline uint32_t dir_index_size_for(uint64_t entries) {
+    uint32_t n = DIRINDEX_MIN_SLOTS;
+    while ((uint64_t)n < entries * 2) n *= 2;
+    return n;
+}
+
+static inline uint64_t dir_index_blocks(uint32_t nslots) {
+    return 1 + nslots / DIRINDEX_SLOTS_PER_BLOCK;
+}
+
+// superblock.flags
+#define SBF_JOURNAL 0x1u        // write-ahead journal between the data bitmap and the inode table
+
+// Write-ahead journal (SBF_JOURNAL): the blocks from data_bitmap_start +
+// data_bitmap_blocks up to inode_table_start. Block 0 holds journal_hdr_t; from
+// block 1 on, transactions are logged back to back. A transaction is a descriptor
+// (journal_tx_t, then the home block number of every logged block as a uint64_t,
+// padded to whole blocks) followed by the logged blocks. Its crc covers the
+// descriptor (crc field zeroed) and the logged blocks, so a torn transaction is
+// simply not there. Replay applies, in order, the transactions from block 1 whose
+// seq runs head_seq, head_seq + 1, ... up to the first missing or damaged one.
+#define JOURNAL_MAGIC 0x4C4E4A56u     // "VJNL"
+#define JOURNAL_TX_MAGIC 0x58544A56u  // "VJTX"
+#define JOURNAL_MIN_BLOCKS 16u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t blocks;      // journal length, this block included
+    uint64_t head_seq;    // seq of the transaction at block 1; 0 = nothing to replay
+    uint64_t next_seq;    // no transaction was ever written with this seq or above
+    uint8_t  pad[32];
+} journal_hdr_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t seq;
+    uint64_t nblocks;     // logged blocks after the descriptor
+    uint64_t desc_blocks; // descriptor length in blocks
+} journal_tx_t;
+#pragma pack(pop)
+_Static_assert(sizeof(journal_hdr_t)==64, "journal header size mismatch");
+
+// descriptor length for a transaction logging n blocks
+static inline uint64_t journal_desc_blocks(uint64_t n) {
+    return (sizeof(journal_tx_t) + n * sizeof(uint64_t) + VSFS_BS - 1) / VSFS_BS;
+}
+
+// Free-space summary: sb_free_t at byte SB_FREE_OFFSET of block 0, past the
+// superblock fields but inside the bytes its checksum covers, followed by ngroups
+// uint32_t free-block counts, one per group of 1 << group_shift data blocks. A
+// group is one data bitmap block, or a power-of-two run of them on images too
+// large for one count each to fit. The original format zeroes the rest of block 0,
+// so an image without SBFREE_MAGIC there simply has its bitmaps counted on open.
+#define SBFREE_MAGIC 0x52465356u      // "VSFR"
+#define SB_FREE_OFFSET 128u
+#define SB_FREE_GROUP_SHIFT 15u       // data blocks one bitmap block covers, log2
+#define SB_FREE_GROUPS_MAX ((VSFS_BS - 4u - SB_FREE_OFFSET - 64u) / 4u)
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t ngroups;
+    uint64_t free_inodes;
+    uint64_t free_blocks;   // in the data region
+    uint64_t inode_hint;    // every inode below this index is in use
+    uint64_t block_hint;    // every data block below this (relative to the data region) is in use
+    uint32_t group_shift;
+    uint8_t  pad[20];
+} sb_free_t;
+#pragma pack(pop)
+_Static_assert(sizeof(sb_free_t)==64, "free-space summary header size mismatch");
+
+// group size (log2, in data blocks) for a data region of n blocks
+static inline uint32_t sb_free_group_shift(uint64_t n) {
+    uint32_t shift = SB_FREE_GROUP_SHIFT;
+    while (((n + (1ull << shift) - 1) >> shift) > SB_FREE_GROUPS_MAX) shift++;
+    return shift;
+}
+
+// Delta (mkfs_adder --delta, mkfs_patch): the blocks an update changed, to be
+// applied to the image the update started from. delta_hdr_t at the start of the
+// first block, the new contents of the nblocks blocks from the second block on,
+// then the nblocks delta_entry_t in ascending block order. base_hash lets the
+// apply step check every block before writing any of them; a block that already
+// holds its new contents is accepted too, so an interrupted apply can be rerun.
+#define DELTA_MAGIC 0x4C445356u       // "VSDL"
+#define DELTA_VERSION 2u
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t total_blocks;  // geometry of the base image
+    uint32_t base_sb_crc;   // superblock checksum of the base image
+    uint32_t new_sb_crc;    // superblock checksum once applied
+    uint64_t nblocks;
+    uint32_t entries_crc;   // CRC32 of the entry table
+    uint32_t hdr_crc;       // CRC32 of this header with hdr_crc zeroed
+    uint8_t  pad[24];
+} delta_hdr_t;
+
+typedef struct {
+    uint64_t block;
+    uint64_t base_hash;     // delta_block_hash() of the block in the base image
+    uint64_t new_hash;      // delta_block_hash() of its new contents
+} delta_entry_t;
+#pragma pack(pop)
+_Static_assert(sizeof(delta_hdr_t)==64, "delta header size mismatch");
+
+// identity of a block's contents in a delta. Not CRC32: every inode carries the
+// CRC32 of its own bytes, and CRC32 is linear, so an inode table block keeps the
+// same CRC32 however its inodes change and could not tell base from patched.
+static inline uint64_t delta_block_hash(const void *blk) {
+    const uint8_t *p = blk;
+    uint64_t h = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < VSFS_BS; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    return h ^ (h >> 33);
+}
+
+// blocks a regular file maps through direct[] and the indirect blocks
+static inline uint64_t inode_mapped_blocks(const inode_t *ino) {
+    if (ino->reserved_2 & IFL_INLINE) return 0;
+    if (ino->reserved_2 & IFL_TAIL) return ino->size_bytes / VSFS_BS;
+    uint64_t bytes = (ino->reserved_2 & IFL_COMPRESSED) ? ino->xattr_ptr : ino->size_bytes;
+    return bytes ? (bytes + VSFS_BS - 1) / VSFS_BS : 1; // an unpacked empty file still owns a block
+}
+
+// pointer blocks needed to map n data blocks
+static inline uint64_t pointer_blocks_for(uint64_t n) {
+    if (n <= DIRECT_MAX) return 0;
+    n -= DIRECT_MAX;
+    if (n <= PTRS_PER_BLOCK) return 1;
+    n -= PTRS_PER_BLOCK;
+    return 2 + (n + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK; // single + double + second-level blocks
+}
+
+#endif
@@ -0,0 +1,352 @@
+// vsfs_io.h - batched asynchronous block I/O for libminivsfs.
+// Callers queue reads and writes into a batch and then wait for the batch as a
+// whole; meanwhile up to VSFS_IO_DEPTH requests are in flight on one of three
+// engines, picked by vsfs_io_open():
+//   uring   - io_uring driven through raw syscalls (no liburing). Requests are
+//             handed to the kernel together when someone waits or the ring is full.
+//   threads - VSFS_IO_THREADS workers doing pread/pwrite
+//   sync    - each request runs in the caller as it is queued
+// VSFS_IO_ENGINE=<name> in the environment forces one; uring falls back to threads
+// where the kernel lacks it or a sandbox forbids it. A queue may be shared by
+// several threads, each waiting for its own batches. Short transfers are resumed
+// for the remainder, and a read that hits end of file fails with EIO. A request's
+// buffer must stay untouched until its batch has been waited for.
+#ifndef VSFS_IO_H
+#define VSFS_IO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define VSFS_IO_HAVE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#define VSFS_IO_DEPTH 64u       // requests in flight per queue
+#define VSFS_IO_THREADS 8       // workers of the threads engine
+#define VSFS_IO_MAX_REQ (1u << 30)
+
+// hook for I/O accounting (vsfs_stats.h defines it)
+#ifndef VSFS_IO_ON_BYTES
+#define VSFS_IO_ON_BYTES(write, n) ((void)0)
+#endif
+
+enum { VSFS_IO_SYNC, VSFS_IO_THREADS_POOL, VSFS_IO_URING };
+
+// a group of requests waited for together; zero it before the first request
+typedef struct {
+    unsigned pending;       // requests not completed yet
+    int err;                // errno of the first failure, 0 if none
+} vsfs_io_batch_t;
+
+typedef struct {
+    vsfs_io_batch_t *batch; // NULL = free slot
+    int fd;
+    int write;
+    uint8_t *buf;
+    size_t len, done;
+    uint64_t off;
+} vsfs_io_req_t;
+
+typedef struct {
+    int opened;
+    int engine;             // VSFS_IO_*
+    pthread_mutex_t lock;   // guards everything below
+    pthread_cond_t done;    // a request completed
+    vsfs_io_req_t req[VSFS_IO_DEPTH];
+    uint32_t free_slot[VSFS_IO_DEPTH];
+    unsigned nfree;
+
+    // threads: FIFO of queued slots
+    pthread_cond_t work;
+    pthread_t tids[VSFS_IO_THREADS];
+    int nthreads, stop;
+    uint32_t fifo[VSFS_IO_DEPTH];
+    unsigned fifo_head, fifo_count;
+
+#ifdef VSFS_IO_HAVE_URING
+    int ring_fd;
+    uint8_t *ring;          // SQ and CQ rings (one mapping)
+    size_t ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;     // SQEs filled but not yet passed to the kernel
+    int reaping;            // a thread is collecting completions with the lock dropped
+#endif
+} vsfs_io_t;
+
+static inline const char *vsfs_io_engine_name(const vsfs_io_t *io) {
+    return io->engine == VSFS_IO_URING ? "uring" : io->engine == VSFS_IO_THREADS_POOL ? "threads" : "sync";
+}
+
+// the whole transfer with plain pread/pwrite; returns the byte count or -errno
+static inline ssize_t vsfs_io_rw(int write, int fd, uint8_t *buf, size_t len, uint64_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write ? pwrite(fd, buf + done, len - done, (off_t)(off + done))
+                          : pread(fd, buf + done, len - done, (off_t)(off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+static inline void vsfs_io_batch_done(vsfs_io_batch_t *b, int err) {
+    if (err && !b->err) b->err = err;
+    b->pending--;
+}
+
+#ifdef VSFS_IO_HAVE_URING
+// fills an SQE for the rest of slot's transfer; called with the lock held
+static inline void vsfs_io_uring_prep(vsfs_io_t *io, uint32_t slot) {
+    vsfs_io_req_t *r = &io->req[slot];
+    unsigned tail = *io->sq_tail; // only written by us, under the lock
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    size_t left = r->len - r->done;
+    sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(r->buf + r->done);
+    sqe->len = (uint32_t)(left < VSFS_IO_MAX_REQ ? left : VSFS_IO_MAX_REQ);
+    sqe->off = r->off + r->done;
+    sqe->user_data = slot;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->to_submit++;
+}
+#endif
+
+// completes (or, for a short uring transfer, resumes) slot; res is bytes or -errno
+static inline void vsfs_io_finish(vsfs_io_t *io, uint32_t slot, ssize_t res) {
+    vsfs_io_req_t *r = &io->req[slot];
+    if (res > 0) {
+        VSFS_IO_ON_BYTES(r->write, res);
+        r->done += (size_t)res;
+    }
+#ifdef VSFS_IO_HAVE_URING
+    if (io->engine == VSFS_IO_URING && r->done < r->len && (res > 0 || res == -EINTR || res == -EAGAIN)) {
+        vsfs_io_uring_prep(io, slot);
+        return;
+    }
+#endif
+    vsfs_io_batch_done(r->batch, res < 0 ? (int)-res : r->done < r->len ? EIO : 0);
+    r->batch = NULL;
+    io->free_slot[io->nfree++] = slot;
+    pthread_cond_broadcast(&io->done);
+}
+
+#ifdef VSFS_IO_HAVE_URING
+// one round with the lock dropped: hands the queued SQEs to the kernel, waits for
+// at least one completion and finishes everything that completed
+static inline void vsfs_io_uring_round(vsfs_io_t *io) {
+    io->reaping = 1;
+    unsigned n = io->to_submit;
+    io->to_submit = 0;
+    pthread_mutex_unlock(&io->lock);
+    long ret = syscall(__NR_io_uring_enter, io->ring_fd, n, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    int err = ret < 0 ? errno : 0;
+    pthread_mutex_lock(&io->lock);
+    if (ret >= 0) {
+        io->to_submit += n - (unsigned)ret;
+    } else if (err == EINTR || err == EAGAIN || err == EBUSY) {
+        io->to_submit += n; // retried next round
+    } else {
+        // the ring is unusable: fail whatever the kernel has not taken yet
+        unsigned head = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE), tail = *io->sq_tail;
+        for (; head != tail; head++) {
+            uint32_t slot = (uint32_t)io->sqes[io->sq_array[head & *io->sq_mask]].user_data;
+            io->req[slot].done = io->req[slot].len; // no resubmission
+            vsfs_io_finish(io, slot, -err);
+        }
+        *io->sq_tail = __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+        io->to_submit = 0;
+    }
+    unsigned head = *io->cq_head;
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        vsfs_io_finish(io, (uint32_t)cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+    io->reaping = 0;
+    pthread_cond_broadcast(&io->done);
+}
+#endif
+
+// waits until some request completes; called with the lock held
+static inline void vsfs_io_progress(vsfs_io_t *io) {
+#ifdef VSFS_IO_HAVE_URING
+    if (io->engine == VSFS_IO_URING && !io->reaping) { vsfs_io_uring_round(io); return; }
+#endif
+    pthread_cond_wait(&io->done, &io->lock);
+}
+
+static inline void vsfs_io_queue(vsfs_io_t *io, vsfs_io_batch_t *b, int write, int fd, const void *buf, size_t len, uint64_t off) {
+    if (len == 0) return;
+    if (io->engine == VSFS_IO_SYNC) {
+        ssize_t n = vsfs_io_rw(write, fd, (uint8_t *)buf, len, off);
+        if (n > 0) VSFS_IO_ON_BYTES(write, n);
+        b->pending++;
+        vsfs_io_batch_done(b, n < 0 ? (int)-n : (size_t)n < len ? EIO : 0);
+        return;
+    }
+    pthread_mutex_lock(&io->lock);
+    while (io->nfree == 0) vsfs_io_progress(io);
+    uint32_t slot = io->free_slot[--io->nfree];
+    io->req[slot] = (vsfs_io_req_t){ .batch = b, .fd = fd, .write = write, .buf = (uint8_t *)buf, .len = len, .off = off };
+    b->pending++;
+#ifdef VSFS_IO_HAVE_URING
+    if (io->engine == VSFS_IO_URING) {
+        vsfs_io_uring_prep(io, slot);
+        pthread_mutex_unlock(&io->lock);
+        return;
+    }
+#endif
+    io->fifo[(io->fifo_head + io->fifo_count++) % VSFS_IO_DEPTH] = slot;
+    pthread_cond_signal(&io->work);
+    pthread_mutex_unlock(&io->lock);
+}
+
+// queue a read of len bytes at off into buf / a write of buf; results go to b
+static inline void vsfs_io_read(vsfs_io_t *io, vsfs_io_batch_t *b, int fd, void *buf, size_t len, uint64_t off) {
+    vsfs_io_queue(io, b, 0, fd, buf, len, off);
+}
+
+static inline void vsfs_io_write(vsfs_io_t *io, vsfs_io_batch_t *b, int fd, const void *buf, size_t len, uint64_t off) {
+    vsfs_io_queue(io, b, 1, fd, buf, len, off);
+}
+
+// waits for every request of b; 0, or -1 with errno set to the first failure.
+// The batch is zeroed again for reuse.
+static inline int vsfs_io_wait(vsfs_io_t *io, vsfs_io_batch_t *b) {
+    if (io->engine != VSFS_IO_SYNC) {
+        pthread_mutex_lock(&io->lock);
+        while (b->pending) vsfs_io_progress(io);
+        pthread_mutex_unlock(&io->lock);
+    }
+    int err = b->err;
+    b->err = 0;
+    if (err) { errno = err; return -1; }
+    return 0;
+}
+
+static inline void *vsfs_io_worker(void *arg) {
+    vsfs_io_t *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->fifo_count && !io->stop) pthread_cond_wait(&io->work, &io->lock);
+        if (!io->fifo_count) break;
+        uint32_t slot = io->fifo[io->fifo_head];
+        io->fifo_head = (io->fifo_head + 1) % VSFS_IO_DEPTH;
+        io->fifo_count--;
+        vsfs_io_req_t r = io->req[slot];
+        pthread_mutex_unlock(&io->lock);
+        ssize_t n = vsfs_io_rw(r.write, r.fd, r.buf, r.len, r.off);
+        pthread_mutex_lock(&io->lock);
+        vsfs_io_finish(io, slot, n);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+#ifdef VSFS_IO_HAVE_URING
+static inline int vsfs_io_uring_setup(vsfs_io_t *io) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, VSFS_IO_DEPTH, &p);
+    if (fd < 0) return -1;
+    // IORING_OP_READ/WRITE came with the probe interface (5.6); older kernels fall back
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    int ok = probe && (p.features & IORING_FEAT_SINGLE_MMAP) &&
+             syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->last_op >= IORING_OP_WRITE &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!ok) { close(fd); return -1; }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    io->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *ring = mmap(NULL, io->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) { close(fd); return -1; }
+    void *sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) { munmap(ring, io->ring_len); close(fd); return -1; }
+    io->ring_fd = fd;
+    io->ring = ring;
+    io->sqes = sqes;
+    io->sq_head = (unsigned *)(io->ring + p.sq_off.head);
+    io->sq_tail = (unsigned *)(io->ring + p.sq_off.tail);
+    io->sq_mask = (unsigned *)(io->ring + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *)(io->ring + p.sq_off.array);
+    io->cq_head = (unsigned *)(io->ring + p.cq_off.head);
+    io->cq_tail = (unsigned *)(io->ring + p.cq_off.tail);
+    io->cq_mask = (unsigned *)(io->ring + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *)(io->ring + p.cq_off.cqes);
+    return 0;
+}
+#endif
+
+// picks the engine (see the top of this file); never fails, sync being the last resort
+static inline void vsfs_io_open(vsfs_io_t *io) {
+    memset(io, 0, sizeof(*io));
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->done, NULL);
+    pthread_cond_init(&io->work, NULL);
+    for (uint32_t i = 0; i < VSFS_IO_DEPTH; i++) io->free_slot[i] = VSFS_IO_DEPTH - 1 - i;
+    io->nfree = VSFS_IO_DEPTH;
+    io->opened = 1;
+    const char *want = getenv("VSFS_IO_ENGINE");
+    if (want && strcmp(want, "uring") && strcmp(want, "threads") && strcmp(want, "sync")) want = NULL;
+#ifdef VSFS_IO_HAVE_URING
+    if ((!want || strcmp(want, "uring") == 0) && vsfs_io_uring_setup(io) == 0) {
+        io->engine = VSFS_IO_URING;
+        return;
+    }
+#endif
+    if (want && strcmp(want, "sync") == 0) return;
+    while (io->nthreads < VSFS_IO_THREADS && pthread_create(&io->tids[io->nthreads], NULL, vsfs_io_worker, io) == 0) io->nthreads++;
+    if (io->nthreads) io->engine = VSFS_IO_THREADS_POOL;
+}
+
+// releases the engine; every batch must have been waited for
+static inline void vsfs_io_close(vsfs_io_t *io) {
+    if (!io->opened) return;
+    if (io->engine == VSFS_IO_THREADS_POOL) {
+        pthread_mutex_lock(&io->lock);
+        io->stop = 1;
+        pthread_cond_broadcast(&io->work);
+        pthread_mutex_unlock(&io->lock);
+        for (int t = 0; t < io->nthreads; t++) pthread_join(io->tids[t], NULL);
+    }
+#ifdef VSFS_IO_HAVE_URING
+    if (io->engine == VSFS_IO_URING) {
+        munmap(io->sqes, io->sqes_len);
+        munmap(io->ring, io->ring_len);
+        close(io->ring_fd);
+    }
+#endif
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->done);
+    pthread_cond_destroy(&io->work);
+    io->opened = 0;
+}
+
+#endif
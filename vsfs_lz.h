@@ -0,0 +1,127 @@
+// vsfs_lz.h - self-contained LZ77 block codec for compressed file data.
+// The output is the LZ4 block format: a sequence is a token (high nibble literal
+// length, low nibble match length - 4, 15 = continued in following bytes of 255),
+// the literals, and a 2-byte little-endian match offset; the last sequence is
+// literals only. The compressor is a greedy single-probe hash matcher that skips
+// ahead faster the longer it goes without a match, so incompressible input costs
+// little. The decompressor checks every length and offset against both buffers
+// and never reads or writes out of bounds, whatever the input.
+#ifndef VSFS_LZ_H
+#define VSFS_LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define VSFS_LZ_MIN_MATCH 4
+#define VSFS_LZ_HASH_BITS 14
+#define VSFS_LZ_MAX_OFFSET 65535u
+#define VSFS_LZ_LAST_LITERALS 5   // a match never covers the final bytes
+#define VSFS_LZ_MF_LIMIT 12       // nor starts this close to the end
+
+static inline uint32_t vsfs_lz_load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t vsfs_lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - VSFS_LZ_HASH_BITS);
+}
+
+// writes a length continuation (the part above 15) as bytes of 255 and a remainder
+static inline uint8_t *vsfs_lz_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// compresses n bytes; returns the compressed length, or 0 when it would not fit in
+// cap bytes (the caller then stores the data raw)
+static inline size_t vsfs_lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << VSFS_LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    if (n > VSFS_LZ_MF_LIMIT) {
+        const uint8_t *mflimit = end - VSFS_LZ_MF_LIMIT;
+        const uint8_t *matchlimit = end - VSFS_LZ_LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t seq = vsfs_lz_load32(ip);
+            uint32_t h = vsfs_lz_hash(seq);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || (size_t)(ip - ref) > VSFS_LZ_MAX_OFFSET || vsfs_lz_load32(ref) != seq) {
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+            const uint8_t *mp = ip + VSFS_LZ_MIN_MATCH, *rp = ref + VSFS_LZ_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) { mp++; rp++; }
+            size_t lit = (size_t)(ip - anchor), mlen = (size_t)(mp - ip) - VSFS_LZ_MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = vsfs_lz_put_len(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t off = (size_t)(ip - ref);
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = vsfs_lz_put_len(op, mlen - 15);
+            ip = anchor = mp;
+        }
+    }
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = vsfs_lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+// reads a length continuation; returns 0 if the input ends inside it
+static inline int vsfs_lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+// decompresses n bytes into at most cap bytes; returns the decompressed length, or
+// -1 when the input is malformed or would not fit
+static inline long vsfs_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !vsfs_lz_get_len(&ip, iend, &lit)) return -1;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break; // the last sequence has no match
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !vsfs_lz_get_len(&ip, iend, &mlen)) return -1;
+        mlen += VSFS_LZ_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+        const uint8_t *m = op - off;
+        if (off >= mlen) memcpy(op, m, mlen);
+        else for (size_t i = 0; i < mlen; i++) op[i] = m[i]; // overlapping: repeats the last off bytes
+        op += mlen;
+    }
+    return (long)(op - dst);
+}
+
+#endif
@@ -0,0 +1,126 @@
+// vsfs_stats.h - per-phase timers and I/O counters behind --stats.
+// Everything is gated on vsfs_stats_on, so a run without --stats pays one
+// predictable branch per event; building with -DVSFS_NO_STATS removes even that.
+// Counters are updated with relaxed atomics because the builder's copy workers
+// share them; phase times are summed across threads, so in a parallel phase they
+// can exceed the wall clock.
+//
+// Include this before vsfs_crc.h, vsfs_bitmap.h and vsfs_io.h so their hooks count
+// CRC bytes, bitmap words and queued I/O. The counters are shared by the library and the CLI that links
+// it: exactly one translation unit (minivsfs.c) defines VSFS_STATS_IMPLEMENTATION
+// before including this header to hold them.
+#ifndef VSFS_STATS_H
+#define VSFS_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum {
+    PH_OPEN,    // opening the image, cloning it and reading the metadata region
+    PH_SCAN,    // walking the host tree (builder --from-dir)
+    PH_PLAN,    // planning the layout (builder --from-dir)
+    PH_ALLOC,   // bitmap searches
+    PH_DIR,     // directory lookups, slot reservation and entry writes
+    PH_COPY,    // moving host data into the image
+    PH_COMPRESS,// compressing file data (adder --compress)
+    PH_CRC,     // inode and superblock checksum finalization
+    PH_WRITE,   // writing metadata back
+    PH_COUNT
+} vsfs_phase_t;
+
+static const char *const vsfs_phase_names[PH_COUNT] = {
+    "open", "scan", "plan", "alloc", "dir", "copy", "comp", "crc", "write",
+};
+
+typedef struct {
+    uint64_t phase_ns[PH_COUNT];
+    uint64_t phase_calls[PH_COUNT];
+    uint64_t bytes_read;        // image and host bytes read, copy_file_range counted here too
+    uint64_t bytes_written;     // image bytes written
+    uint64_t bitmap_words;      // 64-bit bitmap words examined
+    uint64_t dirents_probed;    // dirents and index slots examined
+    uint64_t crc_bytes;         // bytes run through CRC32
+    uint64_t start_ns;
+} vsfs_stats_t;
+
+#ifdef VSFS_STATS_IMPLEMENTATION
+vsfs_stats_t vsfs_stats;
+int vsfs_stats_on;
+#else
+extern vsfs_stats_t vsfs_stats;
+extern int vsfs_stats_on;
+#endif
+
+static inline uint64_t vsfs_stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef VSFS_NO_STATS
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_BEGIN() ((uint64_t)0)
+#define STAT_END(ph, t0) ((void)(t0))
+#else
+#define STAT_ADD(field, n) \
+    do { if (vsfs_stats_on) __atomic_fetch_add(&vsfs_stats.field, (uint64_t)(n), __ATOMIC_RELAXED); } while (0)
+#define STAT_BEGIN() (vsfs_stats_on ? vsfs_stats_clock() : 0)
+#define STAT_END(ph, t0) \
+    do { if (vsfs_stats_on) { \
+        __atomic_fetch_add(&vsfs_stats.phase_ns[ph], vsfs_stats_clock() - (t0), __ATOMIC_RELAXED); \
+        __atomic_fetch_add(&vsfs_stats.phase_calls[ph], 1, __ATOMIC_RELAXED); } } while (0)
+#endif
+
+// hooks picked up by vsfs_crc.h, vsfs_bitmap.h and vsfs_io.h
+#define VSFS_CRC_ON_BYTES(n) STAT_ADD(crc_bytes, n)
+#define VSFS_BM_ON_WORDS(n) STAT_ADD(bitmap_words, n)
+#define VSFS_IO_ON_BYTES(write, n) \
+    do { if (write) STAT_ADD(bytes_written, n); else STAT_ADD(bytes_read, n); } while (0)
+
+// parses "--stats" / "--stats=json"; returns 1 if arg was a stats flag
+static inline int vsfs_stats_arg(const char *arg, int *json) {
+    if (strcmp(arg, "--stats") == 0) { vsfs_stats_on = 1; *json = 0; return 1; }
+    if (strcmp(arg, "--stats=json") == 0) { vsfs_stats_on = 1; *json = 1; return 1; }
+    return 0;
+}
+
+static inline void vsfs_stats_start(void) {
+    if (vsfs_stats_on) vsfs_stats.start_ns = vsfs_stats_clock();
+}
+
+// prints the summary (or one JSON object) to f; phases that never ran are left out
+static inline void vsfs_stats_report(FILE *f, const char *tool, int json) {
+    if (!vsfs_stats_on) return;
+    const vsfs_stats_t *s = &vsfs_stats;
+    double total_ms = (double)(vsfs_stats_clock() - s->start_ns) / 1e6;
+    if (json) {
+        fprintf(f, "{\"tool\": \"%s\", \"total_ms\": %.3f, \"phases\": {", tool, total_ms);
+        const char *sep = "";
+        for (int p = 0; p < PH_COUNT; p++) {
+            if (!s->phase_calls[p]) continue;
+            fprintf(f, "%s\"%s\": {\"ms\": %.3f, \"calls\": %llu}", sep, vsfs_phase_names[p],
+                    (double)s->phase_ns[p] / 1e6, (unsigned long long)s->phase_calls[p]);
+            sep = ", ";
+        }
+        fprintf(f, "}, \"bytes_read\": %llu, \"bytes_written\": %llu, \"bitmap_words\": %llu, "
+                   "\"dirents_probed\": %llu, \"crc_bytes\": %llu}\n",
+                (unsigned long long)s->bytes_read, (unsigned long long)s->bytes_written,
+                (unsigned long long)s->bitmap_words, (unsigned long long)s->dirents_probed,
+                (unsigned long long)s->crc_bytes);
+        return;
+    }
+    fprintf(f, "Stats (%s): %.3f ms total\n", tool, total_ms);
+    for (int p = 0; p < PH_COUNT; p++) {
+        if (!s->phase_calls[p]) continue;
+        fprintf(f, "  %-6s %10.3f ms  %8llu calls\n", vsfs_phase_names[p],
+                (double)s->phase_ns[p] / 1e6, (unsigned long long)s->phase_calls[p]);
+    }
+    fprintf(f, "  bytes read %llu, bytes written %llu, bitmap words %llu, dirents probed %llu, CRC bytes %llu\n",
+            (unsigned long long)s->bytes_read, (unsigned long long)s->bytes_written,
+            (unsigned long long)s->bitmap_words, (unsigned long long)s->dirents_probed,
+            (unsigned long long)s->crc_bytes);
+}
+
+#endif